@@ -0,0 +1,295 @@
+/*
+    cachetest: tests of the cache index and the garbage collection of TGE-FS
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#if HAVE_CONFIG
+ #include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string>
+#include <vector>
+#include <map>
+#include "tge_cache.h"
+#include "tge_index.h"
+#include "tge_keylock.h"
+#include "tge_log.h"
+#include "tge_priority.h"
+
+using namespace std;
+
+static int numberOfFailures = 0;
+
+#define CHECK(condition) \
+  do { \
+    if(!(condition)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+      numberOfFailures++; \
+    } \
+  } while(0)
+
+// no cache files are opened in the tests.
+class NoOpenedFileChecker : public Cache_LockedFileChecker {
+  mutable KeyLockTable lockedFiles;
+ public:
+  virtual bool isLockedFile(const std::string& fname) const { return false; }
+  virtual bool tryLockFile(const std::string& fname, KeyLockTable::Holder& holder) const {
+    return lockedFiles.tryLock(holder, fname.data(), fname.size());
+  }
+  virtual void unlockFile(KeyLockTable::Holder& holder) const { lockedFiles.unlock(holder); }
+};
+
+static NoOpenedFileChecker noOpenedFileChecker;
+
+// the name of a cache file, as tgefs names them by SHA-256 in upper-case hexadecimal digits.
+static string makeCacheFileName(const int number)
+{
+  char buffer[65];
+  snprintf(buffer, sizeof(buffer), "%064X", number * 2654435761u);
+  return buffer;
+}
+
+static string createCacheFile(const string& cacheRootDirectory, const string& cacheFileName, const size_t size)
+{
+  const string path = makeCacheFilePath(cacheRootDirectory, cacheFileName);
+  if(!ensureCacheFileDirectory(path))
+    return "";
+  const int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0600);
+  if(fd < 0)
+    return "";
+  const string data(size, 'x');
+  const bool succeeded = write(fd, data.data(), data.size()) == (ssize_t)data.size();
+  close(fd);
+  return succeeded ? path : "";
+}
+
+// starts a cache directory as tgefs does, and waits for the first scan.
+static void startCacheDirectory(CacheGarbageCollection& gc, const string& cacheRootDirectory)
+{
+  const int limitInKBytes = 1024 * 1024 * 1024; // 1Tbytes, so that nothing is evicted
+  gc.init(cacheRootDirectory.c_str(), limitInKBytes, limitInKBytes);
+  CHECK(gc.startEvictionThread(&noOpenedFileChecker));
+  for(int i = 0; i < 1000 && gc.getStatisticsText().find("validated=1") == string::npos; i++)
+    usleep(10 * 1000);
+  CHECK(gc.getStatisticsText().find("validated=1") != string::npos);
+  gc.stopEvictionThread();
+}
+
+class CacheFileNameCollector : public CacheFileIndex_Visitor {
+ public:
+  map<string, string> originalFullPathNames;
+  virtual void visit(const std::string& cacheFileName, const std::string& originalFullPathName, const CacheFileMetadata& metadata) {
+    originalFullPathNames[cacheFileName] = originalFullPathName;
+  }
+};
+
+// the names visited in the index are those of the cache files.
+static void testIndexNames(const string& directory)
+{
+  const string cacheRootDirectory = directory + "/index";
+  CHECK(mkdir(cacheRootDirectory.c_str(), 0700) == 0);
+  const string cacheFileName = makeCacheFileName(1);
+  const string path = createCacheFile(cacheRootDirectory, cacheFileName, 100);
+  CHECK(!path.empty());
+  CacheFileIndex index;
+  bool isCreated;
+  CHECK(index.open(cacheRootDirectory + "/localfiles", &isCreated));
+  CHECK(index.put(cacheFileName, "/data/a", CacheFileMetadata()));
+  CacheFileNameCollector collector;
+  index.visit(collector);
+  CHECK(collector.originalFullPathNames.size() == 1);
+  CHECK(collector.originalFullPathNames.count(cacheFileName) == 1);
+  CHECK(makeCacheFilePath(cacheRootDirectory, collector.originalFullPathNames.begin()->first) == path);
+  CHECK(access(makeCacheFilePath(cacheRootDirectory, collector.originalFullPathNames.begin()->first).c_str(), F_OK) == 0);
+}
+
+// the original paths survive the scans of the cache directory.
+static void testOriginalPathsSurviveScans(const string& directory)
+{
+  const string cacheRootDirectory = directory + "/scan";
+  CHECK(mkdir(cacheRootDirectory.c_str(), 0700) == 0);
+  const string cacheFileName = makeCacheFileName(2);
+  const string path = createCacheFile(cacheRootDirectory, cacheFileName, 100);
+  CHECK(!path.empty());
+  {
+    CacheGarbageCollection gc;
+    startCacheDirectory(gc, cacheRootDirectory);
+    gc.registerCacheEntry(path, getuid());
+    gc.appendLocalFileCollection(path, "/data/b", SourceFileAttributes());
+    gc.collect(noOpenedFileChecker);
+    CHECK(gc.getOriginalFullPathName(path) == "/data/b");
+  }
+  {
+    // restarted
+    CacheGarbageCollection gc;
+    startCacheDirectory(gc, cacheRootDirectory);
+    CHECK(gc.getOriginalFullPathName(path) == "/data/b");
+  }
+}
+
+// the cache files are accounted to the user who fetched them, even after a restart.
+static void testOwnersSurviveScans(const string& directory)
+{
+  if(getuid() != 0)
+    return; // the cache files are accounted to their owners unless tgefs runs as root.
+  const string cacheRootDirectory = directory + "/owner";
+  CHECK(mkdir(cacheRootDirectory.c_str(), 0700) == 0);
+  const string path = createCacheFile(cacheRootDirectory, makeCacheFileName(3), 100);
+  CHECK(!path.empty());
+  const uid_t owner = 4321;
+  {
+    CacheGarbageCollection gc;
+    startCacheDirectory(gc, cacheRootDirectory);
+    gc.registerCacheEntry(path, owner);
+    gc.appendLocalFileCollection(path, "/data/c", SourceFileAttributes());
+    CacheEntry entry;
+    CHECK(gc.getCacheEntry(path, entry) && entry.owner == owner);
+  }
+  {
+    // restarted
+    CacheGarbageCollection gc;
+    startCacheDirectory(gc, cacheRootDirectory);
+    CacheEntry entry;
+    CHECK(gc.getCacheEntry(path, entry) && entry.owner == owner);
+    gc.collect(noOpenedFileChecker);
+    CHECK(gc.getCacheEntry(path, entry) && entry.owner == owner);
+  }
+}
+
+// a user over the quota loses the least recently used files until the usage gets under the quota,
+// while the other users keep theirs, as nothing else has to be collected.
+static void testQuota(const string& directory)
+{
+  if(getuid() != 0)
+    return; // the quotas take effect only when tgefs runs as root.
+  const string cacheRootDirectory = directory + "/quota";
+  CHECK(mkdir(cacheRootDirectory.c_str(), 0700) == 0);
+  const uid_t heavyUser = 4321;
+  const uid_t lightUser = 4322;
+  vector<string> heavyUserPaths;
+  vector<string> lightUserPaths;
+  for(int i = 0; i < 5; i++) {
+    const string path = createCacheFile(cacheRootDirectory, makeCacheFileName(10 + i), 100);
+    CHECK(!path.empty());
+    (i < 3 ? heavyUserPaths : lightUserPaths).push_back(path);
+  }
+  CacheGarbageCollection gc;
+  startCacheDirectory(gc, cacheRootDirectory);
+  for(unsigned int i = 0; i < heavyUserPaths.size(); i++)
+    gc.registerCacheEntry(heavyUserPaths[i], heavyUser);
+  for(unsigned int i = 0; i < lightUserPaths.size(); i++)
+    gc.registerCacheEntry(lightUserPaths[i], lightUser);
+  CacheGarbageCollection::userQuotasInBytes[heavyUser] = 250;
+  gc.collect(noOpenedFileChecker);
+  CacheGarbageCollection::userQuotasInBytes.clear();
+  CHECK(access(heavyUserPaths[0].c_str(), F_OK) != 0);
+  CHECK(access(heavyUserPaths[1].c_str(), F_OK) == 0);
+  CHECK(access(heavyUserPaths[2].c_str(), F_OK) == 0);
+  for(unsigned int i = 0; i < lightUserPaths.size(); i++)
+    CHECK(access(lightUserPaths[i].c_str(), F_OK) == 0);
+}
+
+// a file fetched into the cache is listed with its entry in the in-memory index.
+static void testListing(const string& directory)
+{
+  const string cacheRootDirectory = directory + "/list";
+  CHECK(mkdir(cacheRootDirectory.c_str(), 0700) == 0);
+  CacheGarbageCollection gc;
+  startCacheDirectory(gc, cacheRootDirectory);
+  const string path = createCacheFile(cacheRootDirectory, makeCacheFileName(30), 100);
+  CHECK(!path.empty());
+  gc.registerCacheEntry(path, getuid());
+  gc.appendLocalFileCollection(path, "/data/d", SourceFileAttributes());
+  vector<CacheListEntry> entries;
+  unsigned long long position = 0;
+  while(gc.listCacheEntries(&position, 16, entries))
+    ;
+  CHECK(entries.size() == 1);
+  if(entries.size() != 1)
+    return;
+  CHECK(entries[0].localCacheFileName == path);
+  CHECK(entries[0].originalFullPathName == "/data/d");
+  CHECK(entries[0].isIndexed);
+  CHECK(entries[0].entry.size == 100);
+  CHECK(entries[0].metadata.size == 100);
+}
+
+static bool isPinned(CacheGarbageCollection& gc, const string& path)
+{
+  CacheEntry entry;
+  return gc.getCacheEntry(path, entry) && entry.isPinned;
+}
+
+// the pinned files stay pinned after a restart, and after a change of the rules of other files.
+static void testPinsSurviveRestartsAndRuleChanges(const string& directory)
+{
+  const string cacheRootDirectory = directory + "/pin";
+  CHECK(mkdir(cacheRootDirectory.c_str(), 0700) == 0);
+  const string pinnedPath = createCacheFile(cacheRootDirectory, makeCacheFileName(20), 100);
+  const string otherPath  = createCacheFile(cacheRootDirectory, makeCacheFileName(21), 100);
+  CHECK(!pinnedPath.empty() && !otherPath.empty());
+  {
+    CachePriorityRules rules;
+    rules.init(cacheRootDirectory.c_str());
+    CHECK(rules.execute("pin /data/reference"));
+    CacheGarbageCollection gc;
+    gc.setPriorityClassifier(&rules);
+    startCacheDirectory(gc, cacheRootDirectory);
+    gc.registerCacheEntry(pinnedPath, getuid());
+    gc.appendLocalFileCollection(pinnedPath, "/data/reference/genome.fa", SourceFileAttributes());
+    gc.registerCacheEntry(otherPath, getuid());
+    gc.appendLocalFileCollection(otherPath, "/data/tmp/reads.fq", SourceFileAttributes());
+    gc.collect(noOpenedFileChecker);
+    CHECK(isPinned(gc, pinnedPath));
+    CHECK(!isPinned(gc, otherPath));
+  }
+  {
+    // restarted
+    CachePriorityRules rules;
+    rules.init(cacheRootDirectory.c_str());
+    CacheGarbageCollection gc;
+    gc.setPriorityClassifier(&rules);
+    startCacheDirectory(gc, cacheRootDirectory);
+    gc.collect(noOpenedFileChecker);
+    CHECK(isPinned(gc, pinnedPath));
+    CHECK(!isPinned(gc, otherPath));
+    CHECK(rules.execute("scratch /data/tmp"));
+    gc.collect(noOpenedFileChecker);
+    CHECK(isPinned(gc, pinnedPath));
+    CacheEntry entry;
+    CHECK(gc.getCacheEntry(otherPath, entry) && entry.priorityClass == PRIORITY_SCRATCH);
+  }
+}
+
+int main(int argc, char** argv)
+{
+  loglevel(-1);
+  char directoryTemplate[] = "/tmp/cachetest.XXXXXX";
+  const char* directory = mkdtemp(directoryTemplate);
+  if(directory == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  testIndexNames(directory);
+  testOriginalPathsSurviveScans(directory);
+  testOwnersSurviveScans(directory);
+  testQuota(directory);
+  testListing(directory);
+  testPinsSurviveRestartsAndRuleChanges(directory);
+  const string command = string("rm -rf ") + directory;
+  if(system(command.c_str()) != 0)
+    fprintf(stderr, "Could not remove '%s'.\n", directory);
+  if(0 < numberOfFailures) {
+    fprintf(stderr, "%d checks failed.\n", numberOfFailures);
+    return 1;
+  }
+  printf("All tests passed.\n");
+  return 0;
+}
@@ -0,0 +1,141 @@
+/*
+    keylockbench: contention benchmark of the cache file locks of TGE-FS
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#if HAVE_CONFIG
+ #include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <string>
+#include <vector>
+#include <set>
+#include "pmutex.h"
+#include "ppthread.h"
+#include "tge_keylock.h"
+
+using namespace std;
+
+// The lock of older versions: one mutex and a set of the locked names, and every unlock
+// wakes up all the waiting threads.
+class GlobalKeyLock {
+  Mutex             locked_mutex;
+  ConditionVariable locked_cond;
+  set<string>       lockedKeys;
+ public:
+  void lock(const string& key) {
+    Mutex::scoped_lock lock(locked_mutex);
+    while(0 < lockedKeys.count(key))
+      locked_cond.wait(locked_mutex);
+    lockedKeys.insert(key);
+  }
+  void unlock(const string& key) {
+    Mutex::scoped_lock lock(locked_mutex);
+    lockedKeys.erase(key);
+    locked_cond.signalAll();
+  }
+};
+
+static GlobalKeyLock globalKeyLock;
+static KeyLockTable  keyLockTable;
+
+static vector<string> keys;
+static int            numberOfOperationsPerThread = 100000;
+static int            workInsideLock              = 100;
+static bool           isStriped                   = true;
+
+static volatile unsigned int workSink = 0;
+
+static void work(unsigned int seed)
+{
+  for(int i = 0; i < workInsideLock; i++)
+    seed = seed * 1103515245u + 12345u;
+  workSink += seed;
+}
+
+class BenchmarkThread : public PThread {
+  unsigned int seed;
+ public:
+  BenchmarkThread(const unsigned int seed) : seed(seed) {}
+  virtual void run() {
+    for(int i = 0; i < numberOfOperationsPerThread; i++) {
+      seed = seed * 1103515245u + 12345u;
+      // the names in tgefs are made by the path, so the cached name is copied as tgefs does.
+      const string key = keys[(seed >> 8) % keys.size()];
+      if(isStriped) {
+	KeyLockTable::Holder holder;
+	keyLockTable.lock(holder, key.data(), key.size());
+	work(seed);
+	keyLockTable.unlock(holder);
+      } else {
+	globalKeyLock.lock(key);
+	work(seed);
+	globalKeyLock.unlock(key);
+      }
+    }
+  }
+};
+
+static double getTime()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static double runBenchmark(const int numberOfThreads)
+{
+  vector<BenchmarkThread*> threads;
+  const double startTime = getTime();
+  for(int i = 0; i < numberOfThreads; i++) {
+    threads.push_back(new BenchmarkThread(i * 2654435761u + 1));
+    threads.back()->start();
+  }
+  for(int i = 0; i < numberOfThreads; i++) {
+    threads[i]->join();
+    delete threads[i];
+  }
+  return getTime() - startTime;
+}
+
+int main(int argc, char** argv)
+{
+  if(argc < 3) {
+    fprintf(stderr, "Contention benchmark of the cache file locks of TGE-FS.\n"
+	            "usage: keylockbench <threads> <keys> [operations per thread] [work inside the lock]\n"
+	            "  Each thread locks a random key out of <keys> and unlocks it, with the global lock\n"
+	            "  of older versions and with the striped lock table.\n");
+    return 1;
+  }
+  const int numberOfThreads = atoi(argv[1]);
+  const int numberOfKeys    = atoi(argv[2]);
+  if(3 < argc) numberOfOperationsPerThread = atoi(argv[3]);
+  if(4 < argc) workInsideLock              = atoi(argv[4]);
+  if(numberOfThreads <= 0 || numberOfKeys <= 0 || numberOfOperationsPerThread <= 0) {
+    fprintf(stderr, "The numbers must be positive.\n");
+    return 1;
+  }
+  for(int i = 0; i < numberOfKeys; i++) {
+    char buffer[80];
+    sprintf(buffer, "%064X", i * 2654435761u);
+    keys.push_back(buffer);
+  }
+  const double totalOperations = (double)numberOfThreads * numberOfOperationsPerThread;
+  printf("threads=%d keys=%d operations=%.0f work=%d\n", numberOfThreads, numberOfKeys, totalOperations, workInsideLock);
+  isStriped = false;
+  const double globalTime = runBenchmark(numberOfThreads);
+  printf("global:  %8.3f sec %12.0f locks/sec\n", globalTime, totalOperations / globalTime);
+  isStriped = true;
+  const double stripedTime = runBenchmark(numberOfThreads);
+  printf("striped: %8.3f sec %12.0f locks/sec\n", stripedTime, totalOperations / stripedTime);
+  long long numberOfLocks, numberOfWaits;
+  keyLockTable.getStatistics(&numberOfLocks, &numberOfWaits);
+  printf("striped: %lld of %lld locks waited for the key\n", numberOfWaits, numberOfLocks);
+  return 0;
+}
@@ -5,6 +5,8 @@
 
 class LZO
 {
+  friend class ParallelLZO;
+
   static const unsigned long lzo_inblock_length;
   static const unsigned long lzo_outblock_length;
   static const unsigned long lzo_filebuffer_length;
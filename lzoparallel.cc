@@ -0,0 +1,542 @@
+#if HAVE_CONFIG
+ #include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "lzocomp.h"
+#include "lzoparallel.h"
+#include "minilz4.h"
+
+using namespace std;
+
+int ParallelLZO::defaultNumberOfThreads = 0;
+int ParallelLZO::defaultFormatVersion   = 1;
+
+const char ParallelLZO::TRAILER_MAGIC[4] = {'L', 'Z', 'O', 'I'};
+
+struct ParallelLZO::BlockHeader {  // 12 bytes
+  int                storedLength;     // negated when the data is stored uncompressed. all zero ends the blocks.
+  unsigned int       rawLength;
+  unsigned int       checksum;         // Adler-32 of the uncompressed data
+};
+
+struct ParallelLZO::IndexEntry {   // 16 bytes
+  unsigned long long offset;           // of the BlockHeader, from the first block
+  unsigned long long uncompressedSize;
+};
+
+struct ParallelLZO::Trailer {      // 24 bytes
+  unsigned long long numberOfBlocks;
+  unsigned long long indexOffset;      // from the first block
+  unsigned int       indexChecksum;    // Adler-32 of the index
+  char               magic[4];
+};
+
+// the initial value of an Adler-32 checksum
+static const lzo_uint32 ADLER32_INIT = 1;
+// data is regarded as incompressible when it does not shrink below this ratio.
+static const double    MAXIMUM_COMPRESSED_RATIO         = 0.97;
+// the number of the compressed blocks, from which the ratio is estimated while compressing a file
+static const int       NUMBER_OF_BLOCKS_TO_ESTIMATE     = 8;
+// while the blocks are stored uncompressed, one block in this number is compressed to see the ratio.
+static const long long RAW_BLOCKS_PROBE_INTERVAL        = 32;
+// isWorthCompressing() samples a file of this size or more.
+static const off_t     MINIMUM_FILE_SIZE_TO_SAMPLE      = 1024 * 1024;
+static const int       NUMBER_OF_SAMPLES                = 8;
+static const lzo_uint  SAMPLE_LENGTH                    = 64 * 1024;
+// the work memory of a worker, for either of the algorithms
+static const size_t WORK_MEMORY_LENGTH = LZO1X_1_MEM_COMPRESS < MINILZ4_MEM_COMPRESS ? MINILZ4_MEM_COMPRESS : LZO1X_1_MEM_COMPRESS;
+
+ParallelLZO::Worker::Worker(ParallelLZO& owner) : owner(owner)
+{
+  work = new unsigned char[WORK_MEMORY_LENGTH];
+}
+
+ParallelLZO::Worker::~Worker()
+{
+  delete[] work;
+}
+
+void ParallelLZO::Worker::run()
+{
+  Mutex::scoped_lock lock(owner.blocks_mutex);
+  while(true) {
+    while(owner.numberOfClaimedBlocks == owner.numberOfReadBlocks && !owner.isTerminating)
+      owner.read_cond.wait(owner.blocks_mutex);
+    if(owner.isTerminating)
+      break;
+    Block& block = owner.blocks[owner.numberOfClaimedBlocks++ % owner.blocks.size()];
+    lock.unlock();
+    if(owner.isDecompressing)
+      decompressBlock(block, owner.formatVersion, owner.algorithm);
+    else
+      compressBlock(block, work, owner.formatVersion, owner.algorithm);
+    lock.lock();
+    block.isProcessed = true;
+    owner.processed_cond.signal();
+  }
+}
+
+void ParallelLZO::Writer::run()
+{
+  Mutex::scoped_lock lock(owner.blocks_mutex);
+  while(true) {
+    while(owner.numberOfWrittenBlocks == owner.numberOfReadBlocks && !owner.isEndOfInput && !owner.isFailed && !owner.isTerminating)
+      owner.processed_cond.wait(owner.blocks_mutex);
+    if(owner.isFailed || owner.isTerminating || owner.numberOfWrittenBlocks == owner.numberOfReadBlocks)
+      break;
+    Block& block = owner.blocks[owner.numberOfWrittenBlocks % owner.blocks.size()];
+    while(!block.isProcessed && !owner.isTerminating)
+      owner.processed_cond.wait(owner.blocks_mutex);
+    if(owner.isTerminating)
+      break;
+    lock.unlock();
+    const bool succeeded = writeDecodedBlock(outfd, block);
+    lock.lock();
+    if(!succeeded)
+      owner.isFailed = true;
+    owner.numberOfWrittenBlocks++;
+    owner.written_cond.signal();
+  }
+}
+
+void ParallelLZO::compressBlock(Block& block, unsigned char* work, const int formatVersion, const int algorithm)
+{
+  const size_t headerLength = formatVersion == 2 ? sizeof(BlockHeader) : sizeof(int);
+  lzo_uint out_len;
+  if(block.isRaw) {
+    out_len = block.inLength;
+  } else if(algorithm == ALGORITHM_LZ4) {
+    unsigned long lz4_out_len;
+    minilz4_compress(block.in, block.inLength, block.out + headerLength, &lz4_out_len, work);
+    out_len = lz4_out_len;
+  } else {
+    lzo1x_1_compress(block.in, block.inLength, block.out + headerLength, &out_len, work);
+  }
+  int size;
+  if(out_len >= block.inLength) {
+    // incompressible
+    size = -(int)block.inLength;
+    memcpy(block.out + headerLength, block.in, block.inLength);
+    block.outLength = headerLength + block.inLength;
+  } else {
+    // compressed
+    size = out_len;
+    block.outLength = headerLength + out_len;
+  }
+  if(formatVersion == 2) {
+    BlockHeader header;
+    header.storedLength = size;
+    header.rawLength    = block.inLength;
+    header.checksum     = lzo_adler32(ADLER32_INIT, block.in, block.inLength);
+    memcpy(block.out, &header, sizeof(header));
+  } else {
+    memcpy(block.out, &size, sizeof(int));
+  }
+}
+
+void ParallelLZO::decompressBlock(Block& block, const int formatVersion, const int algorithm)
+{
+  if(!block.isRaw) {
+    if(algorithm == ALGORITHM_LZ4) {
+      unsigned long out_len = LZO::lzo_outblock_length;
+      const int result = minilz4_decompress_safe(block.in, block.inLength, block.out, &out_len);
+      block.outLength = out_len;
+      block.isFailed  = result != MINILZ4_E_OK;
+    } else {
+      lzo_uint out_len = LZO::lzo_outblock_length;
+      const int result = lzo1x_decompress_safe(block.in, block.inLength, block.out, &out_len, NULL);
+      block.outLength = out_len;
+      block.isFailed  = result != LZO_E_OK;
+    }
+  }
+  if(formatVersion == 2 && !block.isFailed) {
+    const unsigned char* data   = block.isRaw ? block.in       : block.out;
+    const lzo_uint       length = block.isRaw ? block.inLength : block.outLength;
+    block.isFailed = length != block.rawLength || lzo_adler32(ADLER32_INIT, data, length) != block.checksum;
+  }
+}
+
+bool ParallelLZO::writeDecodedBlock(const int outfd, const Block& block)
+{
+  if(block.isFailed)
+    return false;
+  if(block.isRaw)
+    return writeFully(outfd, block.in, block.inLength);
+  return writeFully(outfd, block.out, block.outLength);
+}
+
+bool ParallelLZO::writeFully(const int outfd, const unsigned char* data, lzo_uint length)
+{
+  lzo_uint writtenBytes = 0;
+  while(writtenBytes < length) {
+    const ssize_t result = write(outfd, data + writtenBytes, length - writtenBytes);
+    if(result == -1) {
+      if(errno == EINTR)
+	continue;
+      return false;
+    }
+    writtenBytes += result;
+  }
+  return true;
+}
+
+// returns the number of the bytes read, which is less than length only at the end of the file, or -1 on an error.
+ssize_t ParallelLZO::readFully(const int infd, unsigned char* data, lzo_uint length)
+{
+  lzo_uint readBytes = 0;
+  while(readBytes < length) {
+    const ssize_t result = read(infd, data + readBytes, length - readBytes);
+    if(result == -1 && errno == EINTR)
+      continue;
+    if(result == -1)
+      return -1;
+    if(result == 0)
+      break;
+    readBytes += result;
+  }
+  return readBytes;
+}
+
+ParallelLZO::ParallelLZO(const int numberOfThreads)
+  : numberOfThreads(numberOfThreads), formatVersion(defaultFormatVersion), algorithm(ALGORITHM_LZO), isDecompressing(false), numberOfReadBlocks(0ll), numberOfClaimedBlocks(0ll),
+    numberOfWrittenBlocks(0ll), isEndOfInput(false), isFailed(false), isTerminating(false)
+{
+  if(lzo_init() != LZO_E_OK) {
+    fprintf(stderr, "LZO init error\n");
+    exit(1);
+  }
+  if(this->numberOfThreads <= 0) {
+    const long numberOfProcessors = sysconf(_SC_NPROCESSORS_ONLN);
+    this->numberOfThreads = 0 < numberOfProcessors ? (int)numberOfProcessors : 1;
+  }
+}
+
+ParallelLZO::~ParallelLZO()
+{
+}
+
+bool ParallelLZO::startThreads(vector<PThread*>& threads, const int numberOfWorkers, const size_t inLength, const size_t outLength)
+{
+  // two blocks for each worker, so that one can be read or written while the other is processed.
+  blocks.resize(numberOfWorkers <= 0 ? 1 : numberOfWorkers * 2);
+  for(size_t i = 0; i < blocks.size(); i++) {
+    blocks[i].in          = new unsigned char[inLength];
+    blocks[i].out         = new unsigned char[outLength];
+    blocks[i].inLength    = 0;
+    blocks[i].outLength   = 0;
+    blocks[i].rawLength   = 0;
+    blocks[i].checksum    = 0;
+    blocks[i].isRaw       = false;
+    blocks[i].isProcessed = false;
+    blocks[i].isFailed    = false;
+  }
+  numberOfReadBlocks    = 0;
+  numberOfClaimedBlocks = 0;
+  numberOfWrittenBlocks = 0;
+  isEndOfInput          = false;
+  isFailed              = false;
+  isTerminating         = false;
+  for(int i = 0; i < numberOfWorkers; i++) {
+    Worker* worker = new Worker(*this);
+    if(!worker->start()) {
+      delete worker;
+      break;
+    }
+    threads.push_back(worker);
+  }
+  return !threads.empty();
+}
+
+void ParallelLZO::stopThreads(vector<PThread*>& threads)
+{
+  {
+    Mutex::scoped_lock lock(blocks_mutex);
+    isTerminating = true;
+    read_cond.signalAll();
+    processed_cond.signalAll();
+  }
+  for(size_t i = 0; i < threads.size(); i++) {
+    threads[i]->join();
+    delete threads[i];
+  }
+  threads.clear();
+  for(size_t i = 0; i < blocks.size(); i++) {
+    delete[] blocks[i].in;
+    delete[] blocks[i].out;
+  }
+  blocks.clear();
+}
+
+bool ParallelLZO::compress(const int infd, const int outfd, const int formatVersion, const int algorithm)
+{
+  if(!isSupportedFormatVersion(formatVersion) || !isSupportedAlgorithm(algorithm))
+    return false;
+  this->formatVersion = formatVersion;
+  this->algorithm     = algorithm;
+  isDecompressing     = false;
+  int numberOfWorkers = numberOfThreads <= 1 ? 0 : numberOfThreads;
+  {
+    // a file of a few blocks is not worth the threads.
+    struct stat st;
+    if(fstat(infd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size <= (off_t)(2 * LZO::lzo_inblock_length))
+      numberOfWorkers = 0;
+  }
+  vector<PThread*> threads;
+  startThreads(threads, numberOfWorkers, LZO::lzo_inblock_length, sizeof(BlockHeader) + LZO::lzo_outblock_length);
+  // without the workers, the calling thread compresses the blocks by itself.
+  unsigned char* work = threads.empty() ? new unsigned char[WORK_MEMORY_LENGTH] : NULL;
+  vector<IndexEntry> index;
+  unsigned long long offset = 0;
+  // the ratio of the last compressed blocks tells if the following blocks are worth compressing.
+  const lzo_uint headerLength = formatVersion == 2 ? sizeof(BlockHeader) : sizeof(int);
+  bool     isStoringRaw             = false;
+  int      estimatedBlocks          = 0;
+  lzo_uint estimatedBytes           = 0;
+  lzo_uint estimatedCompressedBytes = 0;
+  bool succeeded   = true;
+  bool isEndOfFile = false;
+  while(succeeded) {
+    // reads the blocks as long as there is a free one.
+    while(!isEndOfFile && numberOfReadBlocks - numberOfWrittenBlocks < (long long)blocks.size()) {
+      Block& block = blocks[numberOfReadBlocks % blocks.size()];
+      const ssize_t readBytes = readFully(infd, block.in, LZO::lzo_inblock_length);
+      if(readBytes == -1) {
+	succeeded = false;
+	break;
+      }
+      if((lzo_uint)readBytes < LZO::lzo_inblock_length)
+	isEndOfFile = true;
+      if(readBytes == 0)
+	break;
+      block.inLength    = readBytes;
+      block.isRaw       = isStoringRaw && numberOfReadBlocks % RAW_BLOCKS_PROBE_INTERVAL != 0;
+      block.isProcessed = false;
+      if(work != NULL) {
+	compressBlock(block, work, formatVersion, algorithm);
+	block.isProcessed = true;
+      }
+      Mutex::scoped_lock lock(blocks_mutex);
+      numberOfReadBlocks++;
+      read_cond.signal();
+    }
+    if(!succeeded || numberOfWrittenBlocks == numberOfReadBlocks)
+      break;
+    // writes the oldest block when it is compressed.
+    Block& block = blocks[numberOfWrittenBlocks % blocks.size()];
+    {
+      Mutex::scoped_lock lock(blocks_mutex);
+      while(!block.isProcessed)
+	processed_cond.wait(blocks_mutex);
+    }
+    if(!writeFully(outfd, block.out, block.outLength))
+      succeeded = false;
+    if(!block.isRaw) {
+      estimatedBlocks++;
+      estimatedBytes           += block.inLength;
+      estimatedCompressedBytes += block.outLength - headerLength;
+      // while storing the blocks raw, a compressed block alone decides.
+      if(isStoringRaw || NUMBER_OF_BLOCKS_TO_ESTIMATE <= estimatedBlocks) {
+	isStoringRaw = estimatedBytes * MAXIMUM_COMPRESSED_RATIO <= estimatedCompressedBytes;
+	estimatedBlocks          = 0;
+	estimatedBytes           = 0;
+	estimatedCompressedBytes = 0;
+      }
+    }
+    IndexEntry entry;
+    entry.offset           = offset;
+    entry.uncompressedSize = block.inLength;
+    index.push_back(entry);
+    offset += block.outLength;
+    numberOfWrittenBlocks++;
+  }
+  stopThreads(threads);
+  delete[] work;
+  if(succeeded && formatVersion == 2) {
+    // the end of the blocks, the index and the trailer
+    BlockHeader endOfBlocks;
+    memset(&endOfBlocks, 0, sizeof(endOfBlocks));
+    const lzo_uint indexLength = index.size() * sizeof(IndexEntry);
+    const unsigned char* indexData = index.empty() ? NULL : reinterpret_cast<const unsigned char*>(&index[0]);
+    Trailer trailer;
+    trailer.numberOfBlocks = index.size();
+    trailer.indexOffset    = offset + sizeof(endOfBlocks);
+    trailer.indexChecksum  = lzo_adler32(ADLER32_INIT, indexData, indexLength);
+    memcpy(trailer.magic, TRAILER_MAGIC, sizeof(trailer.magic));
+    succeeded = writeFully(outfd, reinterpret_cast<const unsigned char*>(&endOfBlocks), sizeof(endOfBlocks))
+             && writeFully(outfd, indexData, indexLength)
+             && writeFully(outfd, reinterpret_cast<const unsigned char*>(&trailer), sizeof(trailer));
+  }
+  return succeeded;
+}
+
+bool ParallelLZO::decompress(const int infd, const int outfd, const int formatVersion, const int algorithm)
+{
+  if(!isSupportedFormatVersion(formatVersion) || !isSupportedAlgorithm(algorithm))
+    return false;
+  this->formatVersion = formatVersion;
+  this->algorithm     = algorithm;
+  isDecompressing     = true;
+  int numberOfWorkers = numberOfThreads <= 1 ? 0 : numberOfThreads;
+  {
+    // a file of a few blocks is not worth the threads.
+    struct stat st;
+    if(fstat(infd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size <= (off_t)(2 * LZO::lzo_inblock_length))
+      numberOfWorkers = 0;
+  }
+  vector<PThread*> threads;
+  startThreads(threads, numberOfWorkers, LZO::lzo_outblock_length, LZO::lzo_outblock_length);
+  // without the workers, the calling thread decompresses and writes the blocks by itself.
+  const bool isDecodingInline = threads.empty();
+  bool succeeded = true;
+  if(!isDecodingInline) {
+    Writer* writer = new Writer(*this, outfd);
+    if(writer->start()) {
+      threads.push_back(writer);
+    } else {
+      delete writer;
+      succeeded = false;
+    }
+  }
+  vector<IndexEntry> index;
+  unsigned long long offset = 0;
+  while(succeeded) {
+    // waits for a free block, which the writer releases.
+    {
+      Mutex::scoped_lock lock(blocks_mutex);
+      while(numberOfReadBlocks - numberOfWrittenBlocks >= (long long)blocks.size() && !isFailed)
+	written_cond.wait(blocks_mutex);
+      if(isFailed)
+	break;
+    }
+    Block& block = blocks[numberOfReadBlocks % blocks.size()];
+    int size;
+    if(formatVersion == 2) {
+      BlockHeader header;
+      if(readFully(infd, reinterpret_cast<unsigned char*>(&header), sizeof(header)) != (ssize_t)sizeof(header)) {
+	// a read error, or truncated before the end of the blocks
+	succeeded = false;
+	break;
+      }
+      if(header.storedLength == 0 && header.rawLength == 0 && header.checksum == 0) {
+	succeeded = readIndex(infd, offset + sizeof(header), index);
+	break;
+      }
+      size            = header.storedLength;
+      block.rawLength = header.rawLength;
+      block.checksum  = header.checksum;
+    } else {
+      const ssize_t sizeBytes = readFully(infd, reinterpret_cast<unsigned char*>(&size), sizeof(int));
+      if(sizeBytes == -1) {
+	succeeded = false;
+	break;
+      }
+      if(sizeBytes < (ssize_t)sizeof(int))
+	break; // the end of the file
+    }
+    const lzo_uint length = size <= 0 ? (lzo_uint)(-(long)size) : (lzo_uint)size;
+    if(length > LZO::lzo_outblock_length || readFully(infd, block.in, length) != (ssize_t)length) {
+      // broken or truncated
+      succeeded = false;
+      break;
+    }
+    if(formatVersion == 2) {
+      IndexEntry entry;
+      entry.offset           = offset;
+      entry.uncompressedSize = block.rawLength;
+      index.push_back(entry);
+      offset += sizeof(BlockHeader) + length;
+    }
+    block.inLength    = length;
+    block.outLength   = 0;
+    block.isRaw       = size <= 0;
+    block.isProcessed = false;
+    block.isFailed    = false;
+    if(isDecodingInline) {
+      decompressBlock(block, formatVersion, algorithm);
+      if(!writeDecodedBlock(outfd, block)) {
+	succeeded = false;
+	break;
+      }
+      numberOfReadBlocks++;
+      numberOfWrittenBlocks++;
+      continue;
+    }
+    Mutex::scoped_lock lock(blocks_mutex);
+    numberOfReadBlocks++;
+    read_cond.signal();
+    processed_cond.signalAll();
+  }
+  {
+    // lets the writer write the rest of the blocks.
+    Mutex::scoped_lock lock(blocks_mutex);
+    isEndOfInput = true;
+    if(!succeeded)
+      isFailed = true;
+    processed_cond.signalAll();
+    while(!isFailed && numberOfWrittenBlocks < numberOfReadBlocks)
+      written_cond.wait(blocks_mutex);
+    if(isFailed)
+      succeeded = false;
+  }
+  stopThreads(threads);
+  return succeeded;
+}
+
+// reads the index and the trailer after the end of the blocks, and checks them against the blocks read.
+bool ParallelLZO::readIndex(const int infd, const unsigned long long indexOffset, const vector<IndexEntry>& expectedIndex)
+{
+  const lzo_uint indexLength = expectedIndex.size() * sizeof(IndexEntry);
+  // one more byte to tell if anything follows the trailer.
+  vector<unsigned char> buffer(indexLength + sizeof(Trailer) + 1);
+  if(readFully(infd, &buffer[0], buffer.size()) != (ssize_t)(indexLength + sizeof(Trailer)))
+    return false;
+  Trailer trailer;
+  memcpy(&trailer, &buffer[indexLength], sizeof(trailer));
+  if(memcmp(trailer.magic, TRAILER_MAGIC, sizeof(trailer.magic)) != 0)
+    return false;
+  if(trailer.numberOfBlocks != expectedIndex.size() || trailer.indexOffset != indexOffset)
+    return false;
+  if(trailer.indexChecksum != lzo_adler32(ADLER32_INIT, &buffer[0], indexLength))
+    return false;
+  return indexLength == 0 || memcmp(&buffer[0], &expectedIndex[0], indexLength) == 0;
+}
+
+bool ParallelLZO::isWorthCompressing(const int infd, const int algorithm)
+{
+  struct stat st;
+  if(fstat(infd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size < MINIMUM_FILE_SIZE_TO_SAMPLE)
+    return true;
+  unsigned char* in   = new unsigned char[SAMPLE_LENGTH];
+  unsigned char* out  = new unsigned char[LZO::lzo_outblock_length];
+  unsigned char* work = new unsigned char[WORK_MEMORY_LENGTH];
+  lzo_uint sampledBytes    = 0;
+  lzo_uint compressedBytes = 0;
+  for(int i = 0; i < NUMBER_OF_SAMPLES; i++) {
+    const off_t offset = (st.st_size - SAMPLE_LENGTH) / (NUMBER_OF_SAMPLES - 1) * i;
+    const ssize_t readBytes = pread(infd, in, SAMPLE_LENGTH, offset);
+    if(readBytes <= 0)
+      break;
+    lzo_uint out_len;
+    if(algorithm == ALGORITHM_LZ4) {
+      unsigned long lz4_out_len;
+      minilz4_compress(in, readBytes, out, &lz4_out_len, work);
+      out_len = lz4_out_len;
+    } else {
+      lzo1x_1_compress(in, readBytes, out, &out_len, work);
+    }
+    sampledBytes    += readBytes;
+    compressedBytes += out_len < (lzo_uint)readBytes ? out_len : readBytes;
+  }
+  delete[] in;
+  delete[] out;
+  delete[] work;
+  return sampledBytes == 0 || compressedBytes < sampledBytes * MAXIMUM_COMPRESSED_RATIO;
+}
@@ -0,0 +1,119 @@
+#ifndef _HEADER_LZOPARALLEL
+#define _HEADER_LZOPARALLEL
+
+#include <vector>
+#include "minilzo.h"
+#include "pmutex.h"
+#include "ppthread.h"
+
+// Compresses and decompresses a file in the same blocks as LZO, with a pool of threads.
+// The blocks are compressed by LZO1X-1, or by LZ4 (minilz4), which decodes faster.
+// When the blocks do not shrink, they are stored uncompressed without running the compressor,
+// except for a block at intervals, which tells when the data gets compressible again.
+// The blocks are independent, so the workers process them out of order, each with its own
+// work memory. Compression reads the input and writes the blocks in sequence on the calling
+// thread. Decompression is a pipeline; the calling thread reads the blocks, the workers decode
+// them, and a writer thread writes them in sequence, so that reading, decoding and writing overlap.
+//
+// The blocks follow the 16-byte header of a compressed file (see tge_fcopy.cc) in either format.
+//
+// Version 1: each block is an int of the length of its data, negated when the block is stored
+//            uncompressed, followed by the data.
+// Version 2: each block is a BlockHeader, which has the raw length and the Adler-32 checksum of
+//            the uncompressed data as well, followed by the data. An empty BlockHeader ends the
+//            blocks, and is followed by the index of the blocks (an IndexEntry of the offset and
+//            the uncompressed size for each block) and the Trailer at the end of the file, which
+//            tells where the index is. The offsets are 64-bit and counted from the first block,
+//            so that a block can be found and decoded alone.
+class ParallelLZO
+{
+public:
+  // the number of the worker threads. 0 means the number of the online processors.
+  static int defaultNumberOfThreads;
+  // the format version of the files to be compressed.
+  static int defaultFormatVersion;
+  // the compression algorithms of the blocks, which are also the lower 4 bits of the
+  // compression algorithm byte in the header.
+  enum Algorithm {
+    ALGORITHM_LZO = 1,
+    ALGORITHM_LZ4 = 2
+  };
+
+private:
+  struct BlockHeader;
+  struct IndexEntry;
+  struct Trailer;
+  static const char TRAILER_MAGIC[4];
+
+  struct Block {
+    unsigned char* in;
+    lzo_uint       inLength;
+    unsigned char* out;
+    lzo_uint       outLength;
+    lzo_uint       rawLength;   // (decompression of version 2 only) the expected length of the decoded data
+    lzo_uint32     checksum;    // (decompression of version 2 only) the expected checksum of the decoded data
+    bool           isRaw;       // the block is stored uncompressed
+    bool           isProcessed;
+    bool           isFailed;
+  };
+  class Worker : public PThread {
+    ParallelLZO&   owner;
+    unsigned char* work;
+    virtual void run();
+  public:
+    Worker(ParallelLZO& owner);
+    virtual ~Worker();
+  };
+  class Writer : public PThread {
+    ParallelLZO& owner;
+    const int    outfd;
+    virtual void run();
+  public:
+    Writer(ParallelLZO& owner, const int outfd) : owner(owner), outfd(outfd) {}
+  };
+  friend class Worker;
+  friend class Writer;
+
+  int                 numberOfThreads;
+  int                 formatVersion;
+  int                 algorithm;
+  bool                isDecompressing;
+  std::vector<Block>  blocks; // a ring of the blocks being processed
+  Mutex               blocks_mutex;
+  ConditionVariable   read_cond;
+  ConditionVariable   processed_cond;
+  ConditionVariable   written_cond;
+  long long           numberOfReadBlocks;
+  long long           numberOfClaimedBlocks;
+  long long           numberOfWrittenBlocks;
+  bool                isEndOfInput;
+  bool                isFailed;
+  bool                isTerminating;
+
+  static void compressBlock(Block& block, unsigned char* work, const int formatVersion, const int algorithm);
+  static void decompressBlock(Block& block, const int formatVersion, const int algorithm);
+  // writes the decoded data of a block, or fails if the block could not be decoded.
+  static bool writeDecodedBlock(const int outfd, const Block& block);
+  static bool writeFully(const int outfd, const unsigned char* data, lzo_uint length);
+  static ssize_t readFully(const int infd, unsigned char* data, lzo_uint length);
+  bool startThreads(std::vector<PThread*>& threads, const int numberOfWorkers, const size_t inLength, const size_t outLength);
+  void stopThreads(std::vector<PThread*>& threads);
+  bool readIndex(const int infd, const unsigned long long indexOffset, const std::vector<IndexEntry>& expectedIndex);
+
+public:
+  ParallelLZO(const int numberOfThreads = defaultNumberOfThreads);
+  ~ParallelLZO();
+  int getNumberOfThreads() const { return numberOfThreads; }
+  static bool isSupportedFormatVersion(const int formatVersion) { return formatVersion == 1 || formatVersion == 2; }
+  static bool isSupportedAlgorithm(const int algorithm) { return algorithm == ALGORITHM_LZO || algorithm == ALGORITHM_LZ4; }
+  // compresses a few samples spread over a regular file, and tells if the file would shrink.
+  // a small file, which is cheap to compress anyway, or a file that cannot be sampled is worth it.
+  static bool isWorthCompressing(const int infd, const int algorithm = ALGORITHM_LZO);
+  // compresses the rest of infd into outfd, after the header.
+  bool compress(const int infd, const int outfd, const int formatVersion = defaultFormatVersion, const int algorithm = ALGORITHM_LZO);
+  // decompresses the rest of infd, after the header, into outfd. it fails on a broken block
+  // or, in version 2, on a checksum mismatch or a broken index.
+  bool decompress(const int infd, const int outfd, const int formatVersion, const int algorithm = ALGORITHM_LZO);
+};
+
+#endif // #ifndef _HEADER_LZOPARALLEL
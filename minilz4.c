@@ -0,0 +1,179 @@
+/* minilz4.c -- a compressor and a decompressor of the LZ4 block format
+
+   A block is a sequence of sequences. A sequence is a token, whose upper 4 bits
+   are the number of the literals and whose lower 4 bits are the match length
+   minus 4, the extra bytes of the number of the literals if it is 15 or more,
+   the literals, the 2-byte little-endian offset of the match, and the extra
+   bytes of the match length if it is 19 or more. The last sequence has only
+   the literals. The last 5 bytes of a block are always literals, and the last
+   match starts 12 bytes before the end of the block at least.
+ */
+
+#include <string.h>
+#include "minilz4.h"
+
+#define MINMATCH      4
+#define LASTLITERALS  5
+#define MFLIMIT       12
+#define HASH_LOG      12
+#define MAX_DISTANCE  65535
+#define SKIP_TRIGGER  6
+
+static unsigned int read32(const unsigned char* p)
+{
+  unsigned int v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static unsigned int hash32(const unsigned int v)
+{
+  return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+static unsigned char* put_length(unsigned char* op, unsigned long length)
+{
+  while(length >= 255) {
+    *op++ = 255;
+    length -= 255;
+  }
+  *op++ = (unsigned char)length;
+  return op;
+}
+
+static unsigned char* put_literals(unsigned char* op, unsigned char* token, const unsigned char* literals, const unsigned long length)
+{
+  if(length >= 15) {
+    *token = 15 << 4;
+    op = put_length(op, length - 15);
+  } else {
+    *token = (unsigned char)(length << 4);
+  }
+  memcpy(op, literals, length);
+  return op + length;
+}
+
+int minilz4_compress(const unsigned char* in, unsigned long in_len,
+                     unsigned char* out, unsigned long* out_len, void* work)
+{
+  unsigned int* table = (unsigned int*)work;
+  unsigned char* op   = out;
+  unsigned long anchor = 0;
+  memset(table, 0, MINILZ4_MEM_COMPRESS);
+  if(in_len >= MFLIMIT + 1) {
+    const unsigned long mflimit    = in_len - MFLIMIT;
+    const unsigned long matchlimit = in_len - LASTLITERALS;
+    unsigned long ip = 0;
+    while(ip <= mflimit) {
+      const unsigned int h = hash32(read32(in + ip));
+      unsigned long ref    = table[h];
+      table[h] = (unsigned int)ip;
+      if(ref < ip && ip - ref <= MAX_DISTANCE && read32(in + ref) == read32(in + ip)) {
+        unsigned long length = MINMATCH;
+        unsigned char* token;
+        while(anchor < ip && 0 < ref && in[ip - 1] == in[ref - 1]) {
+          ip--;
+          ref--;
+          length++;
+        }
+        while(ip + length < matchlimit && in[ip + length] == in[ref + length])
+          length++;
+        token = op++;
+        op = put_literals(op, token, in + anchor, ip - anchor);
+        *op++ = (unsigned char)(ip - ref);
+        *op++ = (unsigned char)((ip - ref) >> 8);
+        if(length - MINMATCH >= 15) {
+          *token |= 15;
+          op = put_length(op, length - MINMATCH - 15);
+        } else {
+          *token |= (unsigned char)(length - MINMATCH);
+        }
+        ip    += length;
+        anchor = ip;
+        if(ip <= mflimit)
+          table[hash32(read32(in + ip - 2))] = (unsigned int)(ip - 2);
+      } else {
+        /* skips faster over the data which does not match */
+        ip += 1 + ((ip - anchor) >> SKIP_TRIGGER);
+      }
+    }
+  }
+  {
+    unsigned char* token = op++;
+    op = put_literals(op, token, in + anchor, in_len - anchor);
+  }
+  *out_len = op - out;
+  return MINILZ4_E_OK;
+}
+
+static int get_length(const unsigned char** ip, const unsigned char* iend, unsigned long* length)
+{
+  unsigned char s;
+  do {
+    if(*ip >= iend)
+      return MINILZ4_E_ERROR;
+    s = *(*ip)++;
+    *length += s;
+  } while(s == 255);
+  return MINILZ4_E_OK;
+}
+
+int minilz4_decompress_safe(const unsigned char* in, unsigned long in_len,
+                            unsigned char* out, unsigned long* out_len)
+{
+  const unsigned char* ip   = in;
+  const unsigned char* iend = in + in_len;
+  unsigned char* op         = out;
+  unsigned char* oend       = out + *out_len;
+  while(1) {
+    unsigned char token;
+    unsigned long length;
+    unsigned long offset;
+    const unsigned char* match;
+    if(ip >= iend)
+      return MINILZ4_E_ERROR;
+    token  = *ip++;
+    length = token >> 4;
+    if(length == 15 && get_length(&ip, iend, &length) != MINILZ4_E_OK)
+      return MINILZ4_E_ERROR;
+    if(length > (unsigned long)(iend - ip) || length > (unsigned long)(oend - op))
+      return MINILZ4_E_ERROR;
+    memcpy(op, ip, length);
+    op += length;
+    ip += length;
+    if(ip == iend)
+      break; /* the last sequence */
+    if(iend - ip < 2)
+      return MINILZ4_E_ERROR;
+    offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if(offset == 0 || offset > (unsigned long)(op - out))
+      return MINILZ4_E_ERROR;
+    length = token & 15;
+    if(length == 15 && get_length(&ip, iend, &length) != MINILZ4_E_OK)
+      return MINILZ4_E_ERROR;
+    length += MINMATCH;
+    if(length > (unsigned long)(oend - op))
+      return MINILZ4_E_ERROR;
+    match = op - offset;
+    if(offset >= length) {
+      memcpy(op, match, length);
+      op += length;
+    } else if(offset >= 8) {
+      /* the chunks of 8 bytes do not overlap */
+      while(length >= 8) {
+        memcpy(op, match, 8);
+        op += 8;
+        match += 8;
+        length -= 8;
+      }
+      while(length-- > 0)
+        *op++ = *match++;
+    } else {
+      while(length-- > 0)
+        *op++ = *match++;
+    }
+  }
+  *out_len = op - out;
+  return MINILZ4_E_OK;
+}
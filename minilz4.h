@@ -0,0 +1,37 @@
+/* minilz4.h -- a compressor and a decompressor of the LZ4 block format
+
+   Blocks compressed by minilz4_compress() are decoded by LZ4_decompress_safe()
+   of the LZ4 library, and vice versa. Only the block format is implemented;
+   the LZ4 frame format is not. See lz4_Block_format.md of the LZ4 library.
+ */
+
+#ifndef __MINILZ4_H
+#define __MINILZ4_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MINILZ4_E_OK     0
+#define MINILZ4_E_ERROR  (-1)
+
+/* the size of the work memory given to minilz4_compress() */
+#define MINILZ4_MEM_COMPRESS     ((1u << 12) * sizeof(unsigned int))
+/* the maximum length of the compressed data of n bytes */
+#define MINILZ4_COMPRESSBOUND(n) ((n) + (n) / 255 + 16)
+
+/* compresses in_len bytes of in into out, which must be MINILZ4_COMPRESSBOUND(in_len) bytes at least. */
+int minilz4_compress(const unsigned char* in, unsigned long in_len,
+                     unsigned char* out, unsigned long* out_len, void* work);
+
+/* decompresses in_len bytes of in into out of *out_len bytes, and sets *out_len to the
+   length of the decompressed data. it never reads or writes beyond the buffers, and fails
+   on a broken block. */
+int minilz4_decompress_safe(const unsigned char* in, unsigned long in_len,
+                            unsigned char* out, unsigned long* out_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __MINILZ4_H */
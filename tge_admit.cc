@@ -0,0 +1,98 @@
+#if HAVE_CONFIG
+ #include "config.h"
+#endif
+
+#include <algorithm>
+#include "tge_admit.h"
+
+using namespace std;
+
+int       CacheAdmission::SKETCH_SAMPLES_PER_RESET = 10 * SKETCH_WIDTH;
+long long CacheAdmission::alwaysAdmitSizeInBytes   = 256 * 1024 * 1024ll;       // 256Mbytes
+long long CacheAdmission::maximumSizeInBytes       = 0ll;                       // no limit
+int       CacheAdmission::minimumOpensToAdmit      = 2;
+
+CacheAdmission::CacheAdmission()
+  : sketch(SKETCH_DEPTH * SKETCH_WIDTH, 0), numberOfSamples(0), numberOfAdmissions(0ll), numberOfRejections(0ll)
+{
+}
+
+unsigned int CacheAdmission::hash(const std::string& key, const int row) const
+{
+  // FNV-1a, seeded differently for each row.
+  unsigned long long h = 14695981039346656037ull ^ (0x9e3779b97f4a7c15ull * (row + 1));
+  for(string::size_type i = 0; i < key.size(); i++) {
+    h ^= (unsigned char)key[i];
+    h *= 1099511628211ull;
+  }
+  h ^= h >> 29;
+  return (unsigned int)(h % SKETCH_WIDTH);
+}
+
+int CacheAdmission::estimate_internal_shouldBeCalledWithMutexLocked(const std::string& key) const
+{
+  int minimumCount = SKETCH_MAX_COUNTER;
+  for(int row = 0; row < SKETCH_DEPTH; row++) {
+    minimumCount = min<int>(minimumCount, sketch[row * SKETCH_WIDTH + hash(key, row)]);
+  }
+  return minimumCount;
+}
+
+void CacheAdmission::reset_internal_shouldBeCalledWithMutexLocked()
+{
+  for(vector<unsigned char>::iterator it = sketch.begin(); it != sketch.end(); ++it)
+    *it >>= 1;
+  numberOfSamples /= 2;
+}
+
+void CacheAdmission::recordOpen(const std::string& key)
+{
+  Mutex::scoped_lock lock(sketch_mutex);
+  // conservative update; only the smallest counters are incremented.
+  const int currentCount = estimate_internal_shouldBeCalledWithMutexLocked(key);
+  if(currentCount < SKETCH_MAX_COUNTER) {
+    for(int row = 0; row < SKETCH_DEPTH; row++) {
+      unsigned char& counter = sketch[row * SKETCH_WIDTH + hash(key, row)];
+      if(counter == currentCount)
+	counter++;
+    }
+  }
+  if(SKETCH_SAMPLES_PER_RESET <= ++numberOfSamples)
+    reset_internal_shouldBeCalledWithMutexLocked();
+}
+
+int CacheAdmission::estimateOpens(const std::string& key)
+{
+  Mutex::scoped_lock lock(sketch_mutex);
+  return estimate_internal_shouldBeCalledWithMutexLocked(key);
+}
+
+bool CacheAdmission::admit(const std::string& key, const long long fileSize)
+{
+  Mutex::scoped_lock lock(sketch_mutex);
+  bool isAdmitted;
+  if(0 < maximumSizeInBytes && maximumSizeInBytes < fileSize) {
+    isAdmitted = false;
+  } else if(fileSize < alwaysAdmitSizeInBytes) {
+    isAdmitted = true;
+  } else {
+    isAdmitted = minimumOpensToAdmit <= estimate_internal_shouldBeCalledWithMutexLocked(key);
+  }
+  if(isAdmitted)
+    numberOfAdmissions++;
+  else
+    numberOfRejections++;
+  return isAdmitted;
+}
+
+long long CacheAdmission::getNumberOfAdmissions()
+{
+  Mutex::scoped_lock lock(sketch_mutex);
+  return numberOfAdmissions;
+}
+
+long long CacheAdmission::getNumberOfRejections()
+{
+  Mutex::scoped_lock lock(sketch_mutex);
+  return numberOfRejections;
+}
@@ -0,0 +1,46 @@
+#ifndef _HEADER_TGE_ADMIT
+#define _HEADER_TGE_ADMIT
+
+#include <string>
+#include <vector>
+#include "pmutex.h"
+
+// Decides whether a file which is not cached yet should be copied into the cache (TinyLFU).
+// The opens of recent paths are counted approximately by a count-min sketch, whose counters
+// are halved periodically so that old popularity fades out. Small files are always admitted,
+// and larger files are admitted only after they are opened several times in a while,
+// so that a one-shot read of a huge file does not flush the cache.
+class CacheAdmission {
+  enum {
+    SKETCH_DEPTH       = 4,
+    SKETCH_WIDTH       = 1 << 16,
+    SKETCH_MAX_COUNTER = 15
+  };
+  static int SKETCH_SAMPLES_PER_RESET;
+
+  Mutex                      sketch_mutex;
+  std::vector<unsigned char> sketch;
+  int                        numberOfSamples;
+
+  long long numberOfAdmissions;
+  long long numberOfRejections;
+
+  unsigned int hash(const std::string& key, const int row) const;
+  int  estimate_internal_shouldBeCalledWithMutexLocked(const std::string& key) const;
+  void reset_internal_shouldBeCalledWithMutexLocked();
+
+ public:
+  static long long alwaysAdmitSizeInBytes; // files smaller than this are always admitted
+  static long long maximumSizeInBytes;     // files larger than this are never admitted (0 means no limit)
+  static int       minimumOpensToAdmit;    // files in between are admitted after this number of opens
+
+  CacheAdmission();
+  void recordOpen(const std::string& key);
+  int  estimateOpens(const std::string& key);
+  // counts the decision as an admission or a rejection.
+  bool admit(const std::string& key, const long long fileSize);
+  long long getNumberOfAdmissions();
+  long long getNumberOfRejections();
+};
+
+#endif // #ifndef _HEADER_TGE_ADMIT
@@ -9,14 +9,37 @@
 #include <vector>
 #include <unistd.h>
 #include <limits.h>
+#include <pwd.h>
+#include "tge_appconfig.h"
 
 using namespace std;
 
 static char config_file_name[] = "/.tge/.tgerc";
 char cacheDirectoryRoot[PATH_MAX + PATH_MAX] = "/";
+char cacheDirectoryRoots[MAX_CACHE_DIRECTORY_ROOTS][PATH_MAX + PATH_MAX];
+int  numberOfCacheDirectoryRoots = 0;
 char tgeLockdServer[1024];
 int  tgeLockdPort;
 int  minimumFileSizeToEnableLock = 50000000;
+int  recompressionIdleSeconds    = 60;
+char evictionPolicyName[64]      = "lru";
+int  isPolicySimulationEnabled   = 1;
+long long admissionAlwaysAdmitSize = 256 * 1024 * 1024ll;
+long long admissionMaximumSize     = 0ll;
+int  admissionMinimumOpens       = 2;
+char ramCacheDirectoryRoot[PATH_MAX + PATH_MAX] = "";
+int  ramCacheSizeInMBytes        = 1024;
+char hddCacheDirectoryRoot[PATH_MAX + PATH_MAX] = "";
+long long ramPromotionMaximumSize = 16 * 1024 * 1024ll;
+int  promotionMinimumOpens       = 2;
+long long defaultUserQuotaInMBytes = 0ll;
+std::map<uid_t, long long> userQuotasInMBytes;
+std::map<uid_t, double>    userWeights;
+int  isSharedCacheRequested      = 0;
+int  isSerializedFSIDRequested   = 0;
+int  cacheScanThreads            = 4;
+int  compressionThreads          = 0;
+int  lzoFormatVersion            = 1;
 
 vector<string> splitBySpace(const string& origstr)
 {
@@ -29,7 +52,7 @@ vector<string> splitBySpace(const string& origstr)
     if(!(i < (int)origstr.size()))
       break; // end of line
     int ncur = i;
-    while(ncur < (int)origstr.size() && origstr[i] != ' ')
+    while(ncur < (int)origstr.size() && origstr[ncur] != ' ')
       ncur++;
     retval.push_back(origstr.substr(i, ncur - i));
     i = ncur;
@@ -37,6 +60,36 @@ vector<string> splitBySpace(const string& origstr)
   return retval;
 }
 
+// a user name or a numeric uid. returns false if the user does not exist.
+static bool getUIDByName(const string& userName, uid_t* uid)
+{
+  if(!userName.empty() && userName.find_first_not_of("0123456789") == string::npos) {
+    *uid = (uid_t)std::atol(userName.c_str());
+    return true;
+  }
+  const struct passwd* pw = getpwnam(userName.c_str());
+  if(pw == NULL)
+    return false;
+  *uid = pw->pw_uid;
+  return true;
+}
+
+// parses '<user>:<value> <user>:<value> ...'.
+static void parseUserValues(const string& rightHand, std::map<uid_t, double>& values)
+{
+  vector<string> userValueSpecifiers = splitBySpace(rightHand);
+  for(int i = 0; i < (int)userValueSpecifiers.size(); i++) {
+    const string& uvs = userValueSpecifiers[i];
+    const string::size_type p = uvs.find(':');
+    uid_t uid;
+    if(p == string::npos || !getUIDByName(uvs.substr(0, p), &uid)) {
+      cerr << "WARNING: unknown user in '" << uvs << "'" << endl;
+      continue;
+    }
+    values[uid] = std::atof(uvs.substr(p + 1).c_str());
+  }
+}
+
 string expandEnvironmentVariable(const string& origstr)
 {
   string retval;
@@ -102,6 +155,54 @@ bool load_application_config()
       tgeLockdPort = std::atoi(rightHand.c_str());
     } else if(leftHand == "locksize") {
       minimumFileSizeToEnableLock = std::atoi(rightHand.c_str());
+    } else if(leftHand == "recompressidle") {
+      recompressionIdleSeconds = std::atoi(rightHand.c_str());
+    } else if(leftHand == "evictionpolicy") {
+      strncpy(evictionPolicyName, rightHand.c_str(), sizeof(evictionPolicyName) - 1);
+      evictionPolicyName[sizeof(evictionPolicyName) - 1] = '\0';
+    } else if(leftHand == "policysimulation") {
+      isPolicySimulationEnabled = std::atoi(rightHand.c_str());
+    } else if(leftHand == "admitsize") {
+      admissionAlwaysAdmitSize = std::atoll(rightHand.c_str());
+    } else if(leftHand == "admitmaxsize") {
+      admissionMaximumSize = std::atoll(rightHand.c_str());
+    } else if(leftHand == "admitopens") {
+      admissionMinimumOpens = std::atoi(rightHand.c_str());
+    } else if(leftHand == "ramcache") {
+      // <path>:<size in Mbytes>
+      const string::size_type p = rightHand.rfind(':');
+      const string path = expandEnvironmentVariable(rightHand.substr(0, p));
+      strncpy(ramCacheDirectoryRoot, path.c_str(), sizeof(ramCacheDirectoryRoot) - 1);
+      ramCacheDirectoryRoot[sizeof(ramCacheDirectoryRoot) - 1] = '\0';
+      if(p != string::npos)
+	ramCacheSizeInMBytes = std::atoi(rightHand.substr(p + 1).c_str());
+    } else if(leftHand == "hddcache") {
+      const string path = expandEnvironmentVariable(rightHand);
+      strncpy(hddCacheDirectoryRoot, path.c_str(), sizeof(hddCacheDirectoryRoot) - 1);
+      hddCacheDirectoryRoot[sizeof(hddCacheDirectoryRoot) - 1] = '\0';
+    } else if(leftHand == "rampromotesize") {
+      ramPromotionMaximumSize = std::atoll(rightHand.c_str());
+    } else if(leftHand == "promoteopens") {
+      promotionMinimumOpens = std::atoi(rightHand.c_str());
+    } else if(leftHand == "userquota") {
+      defaultUserQuotaInMBytes = std::atoll(rightHand.c_str());
+    } else if(leftHand == "userquotas") {
+      std::map<uid_t, double> values;
+      parseUserValues(rightHand, values);
+      for(std::map<uid_t, double>::const_iterator cit = values.begin(); cit != values.end(); ++cit)
+	userQuotasInMBytes[cit->first] = (long long)cit->second;
+    } else if(leftHand == "userweights") {
+      parseUserValues(rightHand, userWeights);
+    } else if(leftHand == "sharedcache") {
+      isSharedCacheRequested = std::atoi(rightHand.c_str());
+    } else if(leftHand == "serializefsid") {
+      isSerializedFSIDRequested = std::atoi(rightHand.c_str());
+    } else if(leftHand == "scanthreads") {
+      cacheScanThreads = std::atoi(rightHand.c_str());
+    } else if(leftHand == "compressthreads") {
+      compressionThreads = std::atoi(rightHand.c_str());
+    } else if(leftHand == "lzoformat") {
+      lzoFormatVersion = std::atoi(rightHand.c_str());
     } else if(leftHand == "localdisk") {
       // currently, we have nothing to do here
     } else if(leftHand == "tgelocaldisk") {
@@ -120,8 +221,23 @@ bool load_application_config()
 	// cerr << "LDS[" << i << "] = " << lds << endl;
 	const string::size_type p = lds.find(':');
 	if(p == string::npos || lds.substr(0, p) == "*" || lds.substr(0, p) == hostname) {
-	  strncpy(cacheDirectoryRoot, expandEnvironmentVariable(p == string::npos ? lds : lds.substr(p+1)).c_str(), sizeof(cacheDirectoryRoot) - 1);
-	  cacheDirectoryRoot[sizeof(cacheDirectoryRoot) - 1] = '\0';
+	  // multiple cache directories are separated by ','.
+	  const string paths = p == string::npos ? lds : lds.substr(p+1);
+	  numberOfCacheDirectoryRoots = 0;
+	  string::size_type start = 0;
+	  while(start <= paths.size() && numberOfCacheDirectoryRoots < MAX_CACHE_DIRECTORY_ROOTS) {
+	    string::size_type end = paths.find(',', start);
+	    if(end == string::npos)
+	      end = paths.size();
+	    if(start < end) {
+	      char* root = cacheDirectoryRoots[numberOfCacheDirectoryRoots++];
+	      strncpy(root, expandEnvironmentVariable(paths.substr(start, end - start)).c_str(), PATH_MAX + PATH_MAX - 1);
+	      root[PATH_MAX + PATH_MAX - 1] = '\0';
+	    }
+	    start = end + 1;
+	  }
+	  if(0 < numberOfCacheDirectoryRoots)
+	    strcpy(cacheDirectoryRoot, cacheDirectoryRoots[0]);
 	  break;
 	}
       }
@@ -1,10 +1,37 @@
 #ifndef _HEADER_APPCONFIG
 #define _HEADER_APPCONFIG
 
+#include <limits.h>
+#include <sys/types.h>
+#include <map>
+
+#define MAX_CACHE_DIRECTORY_ROOTS 8
+
 bool load_application_config();
-extern char cacheDirectoryRoot[];
+extern char cacheDirectoryRoot[];   // the first one of cacheDirectoryRoots, where the log file is placed
+extern char cacheDirectoryRoots[][PATH_MAX + PATH_MAX];
+extern int  numberOfCacheDirectoryRoots;
 extern char tgeLockdServer[];
 extern int  tgeLockdPort;
 extern int  minimumFileSizeToEnableLock;
+extern int  recompressionIdleSeconds;
+extern char evictionPolicyName[];
+extern int  isPolicySimulationEnabled;
+extern long long admissionAlwaysAdmitSize;
+extern long long admissionMaximumSize;
+extern int  admissionMinimumOpens;
+extern char ramCacheDirectoryRoot[];    // empty if the RAM tier is not used
+extern int  ramCacheSizeInMBytes;
+extern char hddCacheDirectoryRoot[];    // empty if the HDD tier is not used
+extern long long ramPromotionMaximumSize;
+extern int  promotionMinimumOpens;
+extern long long defaultUserQuotaInMBytes;                // 0 means no quota
+extern std::map<uid_t, long long> userQuotasInMBytes;
+extern std::map<uid_t, double>    userWeights;
+extern int  isSharedCacheRequested;
+extern int  isSerializedFSIDRequested;
+extern int  cacheScanThreads;
+extern int  compressionThreads;
+extern int  lzoFormatVersion;
 
 #endif // #define _HEADER_APPCONFIG
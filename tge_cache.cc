@@ -6,14 +6,19 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <errno.h>
+#include <ctype.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/vfs.h>
 #include <vector>
 #include <string.h>
 #include <fstream>
+#include <sstream>
 #include <algorithm>
+#include <deque>
+#include <utime.h>
 #include "tge_log.h"
+#include "tge_fcopy.h"
 #include "tge_cache.h"
 
 using namespace std;
@@ -22,7 +27,118 @@ long long CacheGarbageCollection::GC_period_in_KBytes = 1024 * 1024ll * 3;
 int       CacheGarbageCollection::GC_period_in_nFiles = 1000;                   // 1000files
 double    CacheGarbageCollection::GC_apply_hardLimit_ratio_of_HDD_usage = 0.70; // 70%
 int       CacheGarbageCollection::GC_delete_cache_if_this_number_of_days_passed = 14; // 2 weeks;
+int       CacheGarbageCollection::GC_consistency_check_period_in_seconds = 6 * 3600; // 6 hours
+double    CacheGarbageCollection::GC_low_watermark_ratio_of_limit = 0.90;         // evict until 90% of the limit
+double    CacheGarbageCollection::GC_free_space_low_watermark_ratio = 0.10;       // evict if less than 10% of the disk is free
+double    CacheGarbageCollection::GC_free_space_high_watermark_ratio = 0.15;      // until 15% of the disk gets free
+double    CacheGarbageCollection::GC_free_space_emergency_floor_ratio = 0.02;     // fetchers wait below 2%
+int       CacheGarbageCollection::GC_watermark_check_interval_in_seconds = 10;
+int       CacheGarbageCollection::GC_availability_check_interval_in_seconds = 5;
 int       CacheGarbageCollection::AUTO = -1;
+long long CacheGarbageCollection::defaultUserQuotaInBytes = 0ll; // no quota
+std::map<uid_t, long long> CacheGarbageCollection::userQuotasInBytes;
+std::map<uid_t, double>    CacheGarbageCollection::userWeights;
+int       CacheGarbageCollection::scanThreads = 4;
+
+static const int CACHE_SHARD_LEVELS      = 2; // <cache root>/AB/CD/ABCD...
+static const int CACHE_SHARD_NAME_LENGTH = 2;
+
+static bool isHexadecimalName(const char* name, const int expectedLength)
+{
+  int length = 0;
+  for(; name[length] != '\0'; length++) {
+    if(!isxdigit(name[length]))
+      return false;
+  }
+  return length == expectedLength;
+}
+
+static bool isCacheFileName(const char* name)
+{
+  // cache files are named by 64 hexadecimal digits of SHA-256.
+  return isHexadecimalName(name, 64);
+}
+
+std::string makeCacheFilePath(const std::string& cacheRootDirectory, const std::string& cacheFileName)
+{
+  string path = cacheRootDirectory;
+  if(!path.empty() && path[path.size() - 1] == '/')
+    path.resize(path.size() - 1);
+  for(int level = 0; level < CACHE_SHARD_LEVELS; level++) {
+    path += '/';
+    path += cacheFileName.substr(level * CACHE_SHARD_NAME_LENGTH, CACHE_SHARD_NAME_LENGTH);
+  }
+  path += '/';
+  path += cacheFileName;
+  return path;
+}
+
+bool ensureCacheFileDirectory(const std::string& cacheFilePath)
+{
+  // find the slash after the cache root directory, and create the shard directories from there.
+  string::size_type slashPos = cacheFilePath.rfind('/');
+  for(int level = 0; level < CACHE_SHARD_LEVELS && slashPos != string::npos && 0 < slashPos; level++)
+    slashPos = cacheFilePath.rfind('/', slashPos - 1);
+  if(slashPos == string::npos)
+    return false;
+  for(int level = 0; level < CACHE_SHARD_LEVELS; level++) {
+    slashPos = cacheFilePath.find('/', slashPos + 1);
+    const string directory = cacheFilePath.substr(0, slashPos);
+    if(mkdir(directory.c_str(), 0755) == -1 && errno != EEXIST) {
+      logprintf(0, LOG_ERROR, "Could not create cache directory '%s'. (errno=%d)\n", directory.c_str(), errno);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool moveCacheFile(const std::string& sourcePath, const std::string& destinationPath)
+{
+  if(rename(sourcePath.c_str(), destinationPath.c_str()) == 0)
+    return true;
+  if(errno != EXDEV)
+    return false;
+  struct stat st;
+  if(stat(sourcePath.c_str(), &st) == -1)
+    return false;
+  // the freshness of a cache file is judged by its modification time, so it must be kept.
+  const string temporaryPath = destinationPath + ".tmp";
+  struct utimbuf times;
+  times.actime  = st.st_atime;
+  times.modtime = st.st_mtime;
+  if(!copyFile(sourcePath.c_str(), temporaryPath.c_str(), st.st_mode & 07777)
+     || (chown(temporaryPath.c_str(), st.st_uid, st.st_gid) == -1 && getuid() == 0) // the owner is accounted
+     || utime(temporaryPath.c_str(), &times) == -1
+     || rename(temporaryPath.c_str(), destinationPath.c_str()) == -1) {
+    unlink(temporaryPath.c_str());
+    return false;
+  }
+  unlink(sourcePath.c_str());
+  return true;
+}
+
+static bool listDirectory(const std::string& directory, vector<string>& names)
+{
+  DIR* dirp = opendir(directory.c_str());
+  if(dirp == NULL) {
+    logprintf(0, LOG_ERROR, "Could not opendir '%s'\n", directory.c_str());
+    return false;
+  }
+  struct dirent oneEntry;
+  struct dirent *result;
+  int resultStatus;
+  while((resultStatus = readdir_r(dirp, &oneEntry, &result)) == 0) {
+    if(result == NULL)
+      break; // reached the end
+    names.push_back(oneEntry.d_name);
+  }
+  closedir(dirp);
+  if(resultStatus != 0) {
+    logprintf(0, LOG_ERROR, "readdir failed. (errno=%d)\n", resultStatus);
+    return false;
+  }
+  return true;
+}
 
 static inline bool IsKanji(char c) { return false; }
 
@@ -106,16 +222,139 @@ string convertToCSV(const vector<string>& Data) {
 CacheGarbageCollection::CacheGarbageCollection()
 {
   initialized = false;
+  cacheIndex_totalSizeOfMyFiles = 0ll;
+  cacheIndex_numberOfMyFiles    = 0;
+  myUID                         = getuid();
+  lastConsistencyCheckTime      = 0;
+  isValidated                   = false;
+  nextShardToScan               = 0;
+  isScanInterrupted             = false;
+  numberOfScannedFiles          = 0ll;
+  currentLimitInBytes           = -1ll;
+  isEvictionRequested           = false;
+  isEvictionThreadStopping      = false;
+  evictionThread_clfc           = NULL;
+  lastAvailabilityCheckTime     = 0;
+  wasAvailableAtLastCheck       = true;
+  evictionPolicy                = new LRUEvictionPolicy();
+  numberOfCacheHits             = 0ll;
+  numberOfCacheMisses           = 0ll;
+  demotionTarget                = NULL;
+  priorityClassifier            = NULL;
+  appliedPriorityRulesVersion   = -1;
   resetCounter();
 }
 
+CacheGarbageCollection::~CacheGarbageCollection()
+{
+  delete evictionPolicy;
+  for(unsigned int i = 0; i < policySimulators.size(); i++)
+    delete policySimulators[i];
+}
+
+bool CacheGarbageCollection::setEvictionPolicy(const char* policyName)
+{
+  EvictionPolicy* newPolicy = createEvictionPolicy(policyName);
+  if(newPolicy == NULL)
+    return false;
+  Mutex::scoped_lock lock(cacheIndex_mutex);
+  // feed the entries in the index from the least recently used one.
+  for(set<pair<time_t, string> >::const_iterator cit = cacheIndex_agingOrder.begin(); cit != cacheIndex_agingOrder.end(); ++cit) {
+    newPolicy->insert(cit->second, cacheIndex[cit->second]);
+  }
+  delete evictionPolicy;
+  evictionPolicy = newPolicy;
+  return true;
+}
+
+void CacheGarbageCollection::enablePolicySimulation()
+{
+  Mutex::scoped_lock lock(cacheIndex_mutex);
+  if(!policySimulators.empty())
+    return;
+  istringstream policyNames(getEvictionPolicyNames());
+  string policyName;
+  while(policyNames >> policyName) {
+    policySimulators.push_back(new EvictionPolicySimulator(createEvictionPolicy(policyName.c_str())));
+  }
+}
+
+std::string CacheGarbageCollection::getStatisticsText()
+{
+  Mutex::scoped_lock lock(cacheIndex_mutex);
+  string retval;
+  char buffer[256];
+  sprintf(buffer, "evictionpolicy=%s\n", evictionPolicy->getName());
+  retval += buffer;
+  sprintf(buffer, "cachehits=%lld\n", numberOfCacheHits);
+  retval += buffer;
+  sprintf(buffer, "cachemisses=%lld\n", numberOfCacheMisses);
+  retval += buffer;
+  const long long numberOfReferences = numberOfCacheHits + numberOfCacheMisses;
+  sprintf(buffer, "hitratio=%.4f\n", 0 < numberOfReferences ? (double)numberOfCacheHits / numberOfReferences : 0.0);
+  retval += buffer;
+  sprintf(buffer, "validated=%d\n", isValidated ? 1 : 0);
+  retval += buffer;
+  {
+    Mutex::scoped_lock scanLock(scan_mutex);
+    sprintf(buffer, "scannedshards=%d/%d\n", (int)min<size_t>(nextShardToScan, shardsToScan.size()), (int)shardsToScan.size());
+    retval += buffer;
+    sprintf(buffer, "scannedfiles=%lld\n", numberOfScannedFiles);
+    retval += buffer;
+  }
+  if(myUID == 0) {
+    for(map<uid_t, long long>::const_iterator cit = cacheIndex_sizeByOwner.begin(); cit != cacheIndex_sizeByOwner.end(); ++cit) {
+      if(cit->second <= 0)
+	continue;
+      sprintf(buffer, "usage.%d=%lld\n", (int)cit->first, cit->second);
+      retval += buffer;
+      const long long quota = getUserQuotaInBytes(cit->first);
+      if(0 < quota) {
+	sprintf(buffer, "quota.%d=%lld\n", (int)cit->first, quota);
+	retval += buffer;
+      }
+    }
+  }
+  for(unsigned int i = 0; i < policySimulators.size(); i++) {
+    const EvictionPolicySimulator& simulator = *policySimulators[i];
+    const long long numberOfSimulatedReferences = simulator.getNumberOfHits() + simulator.getNumberOfMisses();
+    sprintf(buffer, "hitratio.%s=%.4f\n", simulator.getName(), 0 < numberOfSimulatedReferences ? (double)simulator.getNumberOfHits() / numberOfSimulatedReferences : 0.0);
+    retval += buffer;
+  }
+  return retval;
+}
+
+long long CacheGarbageCollection::getUserQuotaInBytes(const uid_t uid)
+{
+  map<uid_t, long long>::const_iterator cit = userQuotasInBytes.find(uid);
+  return cit != userQuotasInBytes.end() ? cit->second : defaultUserQuotaInBytes;
+}
+
+double CacheGarbageCollection::getUserWeight(const uid_t uid)
+{
+  map<uid_t, double>::const_iterator cit = userWeights.find(uid);
+  return cit != userWeights.end() && 0.0 < cit->second ? cit->second : 1.0;
+}
+
+bool CacheGarbageCollection::isAnyUserOverQuota_internal_shouldBeCalledWithMutexLocked() const
+{
+  if(myUID != 0)
+    return false;
+  for(map<uid_t, long long>::const_iterator cit = cacheIndex_sizeByOwner.begin(); cit != cacheIndex_sizeByOwner.end(); ++cit) {
+    const long long quota = getUserQuotaInBytes(cit->first);
+    if(0 < quota && quota < cit->second)
+      return true;
+  }
+  return false;
+}
+
 void CacheGarbageCollection::resetCounter()
 {
   GC_counter_in_KBytes = 0ll;
   GC_counter_in_nFiles = 0;
 }
 
-void CacheGarbageCollection::accessedFile(const long long fileSize, const Cache_LockedFileChecker& clfc)
+void CacheGarbageCollection::accessedFile(const long long fileSize)
 {
   if(!initialized) {
     logprintf(0, LOG_ERROR, "Garbage collection maneger is called without initialization. (AF)\n");
@@ -123,152 +362,285 @@ void CacheGarbageCollection::accessedFile(const long long fileSize, const Cache_
   }
   if(fileSize < 0)
     return;
-  GC_counter_in_KBytes = (fileSize + 4095ll) / 1024;
+  bool exceedsLimit;
+  {
+    Mutex::scoped_lock lock(cacheIndex_mutex);
+    exceedsLimit = (0 <= currentLimitInBytes && currentLimitInBytes < cacheIndex_totalSizeOfMyFiles)
+                   || isAnyUserOverQuota_internal_shouldBeCalledWithMutexLocked();
+  }
+  Mutex::scoped_lock lock(evictionThread_mutex);
+  GC_counter_in_KBytes += (fileSize + 4095ll) / 1024;
   GC_counter_in_nFiles++;
-  if(GC_period_in_nFiles <= GC_counter_in_nFiles || GC_period_in_KBytes <= GC_counter_in_KBytes) {
-    collect(clfc);
+  if(exceedsLimit || GC_period_in_nFiles <= GC_counter_in_nFiles || GC_period_in_KBytes <= GC_counter_in_KBytes) {
+    // the eviction thread will do the job; the caller does not have to wait for it.
+    isEvictionRequested = true;
+    evictionThread_cond.signal();
     resetCounter();
   }
 }
 
-void CacheGarbageCollection::appendLocalFileCollection(const std::string& localCacheFileName, const std::string& originalFullPathName)
+void CacheGarbageCollection::waitForFreeSpace()
 {
-  Mutex::scoped_lock lock(localCacheCollectionFile_mutex);
-  localCacheFileName2originalFullPathName[localCacheFileName] = originalFullPathName;
-  ofstream ost(localCacheCollectionFile.c_str(), ios::app);
-  if(!ost) {
-    logprintf(0, LOG_ERROR, "Could not append to local cache collection file.\n", localCacheCollectionFile.c_str());
-    return;
+  const int MAX_WAIT_IN_SECONDS = 60;
+  for(int waitedSeconds = 0; waitedSeconds < MAX_WAIT_IN_SECONDS; waitedSeconds++) {
+    struct statfs sfs;
+    if(!statCacheRootDir(&sfs))
+      return;
+    const long long totalCapacity     = sfs.f_bsize * (long long)sfs.f_blocks;
+    const long long availableCapacity = sfs.f_bsize * (long long)sfs.f_bavail;
+    if(totalCapacity * GC_free_space_emergency_floor_ratio <= availableCapacity)
+      return;
+    if(waitedSeconds == 0)
+      logprintf(0, LOG_WARNING, "Free space of the cache disk is below the emergency floor. Waiting for eviction.\n");
+    Mutex::scoped_lock lock(evictionThread_mutex);
+    if(isEvictionThreadStopping)
+      return;
+    isEvictionRequested = true;
+    evictionThread_cond.signal();
+    freeSpace_cond.timedWait(evictionThread_mutex, 1);
   }
-  vector<string> csv;
-  csv.resize(2);
-  csv[0] = localCacheFileName;
-  csv[1] = originalFullPathName;
-  ost << convertToCSV(csv) << "\n";
-  localCacheCollection_SolidText_isDirty = true;
+  logprintf(0, LOG_WARNING, "Gave up waiting for free space of the cache disk.\n");
 }
 
-void CacheGarbageCollection::removeLocalFileCollection(const std::string& localCacheFileName)
+bool CacheGarbageCollection::isAvailable()
 {
-  Mutex::scoped_lock lock(localCacheCollectionFile_mutex);
-  map<string, string>::iterator it = localCacheFileName2originalFullPathName.find(localCacheFileName);
-  if(it != localCacheFileName2originalFullPathName.end()) {
-    localCacheFileName2originalFullPathName.erase(it);
-    localCacheCollection_SolidText_isDirty = true;
+  Mutex::scoped_lock lock(availability_mutex);
+  const time_t currentTime = time(NULL);
+  if(currentTime < lastAvailabilityCheckTime + GC_availability_check_interval_in_seconds)
+    return wasAvailableAtLastCheck;
+  lastAvailabilityCheckTime = currentTime;
+  struct statfs sfs;
+  bool available = statfs(cacheRootDirectory.c_str(), &sfs) == 0 && access(cacheRootDirectory.c_str(), W_OK) == 0;
+  if(available) {
+    const long long totalCapacity     = sfs.f_bsize * (long long)sfs.f_blocks;
+    const long long availableCapacity = sfs.f_bsize * (long long)sfs.f_bavail;
+    available = totalCapacity * GC_free_space_emergency_floor_ratio <= availableCapacity;
+  }
+  if(available != wasAvailableAtLastCheck) {
+    if(available)
+      logprintf(0, LOG_INFO, "Cache directory '%s' is available again.\n", cacheRootDirectory.c_str());
+    else
+      logprintf(0, LOG_WARNING, "Cache directory '%s' has failed or is full. Skip it for a while.\n", cacheRootDirectory.c_str());
   }
+  wasAvailableAtLastCheck = available;
+  return available;
 }
 
-bool CacheGarbageCollection::canUseLocalCacheNameForLocalFileCollection(const std::string& localCacheFileName, const std::string& originalFullPathName)
+void CacheGarbageCollection::reportFailure()
 {
-  Mutex::scoped_lock lock(localCacheCollectionFile_mutex);
-  map<string, string>::iterator it = localCacheFileName2originalFullPathName.find(localCacheFileName);
-  if(it == localCacheFileName2originalFullPathName.end()) {
-    return true;
-  }
-  return it->second == originalFullPathName;
+  Mutex::scoped_lock lock(availability_mutex);
+  if(wasAvailableAtLastCheck)
+    logprintf(0, LOG_WARNING, "Cache directory '%s' has failed. Skip it for a while.\n", cacheRootDirectory.c_str());
+  lastAvailabilityCheckTime = time(NULL);
+  wasAvailableAtLastCheck   = false;
 }
 
-void CacheGarbageCollection::updateSolidText_internal_shouldBeCalledWithMutexLocked()
+bool CacheGarbageCollection::startEvictionThread(const Cache_LockedFileChecker* clfc)
 {
-  if(localCacheCollection_SolidText_isDirty) {
-    vector<char>   solidText;
-    vector<string> csv;
-    csv.resize(2);
-    for(map<string, string>::const_iterator cit = localCacheFileName2originalFullPathName.begin(); cit != localCacheFileName2originalFullPathName.end(); ++cit) {
-      csv[0] = cit->first;
-      csv[1] = cit->second;
-      const string& line = convertToCSV(csv);
-      solidText.insert(solidText.end(), line.begin(), line.end());
-      solidText.push_back('\n');
-    }
-    localCacheCollection_SolidText.assign(solidText.begin(), solidText.end());
-    localCacheCollection_SolidText_isDirty = false;
+  evictionThread_clfc      = clfc;
+  isEvictionThreadStopping = false;
+  if(!start()) {
+    // nobody else will do it.
+    validateCacheDirectory();
+    return false;
   }
+  return true;
 }
 
-std::string CacheGarbageCollection::getSolidText(std::string::size_type start, std::string::size_type end)
+void CacheGarbageCollection::stopEvictionThread()
 {
-  return localCacheCollection_SolidText.substr(start, end);
+  {
+    Mutex::scoped_lock lock(evictionThread_mutex);
+    isEvictionThreadStopping = true;
+    evictionThread_cond.signal();
+    freeSpace_cond.signalAll();
+  }
+  join();
 }
 
-std::string::size_type CacheGarbageCollection::getSolidTextSize()
+void CacheGarbageCollection::run()
 {
-  return localCacheCollection_SolidText.size();
+  // tgefs is mounted before the cache directory is scanned, and the first garbage collection follows the scan.
+  validateCacheDirectory();
+  Mutex::scoped_lock lock(evictionThread_mutex);
+  isEvictionRequested = true;
+  while(!isEvictionThreadStopping) {
+    const bool wasRequested = isEvictionRequested;
+    isEvictionRequested = false;
+    lock.unlock();
+    updateLimits();
+    long long totalSizeUsed;
+    bool      isAnyUserOverQuota;
+    {
+      Mutex::scoped_lock indexLock(cacheIndex_mutex);
+      totalSizeUsed      = cacheIndex_totalSizeOfMyFiles;
+      isAnyUserOverQuota = isAnyUserOverQuota_internal_shouldBeCalledWithMutexLocked();
+    }
+    if(wasRequested || isAnyUserOverQuota || 0 < getGarbageSizeToBeCollected(totalSizeUsed)) {
+      collect(*evictionThread_clfc);
+    }
+    lock.lock();
+    freeSpace_cond.signalAll();
+    if(!isEvictionRequested && !isEvictionThreadStopping)
+      evictionThread_cond.timedWait(evictionThread_mutex, GC_watermark_check_interval_in_seconds);
+  }
 }
 
-void CacheGarbageCollection::updateSolidText()
+static std::string getCacheFileNameOf(const std::string& localCacheFileName)
 {
-  Mutex::scoped_lock lock(localCacheCollectionFile_mutex);
-  updateSolidText_internal_shouldBeCalledWithMutexLocked();
+  return localCacheFileName.substr(localCacheFileName.rfind('/') + 1);
 }
 
-void CacheGarbageCollection::saveLocalFileCollection()
+// Collects the original paths in the index, keyed by the paths of the cache files.
+class CacheGarbageCollection_LocalFileCollector : public CacheFileIndex_Visitor {
+  const std::string& cacheRootDirectory;
+ public:
+  std::map<std::string, std::string>       originalFullPathNames;
+  std::map<std::string, CacheFileMetadata> metadata;
+  CacheGarbageCollection_LocalFileCollector(const std::string& cacheRootDirectory) : cacheRootDirectory(cacheRootDirectory) {}
+  virtual void visit(const std::string& cacheFileName, const std::string& originalFullPathName, const CacheFileMetadata& metadata) {
+    const string localCacheFileName = makeCacheFilePath(cacheRootDirectory, cacheFileName);
+    originalFullPathNames[localCacheFileName] = originalFullPathName;
+    this->metadata[localCacheFileName]        = metadata;
+  }
+};
+
+void CacheGarbageCollection::appendLocalFileCollection(const std::string& localCacheFileName, const std::string& originalFullPathName,
+						       const SourceFileAttributes& source)
 {
-  Mutex::scoped_lock lock(localCacheCollectionFile_mutex);
-  const string localCacheCollectionFile_New = localCacheCollectionFile + ".swp";
+  applyPriorityClass(localCacheFileName, originalFullPathName);
+  CacheFileMetadata metadata;
+  metadata.source = source;
   {
-    ofstream ost(localCacheCollectionFile_New.c_str());
-    if(!ost) {
-      logprintf(0, LOG_ERROR, "Could not save local cache collection file to temporary file '%s'.\n", localCacheCollectionFile_New.c_str());
-      return;
-    }
-    vector<string> csv;
-    csv.resize(2);
-    for(map<string, string>::const_iterator cit = localCacheFileName2originalFullPathName.begin(); cit != localCacheFileName2originalFullPathName.end(); ++cit) {
-      csv[0] = cit->first;
-      csv[1] = cit->second;
-      ost << convertToCSV(csv) << "\n";
+    Mutex::scoped_lock lock(cacheIndex_mutex);
+    map<string, CacheEntry>::const_iterator cit = cacheIndex.find(localCacheFileName);
+    if(cit != cacheIndex.end()) {
+      metadata.size        = cit->second.size;
+      metadata.accessCount = cit->second.accessCount;
+      metadata.hasOwner    = true;
+      metadata.owner       = cit->second.owner;
     }
   }
-  const int result = rename(localCacheCollectionFile_New.c_str(), localCacheCollectionFile.c_str());
-  if(result != 0) {
-    logprintf(0, LOG_ERROR, "Could not rename the temporary file '%s' to '%s'.\n", localCacheCollectionFile_New.c_str(), localCacheCollectionFile.c_str());
+  if(!localFileIndex.put(getCacheFileNameOf(localCacheFileName), originalFullPathName, metadata)) {
+    logprintf(0, LOG_ERROR, "Could not add '%s' to the local cache collection.\n", localCacheFileName.c_str());
+  }
+}
+
+void CacheGarbageCollection::removeLocalFileCollection(const std::string& localCacheFileName)
+{
+  localFileIndex.remove(getCacheFileNameOf(localCacheFileName));
+}
+
+bool CacheGarbageCollection::findLocalFileCollection(const std::string& localCacheFileName, std::string* originalFullPathName, CacheFileMetadata* metadata)
+{
+  return localFileIndex.find(getCacheFileNameOf(localCacheFileName), originalFullPathName, metadata);
+}
+
+std::string CacheGarbageCollection::getOriginalFullPathName(const std::string& localCacheFileName)
+{
+  string originalFullPathName;
+  if(!localFileIndex.find(getCacheFileNameOf(localCacheFileName), &originalFullPathName, NULL))
+    return "";
+  return originalFullPathName;
+}
+
+bool CacheGarbageCollection::canUseLocalCacheNameForLocalFileCollection(const std::string& localCacheFileName, const std::string& originalFullPathName)
+{
+  return localFileIndex.canUse(getCacheFileNameOf(localCacheFileName), originalFullPathName);
+}
+
+class CacheGarbageCollection_LocalFileLister : public CacheFileIndex_Visitor {
+  const std::string&           cacheRootDirectory;
+  std::vector<CacheListEntry>& entries;
+public:
+  CacheGarbageCollection_LocalFileLister(const std::string& cacheRootDirectory, std::vector<CacheListEntry>& entries)
+    : cacheRootDirectory(cacheRootDirectory), entries(entries) {}
+  virtual void visit(const std::string& cacheFileName, const std::string& originalFullPathName, const CacheFileMetadata& metadata) {
+    entries.push_back(CacheListEntry());
+    CacheListEntry& listEntry      = entries.back();
+    listEntry.localCacheFileName   = makeCacheFilePath(cacheRootDirectory, cacheFileName);
+    listEntry.originalFullPathName = originalFullPathName;
+    listEntry.metadata             = metadata;
+  }
+};
+
+bool CacheGarbageCollection::listCacheEntries(unsigned long long* position, const unsigned int maxEntries, std::vector<CacheListEntry>& entries)
+{
+  // the index and the in-memory entries are looked up one after the other, so that the two locks are never nested.
+  const vector<CacheListEntry>::size_type firstEntry = entries.size();
+  CacheGarbageCollection_LocalFileLister lister(cacheRootDirectory, entries);
+  const bool hasMoreEntries = localFileIndex.visit(lister, position, maxEntries);
+  Mutex::scoped_lock lock(cacheIndex_mutex);
+  for(vector<CacheListEntry>::size_type i = firstEntry; i < entries.size(); i++) {
+    map<string, CacheEntry>::const_iterator cit = cacheIndex.find(entries[i].localCacheFileName);
+    if(cit == cacheIndex.end())
+      continue;
+    entries[i].isIndexed = true;
+    entries[i].entry     = cit->second;
+  }
+  return hasMoreEntries;
+}
+
+void CacheGarbageCollection::saveLocalFileCollection()
+{
+  localFileIndex.checkpoint();
+}
+
+void CacheGarbageCollection::importLocalFileCollectionCSV()
+{
+  // older versions kept the list in a CSV file, which is read only once.
+  ifstream ist(localCacheCollectionFile.c_str());
+  if(!ist)
     return;
+  int numberOfImportedEntries = 0;
+  string line;
+  vector<string> cvs;
+  while(getline(ist, line)) {
+    if(line.empty())
+      continue;
+    CSVParse(line, cvs);
+    if(cvs.size() < 2)
+      continue;
+    // the cache file may have been moved into its shard directory.
+    const string cacheFileName = getCacheFileNameOf(cvs[0]);
+    struct stat st;
+    if(!isCacheFileName(cacheFileName.c_str()) || stat(makeCacheFilePath(cacheRootDirectory, cacheFileName).c_str(), &st) != 0)
+      continue;
+    // the attributes of the original file are not known; the cache file has its date instead.
+    CacheFileMetadata metadata;
+    metadata.size = st.st_size;
+    if(localFileIndex.put(cacheFileName, cvs[1], metadata))
+      numberOfImportedEntries++;
   }
+  localFileIndex.checkpoint();
+  const string importedFileName = localCacheCollectionFile + ".old";
+  if(rename(localCacheCollectionFile.c_str(), importedFileName.c_str()) != 0)
+    logprintf(0, LOG_ERROR, "Could not rename '%s' to '%s'. (errno=%d)\n", localCacheCollectionFile.c_str(), importedFileName.c_str(), errno);
+  logprintf(0, LOG_INFO, "%d entries are imported from '%s'.\n", numberOfImportedEntries, localCacheCollectionFile.c_str());
 }
 
 void CacheGarbageCollection::initLocalFileCollection()
 {
-  int numberOfDeletedEntries = 0;
-  {
-    Mutex::scoped_lock lock(localCacheCollectionFile_mutex);
-
-    localCacheFileName2originalFullPathName.clear();
-    ifstream ist(localCacheCollectionFile.c_str());
-    if(!ist) {
-      const bool fileWasNotFound = access(localCacheCollectionFile.c_str(), F_OK) != 0;
-      if(fileWasNotFound) {
-	lock.unlock(); // avoid recursive lock.
-	logprintf(0, LOG_INFO, "Not found local cache collection file '%s'. Create an empty one.\n", localCacheCollectionFile.c_str());
-	saveLocalFileCollection();
-      } else {
-	logprintf(0, LOG_ERROR, "Could not open local cache collection file '%s'. Use an empty list.\n", localCacheCollectionFile.c_str());
-      }
-      return;
-    }
-    string line;
-    vector<string> cvs;
-    while(getline(ist, line)) {
-      if(line.empty())
-	continue;
-      CSVParse(line, cvs);
-      if(cvs.size() >= 2) {
-	const string& localCacheFileName = cvs[0];
-	const string& originalFullPathName = cvs[1];
-	const bool localFileFound = access(localCacheFileName.c_str(), F_OK) == 0;
-	if(localFileFound) {
-	  if(localCacheFileName2originalFullPathName.count(localCacheFileName))
-	    numberOfDeletedEntries++;
-	  localCacheFileName2originalFullPathName[localCacheFileName] = originalFullPathName;
-	} else {
-	  numberOfDeletedEntries++;
-	}
-      }
-    }
+  bool isCreated;
+  if(!localFileIndex.open(cacheRootDirectory + "/localfiles", &isCreated)) {
+    logprintf(0, LOG_ERROR, "Could not open the local cache collection in '%s'. The original paths are not kept.\n", cacheRootDirectory.c_str());
+    return;
   }
-  if(0 < numberOfDeletedEntries) {
-    logprintf(0, LOG_INFO, "%d files are removed from the local cache list.\n", numberOfDeletedEntries );
-    saveLocalFileCollection();
+  if(isCreated)
+    importLocalFileCollectionCSV();
+  // the entries whose cache files have gone are removed by the first scan.
+}
+
+void CacheGarbageCollection::restoreCacheEntryMetadata()
+{
+  CacheGarbageCollection_LocalFileCollector collector(cacheRootDirectory);
+  localFileIndex.visit(collector);
+  Mutex::scoped_lock lock(cacheIndex_mutex);
+  for(map<string, CacheFileMetadata>::const_iterator cit = collector.metadata.begin(); cit != collector.metadata.end(); ++cit) {
+    map<string, CacheEntry>::iterator it = cacheIndex.find(cit->first);
+    if(it == cacheIndex.end())
+      continue;
+    it->second.accessCount = max<int>(it->second.accessCount, cit->second.accessCount);
   }
 }
 
@@ -283,51 +655,74 @@ void CacheGarbageCollection::init(const char* cacheRootDirectory,
       s.resize(s.size() - 1);
     }
   }
-  this->localCacheCollectionFile = this->cacheRootDirectory + "/localfiles.csv";
+  this->localCacheCollectionFile = this->cacheRootDirectory + "/localfiles.csv"; // of older versions
 
-  if(softLimitInKBytes != AUTO) {
-    this->softLimitInKBytes   = softLimitInKBytes;
-  } else {
-    struct statfs sfs;
-    if(statCacheRootDir(&sfs)) {
-      this->softLimitInKBytes = (long)((long long)sfs.f_bsize * sfs.f_blocks * 0.2 / 1024);
+  this->isSoftLimitAuto   = softLimitInKBytes == AUTO;
+  this->isHardLimitAuto   = hardLimitInKBytes == AUTO;
+  this->softLimitInKBytes = softLimitInKBytes;
+  this->hardLimitInKBytes = hardLimitInKBytes;
+  updateLimits();
+
+  migrateFlatCacheFiles();
+  initLocalFileCollection();
+  this->initialized        = true;
+}
+
+void CacheGarbageCollection::updateLimits()
+{
+  // the disk may be resized or mounted after tgefs is started, so the limits are re-evaluated every time.
+  struct statfs sfs;
+  const bool statSucceeded = (isSoftLimitAuto || isHardLimitAuto) && statCacheRootDir(&sfs);
+  if(isSoftLimitAuto) {
+    if(statSucceeded) {
+      this->softLimitInKBytes = (long long)((long long)sfs.f_bsize * sfs.f_blocks * 0.2 / 1024);
     } else {
       this->softLimitInKBytes = 30 * 1024 * 1024; // 30Gbytes
     }
   }
-
-  if(hardLimitInKBytes != AUTO) {
-    this->hardLimitInKBytes  = hardLimitInKBytes;
-  } else {
-    struct statfs sfs;
-    if(statCacheRootDir(&sfs)) {
-      this->hardLimitInKBytes = (long)((long long)sfs.f_bsize * sfs.f_blocks * 0.1 / 1024);
+  if(isHardLimitAuto) {
+    if(statSucceeded) {
+      this->hardLimitInKBytes = (long long)((long long)sfs.f_bsize * sfs.f_blocks * 0.1 / 1024);
     } else {
-      this->softLimitInKBytes = 10 * 1024 * 1024; // 10Gbytes
+      this->hardLimitInKBytes = 10 * 1024 * 1024; // 10Gbytes
     }
   }
-
-  initLocalFileCollection();
-  this->localCacheCollection_SolidText_isDirty = true;
-  this->initialized        = true;
 }
 
-struct File {
-  string name;
-  long long   size;
-  time_t      lastAccessTime;
-  uid_t       owner;
-
-  File() {
-    size = -1ll;
+long long CacheGarbageCollection::getGarbageSizeToBeCollected(const long long totalSizeUsed)
+{
+  struct statfs sfs;
+  if(!statCacheRootDir(&sfs)) {
+    logprintf(0, LOG_ERROR, "statfs failed for cachrroot '%s'\n", cacheRootDirectory.c_str());
+    return 0ll;
   }
-  File(const string& name) : name(name) {
-    size = -1ll;
+  long long limitSize = -1ll;
+  const long long totalCapacity     = sfs.f_bsize * (long long)sfs.f_blocks;
+  const long long availableCapacity = sfs.f_bsize * (long long)sfs.f_bavail;
+  const long long thresholdCapacity = (long long)(totalCapacity * (1.0 - GC_apply_hardLimit_ratio_of_HDD_usage));
+  logprintf(3, LOG_DEBUG, "Total capacity = %lld bytes\n", totalCapacity);
+  logprintf(3, LOG_DEBUG, "Avail capacity = %lld bytes\n", availableCapacity);
+  logprintf(3, LOG_DEBUG, "Thres capacity = %lld bytes\n", thresholdCapacity);
+  if(availableCapacity < thresholdCapacity) {
+    limitSize = softLimitInKBytes * 1024ll;
+    logprintf(3, LOG_DEBUG, "Use soft limit, %lld bytes\n", limitSize);
+  } else {
+    limitSize = hardLimitInKBytes * 1024ll;
+    logprintf(3, LOG_DEBUG, "Use hard limit, %lld bytes\n", limitSize);
   }
-};
-
-inline bool sortByAccessTime(File* a, File* b) {
-  return a->lastAccessTime < b->lastAccessTime;
+  {
+    Mutex::scoped_lock lock(cacheIndex_mutex);
+    currentLimitInBytes = limitSize;
+  }
+  // high watermarks are the limit and the low free space, and we evict files until reaching the low watermarks.
+  long long garbageSize = 0ll;
+  if(limitSize < totalSizeUsed) {
+    garbageSize = totalSizeUsed - (long long)(limitSize * GC_low_watermark_ratio_of_limit);
+  }
+  if(availableCapacity < totalCapacity * GC_free_space_low_watermark_ratio) {
+    garbageSize = max<long long>(garbageSize, (long long)(totalCapacity * GC_free_space_high_watermark_ratio) - availableCapacity);
+  }
+  return max<long long>(0ll, garbageSize);
 }
 
 std::string CacheGarbageCollection::fullPath(const std::string& path)
@@ -344,64 +739,598 @@ bool CacheGarbageCollection::statCacheRootDir(struct statfs* sfs) {
   return true;
 }
 
-void CacheGarbageCollection::collect(const Cache_LockedFileChecker& clfc)
+void CacheGarbageCollection::collectCacheFiles(const std::string& directory, const int shardLevel, std::vector<std::string>& files)
 {
-  if(!initialized) {
-    logprintf(0, LOG_ERROR, "Garbage collection maneger is called without initialization.\n");
+  vector<string> names;
+  if(!listDirectory(directory, names))
     return;
+  for(unsigned int i = 0; i < names.size(); i++) {
+    const char* name = names[i].c_str();
+    if(shardLevel < CACHE_SHARD_LEVELS) {
+      if(isHexadecimalName(name, CACHE_SHARD_NAME_LENGTH))
+	collectCacheFiles(directory + "/" + names[i], shardLevel + 1, files);
+    } else {
+      if(isCacheFileName(name))
+	files.push_back(directory + "/" + names[i]);
+    }
   }
-  Mutex::scoped_lock lock(garbageCollection_mutex);
-  logprintf(0, LOG_INFO, "Garbage collection started\n");
+}
 
-  // Step 1) List the files in my cache directory.
-  DIR* dirp = opendir(cacheRootDirectory.c_str());
-  if(dirp == NULL) {
-    logprintf(0, LOG_ERROR, "Could not opendir '%s'\n", cacheRootDirectory.c_str());
+void CacheGarbageCollection::migrateFlatCacheFiles()
+{
+  // older versions put all the cache files right under the cache root directory.
+  vector<string> names;
+  if(!listDirectory(cacheRootDirectory, names))
+    return;
+  int numberOfMigratedFiles = 0;
+  for(unsigned int i = 0; i < names.size(); i++) {
+    if(!isCacheFileName(names[i].c_str()))
+      continue;
+    const string oldPath = fullPath(names[i]);
+    const string newPath = makeCacheFilePath(cacheRootDirectory, names[i]);
+    if(!ensureCacheFileDirectory(newPath) || rename(oldPath.c_str(), newPath.c_str()) == -1) {
+      logprintf(0, LOG_ERROR, "Could not move cache file '%s' to '%s'. (errno=%d)\n", oldPath.c_str(), newPath.c_str(), errno);
+      continue;
+    }
+    numberOfMigratedFiles++;
+  }
+  if(0 < numberOfMigratedFiles)
+    logprintf(0, LOG_INFO, "%d cache files are moved into shard directories.\n", numberOfMigratedFiles);
+}
+
+void CacheGarbageCollection::insertCacheEntry_internal_shouldBeCalledWithMutexLocked(const std::string& localCacheFileName, const CacheEntry& entry)
+{
+  map<string, CacheEntry>::iterator it = cacheIndex.find(localCacheFileName);
+  const bool isNewEntry = it == cacheIndex.end();
+  if(!isNewEntry) {
+    const CacheEntry& oldEntry = it->second;
+    cacheIndex_agingOrder.erase(make_pair(oldEntry.lastAccessTime, localCacheFileName));
+    if(isManagedOwner(oldEntry.owner)) {
+      cacheIndex_totalSizeOfMyFiles -= oldEntry.size;
+      cacheIndex_numberOfMyFiles--;
+      cacheIndex_sizeByOwner[oldEntry.owner] -= oldEntry.size;
+    }
+  }
+  cacheIndex[localCacheFileName] = entry;
+  cacheIndex_agingOrder.insert(make_pair(entry.lastAccessTime, localCacheFileName));
+  if(isManagedOwner(entry.owner)) {
+    cacheIndex_totalSizeOfMyFiles += entry.size;
+    cacheIndex_numberOfMyFiles++;
+    cacheIndex_sizeByOwner[entry.owner] += entry.size;
+  }
+  // an update must not be a removal followed by an insertion, which loses the history kept by the policy.
+  if(isNewEntry)
+    evictionPolicy->insert(localCacheFileName, entry);
+  else
+    evictionPolicy->access(localCacheFileName, entry);
+}
+
+void CacheGarbageCollection::removeCacheEntry_internal_shouldBeCalledWithMutexLocked(const std::string& localCacheFileName, const bool isEvicted)
+{
+  map<string, CacheEntry>::iterator it = cacheIndex.find(localCacheFileName);
+  if(it == cacheIndex.end())
+    return;
+  const CacheEntry& entry = it->second;
+  cacheIndex_agingOrder.erase(make_pair(entry.lastAccessTime, localCacheFileName));
+  if(isManagedOwner(entry.owner)) {
+    cacheIndex_totalSizeOfMyFiles -= entry.size;
+    cacheIndex_numberOfMyFiles--;
+    cacheIndex_sizeByOwner[entry.owner] -= entry.size;
+  }
+  evictionPolicy->remove(localCacheFileName, isEvicted);
+  cacheIndex.erase(it);
+}
+
+void CacheGarbageCollection::simulateReference_internal_shouldBeCalledWithMutexLocked(const std::string& localCacheFileName, const CacheEntry& entry)
+{
+  if(currentLimitInBytes < 0)
+    return; // the limit is not known until the first garbage collection
+  for(unsigned int i = 0; i < policySimulators.size(); i++)
+    policySimulators[i]->reference(localCacheFileName, entry, currentLimitInBytes);
+}
+
+bool CacheGarbageCollection::statCacheEntry(const std::string& localCacheFileName, CacheEntry& entry)
+{
+  struct stat statResult;
+  if(stat(localCacheFileName.c_str(), &statResult) == -1)
+    return false;
+  entry.size           = statResult.st_size;
+  entry.lastAccessTime = std::max<time_t>(statResult.st_atime, statResult.st_mtime);
+  entry.owner          = statResult.st_uid;
+  // the cache files are owned by root when tgefs runs as root, and the index knows who fetched them.
+  CacheFileMetadata metadata;
+  if(myUID == 0 && localFileIndex.find(getCacheFileNameOf(localCacheFileName), NULL, &metadata) && metadata.hasOwner)
+    entry.owner = metadata.owner;
+  return true;
+}
+
+void CacheGarbageCollection::registerCacheEntry(const std::string& localCacheFileName, const uid_t owner)
+{
+  CacheEntry entry;
+  if(!statCacheEntry(localCacheFileName, entry)) {
+    logprintf(0, LOG_ERROR, "Could not stat cache file '%s' to register. (errno=%d)\n", localCacheFileName.c_str(), errno);
+    return;
+  }
+  entry.lastAccessTime = time(NULL);
+  if(myUID == 0)
+    entry.owner = owner;
+  Mutex::scoped_lock lock(cacheIndex_mutex);
+  map<string, CacheEntry>::const_iterator cit = cacheIndex.find(localCacheFileName);
+  if(cit != cacheIndex.end()) {
+    entry.accessCount   = cit->second.accessCount;
+    entry.priorityClass = cit->second.priorityClass;
+    entry.isPinned      = cit->second.isPinned;
+    entry.isDirty       = cit->second.isDirty;
+  }
+  entry.accessCount++;
+  numberOfCacheMisses++;
+  insertCacheEntry_internal_shouldBeCalledWithMutexLocked(localCacheFileName, entry);
+  simulateReference_internal_shouldBeCalledWithMutexLocked(localCacheFileName, entry);
+}
+
+void CacheGarbageCollection::touchCacheEntry(const std::string& localCacheFileName)
+{
+  Mutex::scoped_lock lock(cacheIndex_mutex);
+  map<string, CacheEntry>::const_iterator cit = cacheIndex.find(localCacheFileName);
+  CacheEntry entry;
+  if(cit != cacheIndex.end()) {
+    entry = cit->second;
+  } else {
+    // not indexed yet if it is cached after the last scan by another instance of tgefs.
+    lock.unlock();
+    if(!statCacheEntry(localCacheFileName, entry)) {
+      logprintf(0, LOG_ERROR, "Could not stat cache file '%s' to register. (errno=%d)\n", localCacheFileName.c_str(), errno);
+      return;
+    }
+    lock.lock();
+  }
+  entry.lastAccessTime = time(NULL);
+  entry.accessCount++;
+  numberOfCacheHits++;
+  insertCacheEntry_internal_shouldBeCalledWithMutexLocked(localCacheFileName, entry);
+  simulateReference_internal_shouldBeCalledWithMutexLocked(localCacheFileName, entry);
+}
+
+void CacheGarbageCollection::updateCacheEntry(const std::string& localCacheFileName)
+{
+  CacheEntry entry;
+  if(!statCacheEntry(localCacheFileName, entry)) {
+    logprintf(0, LOG_ERROR, "Could not stat cache file '%s' to update. (errno=%d)\n", localCacheFileName.c_str(), errno);
+    return;
+  }
+  entry.lastAccessTime = time(NULL);
+  Mutex::scoped_lock lock(cacheIndex_mutex);
+  map<string, CacheEntry>::const_iterator cit = cacheIndex.find(localCacheFileName);
+  if(cit != cacheIndex.end()) {
+    entry.owner         = cit->second.owner;
+    entry.accessCount   = cit->second.accessCount;
+    entry.priorityClass = cit->second.priorityClass;
+    entry.isPinned      = cit->second.isPinned;
+    entry.isDirty       = cit->second.isDirty;
+  }
+  insertCacheEntry_internal_shouldBeCalledWithMutexLocked(localCacheFileName, entry);
+}
+
+void CacheGarbageCollection::setCacheEntryDirty(const std::string& localCacheFileName, const bool isDirty)
+{
+  Mutex::scoped_lock lock(cacheIndex_mutex);
+  map<string, CacheEntry>::iterator it = cacheIndex.find(localCacheFileName);
+  if(it != cacheIndex.end())
+    it->second.isDirty = isDirty;
+}
+
+void CacheGarbageCollection::applyPriorityClass(const std::string& localCacheFileName, const std::string& originalFullPathName)
+{
+  if(priorityClassifier == NULL)
+    return;
+  const int priorityClass = priorityClassifier->classify(originalFullPathName);
+  Mutex::scoped_lock lock(cacheIndex_mutex);
+  map<string, CacheEntry>::iterator it = cacheIndex.find(localCacheFileName);
+  if(it != cacheIndex.end()) {
+    it->second.priorityClass = priorityClass;
+    it->second.isPinned      = priorityClass == PRIORITY_PINNED;
+  }
+}
+
+void CacheGarbageCollection::applyPriorityClassesIfRulesChanged()
+{
+  if(priorityClassifier == NULL)
+    return;
+  const int version = priorityClassifier->getVersion();
+  if(version == appliedPriorityRulesVersion)
+    return;
+  CacheGarbageCollection_LocalFileCollector collector(cacheRootDirectory);
+  localFileIndex.visit(collector);
+  map<string, int> priorityClasses;
+  for(map<string, string>::const_iterator cit = collector.originalFullPathNames.begin(); cit != collector.originalFullPathNames.end(); ++cit)
+    priorityClasses[cit->first] = priorityClassifier->classify(cit->second);
+  int numberOfPinnedFiles = 0;
+  {
+    Mutex::scoped_lock lock(cacheIndex_mutex);
+    for(map<string, CacheEntry>::iterator it = cacheIndex.begin(); it != cacheIndex.end(); ++it) {
+      map<string, int>::const_iterator cit = priorityClasses.find(it->first);
+      it->second.priorityClass = cit != priorityClasses.end() ? cit->second : (int)PRIORITY_NORMAL;
+      it->second.isPinned      = it->second.priorityClass == PRIORITY_PINNED;
+      if(it->second.isPinned)
+	numberOfPinnedFiles++;
+    }
+  }
+  appliedPriorityRulesVersion = version;
+  logprintf(1, LOG_INFO, "Priority rules are applied to %d files. %d files are pinned.\n", (int)priorityClasses.size(), numberOfPinnedFiles);
+}
+
+bool CacheGarbageCollection::hasCacheEntry(const std::string& localCacheFileName)
+{
+  {
+    Mutex::scoped_lock lock(cacheIndex_mutex);
+    if(0 < cacheIndex.count(localCacheFileName))
+      return true;
+    if(isValidated)
+      return false;
+  }
+  CacheEntry entry;
+  if(!statCacheEntry(localCacheFileName, entry))
+    return false;
+  Mutex::scoped_lock lock(cacheIndex_mutex);
+  if(cacheIndex.count(localCacheFileName) == 0)
+    insertCacheEntry_internal_shouldBeCalledWithMutexLocked(localCacheFileName, entry);
+  return true;
+}
+
+bool CacheGarbageCollection::getCacheEntry(const std::string& localCacheFileName, CacheEntry& entry)
+{
+  Mutex::scoped_lock lock(cacheIndex_mutex);
+  map<string, CacheEntry>::const_iterator cit = cacheIndex.find(localCacheFileName);
+  if(cit == cacheIndex.end())
+    return false;
+  entry = cit->second;
+  return true;
+}
+
+void CacheGarbageCollection::adoptCacheEntry(const std::string& localCacheFileName, const CacheEntry& entry, const std::string& originalFullPathName,
+					     const SourceFileAttributes& source)
+{
+  CacheEntry adoptedEntry = entry;
+  if(!statCacheEntry(localCacheFileName, adoptedEntry)) {
+    logprintf(0, LOG_ERROR, "Could not stat cache file '%s' to adopt. (errno=%d)\n", localCacheFileName.c_str(), errno);
     return;
   }
-  vector<File> files;
+  adoptedEntry.lastAccessTime = entry.lastAccessTime;
+  adoptedEntry.owner          = entry.owner;
   {
-    struct dirent oneEntry;
-    struct dirent *result;
-    int resultStatus;
-    while((resultStatus = readdir_r(dirp, &oneEntry, &result)) == 0) {
-      if(result == NULL)
-	break; // reached the end
-      if(strcmp(oneEntry.d_name, "tgefslog") != 0 && oneEntry.d_name[0] != '.') { // exclude log file, '.', '..' and other hidden files
-	files.push_back(File(oneEntry.d_name));
+    Mutex::scoped_lock lock(cacheIndex_mutex);
+    insertCacheEntry_internal_shouldBeCalledWithMutexLocked(localCacheFileName, adoptedEntry);
+  }
+  if(!originalFullPathName.empty())
+    appendLocalFileCollection(localCacheFileName, originalFullPathName, source);
+  accessedFile(adoptedEntry.size);
+}
+
+void CacheGarbageCollection::forgetCacheEntry(const std::string& localCacheFileName)
+{
+  {
+    Mutex::scoped_lock lock(cacheIndex_mutex);
+    removeCacheEntry_internal_shouldBeCalledWithMutexLocked(localCacheFileName, false);
+  }
+  removeLocalFileCollection(localCacheFileName);
+}
+
+// Lists and stats the cache files in the shard directories handed out by the garbage collection.
+class CacheGarbageCollection_ShardScanner : public PThread {
+  CacheGarbageCollection& gc;
+  void run() { scan(); }
+ public:
+  std::map<std::string, CacheEntry> scannedEntries;
+  CacheGarbageCollection_ShardScanner(CacheGarbageCollection& gc) : gc(gc) {}
+  void scan() {
+    string shardDirectory;
+    while(gc.takeShardToScan(shardDirectory)) {
+      vector<string> files;
+      gc.collectCacheFiles(shardDirectory, 1, files);
+      for(unsigned int i = 0; i < files.size(); i++) {
+	CacheEntry entry;
+	if(!gc.statCacheEntry(files[i], entry)) {
+	  logprintf(0, LOG_ERROR, "stat failed during scanning the cache directory. (errno=%d)\n", errno);
+	  continue;
+	}
+	scannedEntries[files[i]] = entry;
       }
+      gc.reportShardScanned(files.size());
     }
-    closedir(dirp);
-    if(resultStatus != 0) {
-      logprintf(0, LOG_ERROR, "readdir failed. (errno=%d)\n", result);
-      return;
+  }
+};
+
+bool CacheGarbageCollection::takeShardToScan(std::string& shardDirectory)
+{
+  {
+    Mutex::scoped_lock lock(evictionThread_mutex);
+    if(isEvictionThreadStopping) {
+      Mutex::scoped_lock scanLock(scan_mutex);
+      isScanInterrupted = true;
+      return false;
     }
   }
-  // Step 2) Examine the file size for each file which is owned by myself.
-  for(unsigned int i = 0; i < files.size(); i++) {
-    File& f = files[i];
-    struct stat statResult;
-    const int result = stat(fullPath(f.name).c_str(), &statResult);
-    if(result == -1) {
-      logprintf(0, LOG_ERROR, "stat failed during GC. (errno=%d)\n", errno);
-      return;
+  Mutex::scoped_lock lock(scan_mutex);
+  if(shardsToScan.size() <= nextShardToScan)
+    return false;
+  shardDirectory = shardsToScan[nextShardToScan++];
+  return true;
+}
+
+void CacheGarbageCollection::reportShardScanned(const int numberOfFiles)
+{
+  Mutex::scoped_lock lock(scan_mutex);
+  numberOfScannedFiles += numberOfFiles;
+}
+
+bool CacheGarbageCollection::rescanCacheDirectory()
+{
+  logprintf(0, LOG_INFO, "Scanning cache directory '%s'\n", cacheRootDirectory.c_str());
+  const time_t scanStartTime = time(NULL);
+  // Step 1) List the top-level shard directories. (the log file and the local file collection are excluded)
+  {
+    vector<string> names;
+    listDirectory(cacheRootDirectory, names);
+    Mutex::scoped_lock lock(scan_mutex);
+    shardsToScan.clear();
+    for(unsigned int i = 0; i < names.size(); i++) {
+      if(isHexadecimalName(names[i].c_str(), CACHE_SHARD_NAME_LENGTH))
+	shardsToScan.push_back(fullPath(names[i]));
     }
-    f.size           = statResult.st_size;
-    f.lastAccessTime = std::max<time_t>(statResult.st_atime, statResult.st_mtime);
-    f.owner          = statResult.st_uid;
+    nextShardToScan      = 0;
+    isScanInterrupted    = false;
+    numberOfScannedFiles = 0ll;
   }
-  long long totalSizeUsed = 0;
-  int numberOfFiles = 0;
+  // Step 2) Examine the size, the last access time and the owner of each file.
+  //         The shard directories are scanned in parallel, including this thread.
+  map<string, CacheEntry> scannedEntries;
   {
-    const uid_t myUID = getuid();
-    for(unsigned int i = 0; i < files.size(); i++) {
-      const File& f = files[i];
-      if(f.owner == myUID) {
-	numberOfFiles++;
-	totalSizeUsed += f.size;
+    vector<CacheGarbageCollection_ShardScanner*> scanners;
+    scanners.push_back(new CacheGarbageCollection_ShardScanner(*this));
+    for(int i = 1; i < scanThreads; i++) {
+      CacheGarbageCollection_ShardScanner* scanner = new CacheGarbageCollection_ShardScanner(*this);
+      if(!scanner->start()) {
+	delete scanner;
+	break;
       }
+      scanners.push_back(scanner);
+    }
+    scanners[0]->scan();
+    for(unsigned int i = 0; i < scanners.size(); i++) {
+      if(0 < i)
+	scanners[i]->join();
+      scannedEntries.insert(scanners[i]->scannedEntries.begin(), scanners[i]->scannedEntries.end());
+      delete scanners[i];
+    }
+  }
+  {
+    Mutex::scoped_lock lock(scan_mutex);
+    if(isScanInterrupted) {
+      logprintf(0, LOG_INFO, "Scanning cache directory '%s' is interrupted.\n", cacheRootDirectory.c_str());
+      return false;
     }
   }
+  // Step 3) Reconcile the index with the directory.
+  int numberOfFixedEntries = 0;
+  {
+    Mutex::scoped_lock lock(cacheIndex_mutex);
+    vector<string> vanishedEntries;
+    for(map<string, CacheEntry>::const_iterator cit = cacheIndex.begin(); cit != cacheIndex.end(); ++cit) {
+      // files cached while scanning may have been missed.
+      if(scannedEntries.count(cit->first) == 0 && cit->second.lastAccessTime < scanStartTime)
+	vanishedEntries.push_back(cit->first);
+    }
+    for(unsigned int i = 0; i < vanishedEntries.size(); i++) {
+      removeCacheEntry_internal_shouldBeCalledWithMutexLocked(vanishedEntries[i], false);
+      numberOfFixedEntries++;
+    }
+    // the policy is fed from the least recently used entry, so that it starts with the order of the last access times.
+    set<pair<time_t, string> > entriesToBeUpdated;
+    for(map<string, CacheEntry>::iterator it = scannedEntries.begin(); it != scannedEntries.end(); ++it) {
+      CacheEntry& entry = it->second;
+      map<string, CacheEntry>::const_iterator cit = cacheIndex.find(it->first);
+      if(cit != cacheIndex.end()) {
+	const CacheEntry& indexedEntry = cit->second;
+	if(indexedEntry.size == entry.size && indexedEntry.owner == entry.owner)
+	  continue;
+	entry.lastAccessTime = std::max<time_t>(entry.lastAccessTime, indexedEntry.lastAccessTime);
+	entry.accessCount    = indexedEntry.accessCount;
+	entry.priorityClass  = indexedEntry.priorityClass;
+	entry.isPinned       = indexedEntry.isPinned;
+	entry.isDirty        = indexedEntry.isDirty;
+      }
+      entriesToBeUpdated.insert(make_pair(entry.lastAccessTime, it->first));
+    }
+    for(set<pair<time_t, string> >::const_iterator cit = entriesToBeUpdated.begin(); cit != entriesToBeUpdated.end(); ++cit) {
+      insertCacheEntry_internal_shouldBeCalledWithMutexLocked(cit->second, scannedEntries[cit->second]);
+      numberOfFixedEntries++;
+    }
+  }
+  // Step 4) Remove the entries of the local file collection whose files have gone.
+  int numberOfRemovedPaths = 0;
+  {
+    CacheGarbageCollection_LocalFileCollector collector(cacheRootDirectory);
+    localFileIndex.visit(collector);
+    for(map<string, string>::const_iterator cit = collector.originalFullPathNames.begin(); cit != collector.originalFullPathNames.end(); ++cit) {
+      if(scannedEntries.count(cit->first) != 0 || hasCacheEntry(cit->first))
+	continue;
+      if(access(cit->first.c_str(), F_OK) != 0 && localFileIndex.remove(getCacheFileNameOf(cit->first)))
+	numberOfRemovedPaths++;
+    }
+  }
+  lastConsistencyCheckTime = time(NULL);
+  logprintf(0, LOG_INFO, "Scanned %d cache files. %d index entries are updated, and %d paths are removed from the local cache list.\n",
+	    (int)scannedEntries.size(), numberOfFixedEntries, numberOfRemovedPaths);
+  return true;
+}
+
+void CacheGarbageCollection::validateCacheDirectory()
+{
+  if(!rescanCacheDirectory())
+    return;
+  restoreCacheEntryMetadata();
+  {
+    Mutex::scoped_lock lock(cacheIndex_mutex);
+    isValidated = true;
+  }
+  logprintf(0, LOG_INFO, "Cache directory '%s' is validated.\n", cacheRootDirectory.c_str());
+}
+
+// When tgefs runs as root, the files of all users are candidates. Users over their quota
+// lose their files first, and then the user who uses the most for the weight does,
+// so that one user's bulk job cannot take up the whole cache. The files are picked
+// while the eviction order is visited, so that the visit stops as soon as enough
+// files are picked, instead of going through all the files of the cache.
+class CacheGarbageCollection_VictimCollector : public EvictionPolicy_Visitor {
+  const std::map<std::string, CacheEntry>& cacheIndex;
+  const Cache_LockedFileChecker&     clfc;
+  const uid_t                        myUID;
+  const long long                    garbageSizeToBeCollected;
+  const double                       quotaLowWatermarkRatio;
+  std::map<uid_t, long long>         usageByOwner;
+  std::map<uid_t, std::deque<std::string> > candidatesByOwner;
+
+  // returns 0 if the user is not over the quota.
+  long long getExcessOverQuota(const uid_t owner) {
+    const long long quota = CacheGarbageCollection::getUserQuotaInBytes(owner);
+    if(quota <= 0 || usageByOwner[owner] <= quota * quotaLowWatermarkRatio)
+      return 0ll;
+    return usageByOwner[owner] - (long long)(quota * quotaLowWatermarkRatio);
+  }
+  // chooses the user over the quota the most, or the user with the largest usage per weight
+  // if more space should be collected. Users without a candidate are skipped if candidatesOnly.
+  bool chooseOwner(const bool candidatesOnly, uid_t* chosenOwner) {
+    bool   isChosen          = false;
+    bool   isChosenOverQuota = false;
+    double chosenKey         = 0.0;
+    for(std::map<uid_t, long long>::const_iterator cit = usageByOwner.begin(); cit != usageByOwner.end(); ++cit) {
+      if(cit->second <= 0)
+	continue;
+      if(candidatesOnly) {
+	std::map<uid_t, std::deque<std::string> >::const_iterator candidates = candidatesByOwner.find(cit->first);
+	if(candidates == candidatesByOwner.end() || candidates->second.empty())
+	  continue;
+      }
+      const long long excess      = getExcessOverQuota(cit->first);
+      const bool      isOverQuota = 0 < excess;
+      if(!isOverQuota && garbageSizeToBeCollected <= sizeOfVictims)
+	continue;
+      const double key = isOverQuota ? (double)excess : cit->second / CacheGarbageCollection::getUserWeight(cit->first);
+      if(!isChosen || (isOverQuota && !isChosenOverQuota) || (isOverQuota == isChosenOverQuota && chosenKey < key)) {
+	isChosen          = true;
+	isChosenOverQuota = isOverQuota;
+	chosenKey         = key;
+	*chosenOwner      = cit->first;
+      }
+    }
+    return isChosen;
+  }
+  // picks the candidates of the chosen users. If candidatesOnly is false, it stops when the
+  // chosen user has no candidate yet, which may be found later in the eviction order.
+  void pickCandidates(const bool candidatesOnly) {
+    uid_t owner;
+    while(chooseOwner(candidatesOnly, &owner)) {
+      std::deque<std::string>& candidates = candidatesByOwner[owner];
+      if(candidates.empty())
+	break;
+      const std::string fullPathName = candidates.front();
+      candidates.pop_front();
+      pick(fullPathName);
+    }
+  }
+ public:
+  int                                             priorityClassToVisit;
+  std::vector<std::pair<std::string, long long> > victims;
+  std::set<std::string>                           victimNames;
+  std::set<std::string>                           agedVictimNames;
+  long long                                       sizeOfVictims;
+
+  CacheGarbageCollection_VictimCollector(const std::map<std::string, CacheEntry>& cacheIndex, const Cache_LockedFileChecker& clfc, const uid_t myUID, const long long garbageSizeToBeCollected,
+					 const std::map<uid_t, long long>& usageByOwner, const double quotaLowWatermarkRatio)
+    : cacheIndex(cacheIndex), clfc(clfc), myUID(myUID), garbageSizeToBeCollected(garbageSizeToBeCollected), quotaLowWatermarkRatio(quotaLowWatermarkRatio),
+      usageByOwner(usageByOwner), priorityClassToVisit(PRIORITY_SCRATCH), sizeOfVictims(0ll) {}
+  // returns false if enough space will be collected and nobody is over the quota.
+  bool needsMoreVictims() {
+    if(sizeOfVictims < garbageSizeToBeCollected)
+      return true;
+    if(myUID != 0)
+      return false;
+    for(std::map<uid_t, long long>::const_iterator cit = usageByOwner.begin(); cit != usageByOwner.end(); ++cit) {
+      if(0 < getExcessOverQuota(cit->first))
+	return true;
+    }
+    return false;
+  }
+  // returns false if the file cannot be evicted.
+  bool pick(const std::string& fullPathName) {
+    if(victimNames.count(fullPathName))
+      return false;
+    std::map<std::string, CacheEntry>::const_iterator cit = cacheIndex.find(fullPathName);
+    if(cit == cacheIndex.end())
+      return false;
+    const CacheEntry& entry = cit->second;
+    if((entry.owner != myUID && myUID != 0) || entry.isPinned || entry.isDirty)
+      return false;
+    if(clfc.isLockedFile(fullPathName)) {
+      logprintf(0, LOG_DEBUG, "%s is opened.\n", fullPathName.c_str());
+      return false;
+    }
+    victims.push_back(make_pair(fullPathName, entry.size));
+    victimNames.insert(fullPathName);
+    sizeOfVictims += entry.size;
+    usageByOwner[entry.owner] -= entry.size;
+    return true;
+  }
+  virtual bool visit(const std::string& fullPathName) {
+    std::map<std::string, CacheEntry>::const_iterator cit = cacheIndex.find(fullPathName);
+    if(cit == cacheIndex.end() || cit->second.priorityClass != priorityClassToVisit)
+      return true;
+    if(myUID != 0) {
+      pick(fullPathName);
+      return needsMoreVictims();
+    }
+    candidatesByOwner[cit->second.owner].push_back(fullPathName);
+    pickCandidates(false);
+    return needsMoreVictims();
+  }
+  // picks the candidates left when the visit has finished, where the chosen users may have no more.
+  void pickFairly() {
+    pickCandidates(true);
+    candidatesByOwner.clear();
+  }
+};
+
+// holds the lock of a cache file while the garbage collector deletes or moves it.
+class Cache_FileLock {
+  const Cache_LockedFileChecker& clfc;
+  KeyLockTable::Holder           holder;
+public:
+  Cache_FileLock(const Cache_LockedFileChecker& clfc) : clfc(clfc) {}
+  bool tryLock(const std::string& fullPathName) { return clfc.tryLockFile(fullPathName, holder); }
+  ~Cache_FileLock() { clfc.unlockFile(holder); }
+};
+
+void CacheGarbageCollection::collect(const Cache_LockedFileChecker& clfc)
+{
+  if(!initialized) {
+    logprintf(0, LOG_ERROR, "Garbage collection maneger is called without initialization.\n");
+    return;
+  }
+  Mutex::scoped_lock lock(garbageCollection_mutex);
+  logprintf(0, LOG_INFO, "Garbage collection started\n");
+
+  // Step 1) Check if the index is consistent with the cache directory once in a while.
+  if(lastConsistencyCheckTime + GC_consistency_check_period_in_seconds <= time(NULL)) {
+    rescanCacheDirectory();
+  }
+  // Step 2) Get the total size of the files which are owned by myself from the index.
+  long long totalSizeUsed;
+  int numberOfFiles;
+  {
+    Mutex::scoped_lock lock(cacheIndex_mutex);
+    totalSizeUsed = cacheIndex_totalSizeOfMyFiles;
+    numberOfFiles = cacheIndex_numberOfMyFiles;
+  }
   {
     const long long totalSizeUsedInKB = (totalSizeUsed + 1023) / 1024;
     const int totalSizeUsedInMB       = totalSizeUsedInKB / 1024;
@@ -411,84 +1340,91 @@ void CacheGarbageCollection::collect(const Cache_LockedFileChecker& clfc)
       logprintf(0, LOG_INFO, "%d.%02dGbytes (%d files) are used.\n", totalSizeUsedInMB / 1000, (totalSizeUsedInMB % 1000) / 10, numberOfFiles);
     }
   }
-  // Step 3) Determine which threshold we will use.
-  long long garbageSizeToBeCollected = 0ll;
+  // Step 3) Determine how much we should collect by the watermarks.
+  const long long garbageSizeToBeCollected = getGarbageSizeToBeCollected(totalSizeUsed);
+  logprintf(2, LOG_DEBUG, "%lld bytes to be collected\n", garbageSizeToBeCollected);
+  // Step 4) Pick too old files, and then pick files in the order given by the eviction policy
+  //         until enough space will be collected. Lower priority classes go first, and
+  //         pinned files are never picked.
+  applyPriorityClassesIfRulesChanged();
+  vector<pair<string, long long> > victims;
+  set<string>                      agedVictimNames;
   {
-    long long limitSize = -1ll;
-    struct statfs sfs;
-    if(!statCacheRootDir(&sfs)) {
-      logprintf(0, LOG_ERROR, "statfs failed for cachrroot '%s'\n", cacheRootDirectory.c_str());
-      return;
+    const int SECONDS_PER_DAY = 86400;
+    const time_t currentDate  = time(NULL);
+    const time_t oldDate      = currentDate - SECONDS_PER_DAY * GC_delete_cache_if_this_number_of_days_passed;
+    map<uid_t, long long> usageByOwner;
+    {
+      Mutex::scoped_lock lock(cacheIndex_mutex);
+      usageByOwner = cacheIndex_sizeByOwner;
     }
-    const long long totalCapacity     = sfs.f_bsize * (long long)sfs.f_blocks;
-    const long long availableCapacity = sfs.f_bsize * (long long)sfs.f_bavail;
-    const long long thresholdCapacity = (long long)(totalCapacity * (1.0 - GC_apply_hardLimit_ratio_of_HDD_usage));
-    logprintf(3, LOG_DEBUG, "Total capacity = %lld bytes\n", totalCapacity);
-    logprintf(3, LOG_DEBUG, "Avail capacity = %lld bytes\n", availableCapacity);
-    logprintf(3, LOG_DEBUG, "Thres capacity = %lld bytes\n", thresholdCapacity);
-    if(availableCapacity < thresholdCapacity) {
-      limitSize = softLimitInKBytes * 1024ll;
-      logprintf(2, LOG_DEBUG, "Use soft limit, %lld bytes\n", limitSize);
-    } else {
-      limitSize = hardLimitInKBytes * 1024ll;
-      logprintf(2, LOG_DEBUG, "Use hard limit, %lld bytes\n", limitSize);
+    CacheGarbageCollection_VictimCollector collector(cacheIndex, clfc, myUID, garbageSizeToBeCollected, usageByOwner, GC_low_watermark_ratio_of_limit);
+    {
+      Mutex::scoped_lock lock(cacheIndex_mutex);
+      for(set<pair<time_t, string> >::const_iterator cit = cacheIndex_agingOrder.begin(); cit != cacheIndex_agingOrder.end() && cit->first < oldDate; ++cit) {
+	if(collector.pick(cit->second))
+	  collector.agedVictimNames.insert(cit->second);
+      }
+    }
+    // the index is unlocked between the priority classes, as the victims are checked again before they are deleted.
+    for(int priorityClass = PRIORITY_SCRATCH; priorityClass < PRIORITY_PINNED; priorityClass++) {
+      if(!collector.needsMoreVictims())
+	break;
+      Mutex::scoped_lock lock(cacheIndex_mutex);
+      collector.priorityClassToVisit = priorityClass;
+      evictionPolicy->visitInEvictionOrder(collector);
+      collector.pickFairly();
     }
-    garbageSizeToBeCollected = max<long long>(0ll, totalSizeUsed - limitSize);
-    logprintf(2, LOG_DEBUG, "%lld bytes to be collected\n", garbageSizeToBeCollected);
+    victims.swap(collector.victims);
+    agedVictimNames.swap(collector.agedVictimNames);
   }
-  // Step 4) Delete too old files, other files are push_back'ed into candidates if they are mine.
+  // Step 5) Move them to the lower tier if any, or delete them. Too old files are always deleted.
   int       numberOfDeletedFiles   = 0;
+  int       numberOfDemotedFiles   = 0;
   long long totalSizeOfDeleteFiles = 0ll;
-
-  vector<File*> candidates;
-  {
-    const int SECONDS_PER_DAY = 86400;
-    const time_t currentDate  = time(NULL);
-    const time_t oldDate      = currentDate - SECONDS_PER_DAY * GC_delete_cache_if_this_number_of_days_passed;
-    const uid_t  myUID        = getuid();
-    for(unsigned int i = 0; i < files.size(); i++) {
-      File& file = files[i];
-      if(file.owner != myUID)
-	continue;
-      const string& fullPathName = fullPath(file.name);
-      if(clfc.isLockedFile(fullPathName)) {
-	logprintf(0, LOG_DEBUG, "%s is opened.\n", file.name.c_str());
+  for(unsigned int i = 0; i < victims.size(); i++) {
+    const string& fullPathName = victims[i].first;
+    // the victims were picked without the lock of each file, so the file may have been opened or
+    // written since then. A busy file is skipped rather than waited for, and is collected next time.
+    Cache_FileLock fileLock(clfc);
+    if(!fileLock.tryLock(fullPathName)) {
+      logprintf(3, LOG_DEBUG, "skipped %s because it is busy.\n", fullPathName.c_str());
+      continue;
+    }
+    CacheEntry entry;
+    const bool hasEntry = getCacheEntry(fullPathName, entry);
+    if(clfc.isLockedFile(fullPathName) || (hasEntry && (entry.isDirty || entry.isPinned))) {
+      logprintf(3, LOG_DEBUG, "skipped %s because it is in use.\n", fullPathName.c_str());
+      continue;
+    }
+    if(demotionTarget != NULL && agedVictimNames.count(fullPathName) == 0) {
+      if(hasEntry && demotionTarget->demote(fullPathName, getOriginalFullPathName(fullPathName), entry)) {
+	logprintf(3, LOG_DEBUG, "demoted %s.\n", fullPathName.c_str());
+	forgetCacheEntry(fullPathName);
+	numberOfDemotedFiles++;
+	totalSizeOfDeleteFiles += victims[i].second;
 	continue;
       }
-      if(file.lastAccessTime < oldDate) {
-	const int result = unlink(fullPathName.c_str());
-	removeLocalFileCollection(fullPathName);
-	if(result == 0) {
-	  logprintf(3, LOG_DEBUG, "deleted %s because it is too old\n", file.name.c_str());
-	  numberOfDeletedFiles++;
-	  totalSizeOfDeleteFiles += file.size;
-	} else {
-	  logprintf(0, LOG_ERROR, "tried to delete '%s' because it's too old, but it failed.\n", file.name.c_str());
-	}
-      } else {
-	candidates.push_back(&file);
-      }
     }
-  }
-  // Step 5) Sort candidates by their last access time
-  {
-    sort(candidates.begin(), candidates.end(), sortByAccessTime);
-    for(unsigned int idx = 0; totalSizeOfDeleteFiles < garbageSizeToBeCollected && idx < candidates.size(); idx++) {
-      File& file = *candidates[idx];
-      const string& fullPathName = fullPath(file.name);
-      const int result = unlink(fullPathName.c_str());
-      removeLocalFileCollection(fullPathName);
-      if(result == 0) {
-	logprintf(3, LOG_DEBUG, "deleted %s because it is old and unused.\n", file.name.c_str());
-	numberOfDeletedFiles++;
-	totalSizeOfDeleteFiles += file.size;
-      } else {
-	logprintf(0, LOG_ERROR, "tried to delete '%s' because it's old and unused, but it failed.\n", file.name.c_str());
+    const int result = unlink(fullPathName.c_str());
+    if(result == 0 || errno == ENOENT) {
+      {
+	Mutex::scoped_lock lock(cacheIndex_mutex);
+	removeCacheEntry_internal_shouldBeCalledWithMutexLocked(fullPathName, true);
       }
+      removeLocalFileCollection(fullPathName);
+    }
+    if(result == 0) {
+      logprintf(3, LOG_DEBUG, "deleted %s because it is old and unused.\n", fullPathName.c_str());
+      numberOfDeletedFiles++;
+      totalSizeOfDeleteFiles += victims[i].second;
+    } else {
+      logprintf(0, LOG_ERROR, "tried to delete '%s' because it's old and unused, but it failed.\n", fullPathName.c_str());
     }
   }
   // Step 6) Report to the log file
-  logprintf(0, LOG_INFO, "Garbage collection finished. %d files are deleted. (%lld bytes in total)\n", numberOfDeletedFiles, totalSizeOfDeleteFiles);
-  // Step 7) Reflesh Local File Collection CSV
-  saveLocalFileCollection();
+  logprintf(0, LOG_INFO, "Garbage collection finished. %d files are deleted, and %d files are demoted. (%lld bytes in total)\n", numberOfDeletedFiles, numberOfDemotedFiles, totalSizeOfDeleteFiles);
+  // Step 7) Checkpoint the local file collection
+  if(0 < numberOfDeletedFiles || 0 < numberOfDemotedFiles)
+    saveLocalFileCollection();
 }
@@ -7,19 +7,72 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
 #include "pmutex.h"
+#include "ppthread.h"
+#include "tge_evict.h"
+#include "tge_index.h"
+#include "tge_keylock.h"
+
+// Cache files are sharded into two levels of directories by the first four hexadecimal digits
+// of their names, such as <cache root>/AB/CD/ABCD..., so that no directory grows too large.
+std::string makeCacheFilePath(const std::string& cacheRootDirectory, const std::string& cacheFileName);
+// creates the shard directories of a cache file if they do not exist.
+bool        ensureCacheFileDirectory(const std::string& cacheFilePath);
+// moves a cache file to another cache directory, possibly on another disk, keeping its dates.
+bool        moveCacheFile(const std::string& sourcePath, const std::string& destinationPath);
+std::string convertToCSV(const std::vector<std::string>& Data);
 
 class Cache_LockedFileChecker {
  public:
   Cache_LockedFileChecker() {}
   virtual bool isLockedFile(const std::string& fname) const = 0;
+  // takes the lock of the file for a modification without waiting, so that it is not opened
+  // while it is deleted or moved. It returns false if the file is busy.
+  virtual bool tryLockFile(const std::string& fname, KeyLockTable::Holder& holder) const = 0;
+  virtual void unlockFile(KeyLockTable::Holder& holder) const = 0;
   virtual ~Cache_LockedFileChecker() {}
 };
 
-class CacheGarbageCollection {
+// Receives the files evicted from a cache directory to keep them in a lower tier.
+class Cache_DemotionTarget {
+ public:
+  Cache_DemotionTarget() {}
+  // returns false if the file should be deleted instead.
+  virtual bool demote(const std::string& localCacheFileName, const std::string& originalFullPathName, const CacheEntry& entry) = 0;
+  virtual ~Cache_DemotionTarget() {}
+};
+
+// Tells the priority class of a cache file by its original path.
+class Cache_PriorityClassifier {
+ public:
+  Cache_PriorityClassifier() {}
+  virtual int classify(const std::string& originalFullPathName) const = 0;
+  // changes whenever the classification changes.
+  virtual int getVersion() const = 0;
+  virtual ~Cache_PriorityClassifier() {}
+};
+
+// A cache file listed in /proc/tgefscache.
+struct CacheListEntry {
+  std::string       localCacheFileName;
+  std::string       originalFullPathName;
+  CacheFileMetadata metadata;
+  bool              isIndexed; // entry is valid. false until the cache directory is scanned.
+  CacheEntry        entry;
+
+  CacheListEntry() : isIndexed(false) {}
+};
+
+// Cache files are evicted by a dedicated thread, which wakes up when the cache
+// grows beyond the limit or the free space of the cache disk runs short.
+class CacheGarbageCollection : PThread {
   bool        initialized;
-  int         softLimitInKBytes;
-  int         hardLimitInKBytes;
+  bool        isSoftLimitAuto;
+  bool        isHardLimitAuto;
+  long long   softLimitInKBytes;
+  long long   hardLimitInKBytes;
+  long long   currentLimitInBytes;
   std::string cacheRootDirectory;
 
   Mutex       garbageCollection_mutex;
@@ -28,6 +81,24 @@ class CacheGarbageCollection {
   static int       GC_period_in_nFiles;
   static double    GC_apply_hardLimit_ratio_of_HDD_usage;
   static int       GC_delete_cache_if_this_number_of_days_passed;
+  static int       GC_consistency_check_period_in_seconds;
+  static double    GC_low_watermark_ratio_of_limit;
+  static double    GC_free_space_low_watermark_ratio;
+  static double    GC_free_space_high_watermark_ratio;
+  static double    GC_free_space_emergency_floor_ratio;
+  static int       GC_watermark_check_interval_in_seconds;
+  static int       GC_availability_check_interval_in_seconds;
+ public:
+  // per-user quotas in bytes (0 means no quota) and weights for the fair share of the cache.
+  // they take effect when tgefs runs as root, where the cache files of all users are managed.
+  static long long                      defaultUserQuotaInBytes;
+  static std::map<uid_t, long long>     userQuotasInBytes;
+  static std::map<uid_t, double>        userWeights;
+  static long long getUserQuotaInBytes(const uid_t uid);
+  static double    getUserWeight(const uid_t uid);
+  // the number of threads which stat the cache files when the cache directory is scanned.
+  static int       scanThreads;
+ private:
 
   long long GC_counter_in_KBytes;
   int       GC_counter_in_nFiles;
@@ -35,25 +106,110 @@ class CacheGarbageCollection {
   void   resetCounter();
   std::string fullPath(const std::string& path);
   bool statCacheRootDir(struct statfs* sfs);
+  void updateLimits();
+  long long getGarbageSizeToBeCollected(const long long totalSizeUsed);
+
+  Mutex       availability_mutex;
+  time_t      lastAvailabilityCheckTime;
+  bool        wasAvailableAtLastCheck;
+
+  Mutex                          evictionThread_mutex;
+  ConditionVariable              evictionThread_cond;
+  ConditionVariable              freeSpace_cond;
+  bool                           isEvictionRequested;
+  bool                           isEvictionThreadStopping;
+  const Cache_LockedFileChecker* evictionThread_clfc;
+  void run();
+
+  // in-memory index of the cache files, which saves rescanning the cache directory on each GC.
+  Mutex                             cacheIndex_mutex;
+  std::map<std::string, CacheEntry> cacheIndex;
+  std::set<std::pair<time_t, std::string> > cacheIndex_agingOrder; // least recently used first, to delete too old files
+  long long                         cacheIndex_totalSizeOfMyFiles; // of all users when tgefs runs as root
+  int                               cacheIndex_numberOfMyFiles;
+  std::map<uid_t, long long>        cacheIndex_sizeByOwner;
+  uid_t                             myUID;
+  time_t                            lastConsistencyCheckTime;
+  bool                              isValidated; // the first scan after the start has finished
+
+  // the top-level shard directories are handed out to the scanning threads one by one.
+  friend class CacheGarbageCollection_ShardScanner;
+  Mutex                    scan_mutex;
+  std::vector<std::string> shardsToScan;
+  unsigned int             nextShardToScan;
+  bool                     isScanInterrupted;
+  long long                numberOfScannedFiles;
+  bool takeShardToScan(std::string& shardDirectory);
+  void reportShardScanned(const int numberOfFiles);
+
+  // the policy orders the entries in the index for eviction, and the simulators replay
+  // the references to the cache against all the policies to compare their hit ratios.
+  EvictionPolicy*                       evictionPolicy;
+  std::vector<EvictionPolicySimulator*> policySimulators;
+  long long                             numberOfCacheHits;
+  long long                             numberOfCacheMisses;
+  Cache_DemotionTarget*                 demotionTarget;
+  const Cache_PriorityClassifier*       priorityClassifier;
+  int                                   appliedPriorityRulesVersion;
+
+  // tgefs running as root manages the cache files of all users.
+  inline bool isManagedOwner(const uid_t owner) const { return owner == myUID || myUID == 0; }
+  bool isAnyUserOverQuota_internal_shouldBeCalledWithMutexLocked() const;
+  void insertCacheEntry_internal_shouldBeCalledWithMutexLocked(const std::string& localCacheFileName, const CacheEntry& entry);
+  void removeCacheEntry_internal_shouldBeCalledWithMutexLocked(const std::string& localCacheFileName, const bool isEvicted);
+  void simulateReference_internal_shouldBeCalledWithMutexLocked(const std::string& localCacheFileName, const CacheEntry& entry);
+  bool statCacheEntry(const std::string& localCacheFileName, CacheEntry& entry);
+  void collectCacheFiles(const std::string& directory, const int shardLevel, std::vector<std::string>& files);
+  // returns false if it is interrupted.
+  bool rescanCacheDirectory();
+  void validateCacheDirectory();
+  void migrateFlatCacheFiles();
+  void applyPriorityClass(const std::string& localCacheFileName, const std::string& originalFullPathName);
+  void applyPriorityClassesIfRulesChanged();
+public:
+  // a file is fetched from the remote file system by the user. (cache miss)
+  void registerCacheEntry(const std::string& localCacheFileName, const uid_t owner);
+  // a cached file is opened without fetching. (cache hit)
+  void touchCacheEntry(const std::string& localCacheFileName);
+  // a cached file is modified and written back.
+  void updateCacheEntry(const std::string& localCacheFileName);
+  void setCacheEntryDirty(const std::string& localCacheFileName, const bool isDirty);
+  // until the first scan finishes, the file is looked up on the disk and indexed if it exists.
+  bool hasCacheEntry(const std::string& localCacheFileName);
+  bool getCacheEntry(const std::string& localCacheFileName, CacheEntry& entry);
+  // a cache file is moved in from another cache directory.
+  void adoptCacheEntry(const std::string& localCacheFileName, const CacheEntry& entry, const std::string& originalFullPathName,
+		       const SourceFileAttributes& source);
+  // a cache file is moved out to another cache directory.
+  void forgetCacheEntry(const std::string& localCacheFileName);
+  void setDemotionTarget(Cache_DemotionTarget* demotionTarget) { this->demotionTarget = demotionTarget; }
+  void setPriorityClassifier(const Cache_PriorityClassifier* priorityClassifier) { this->priorityClassifier = priorityClassifier; }
+  bool setEvictionPolicy(const char* policyName);
+  void enablePolicySimulation();
+  std::string getStatisticsText();
+private:
+
+  // the original paths and the metadata of the cache files, kept in localfiles.idx.
+  CacheFileIndex localFileIndex;
+  std::string localCacheCollectionFile; // localfiles.csv of older versions
 
-  std::string localCacheCollectionFile;
-  Mutex       localCacheCollectionFile_mutex;
-  std::map<std::string, std::string> localCacheFileName2originalFullPathName;
-  
-  std::string localCacheCollection_SolidText;
-  bool        localCacheCollection_SolidText_isDirty;
-  void                   updateSolidText_internal_shouldBeCalledWithMutexLocked();
 public:
-  std::string            getSolidText(std::string::size_type start, std::string::size_type end);
-  std::string::size_type getSolidTextSize();
-  void                   updateSolidText();
+  // lists at most maxEntries cache files from *position, which is 0 at first, and advances it.
+  // returns false if there are no more files.
+  bool listCacheEntries(unsigned long long* position, const unsigned int maxEntries, std::vector<CacheListEntry>& entries);
 
 private:
   void initLocalFileCollection();
+  void importLocalFileCollectionCSV();
+  void restoreCacheEntryMetadata();
   void saveLocalFileCollection();
 public:
 
-  void appendLocalFileCollection(const std::string& localCacheFileName, const std::string& originalFullPathName);
+  // source is the attributes of the original file, which the cache file is a copy of.
+  void appendLocalFileCollection(const std::string& localCacheFileName, const std::string& originalFullPathName,
+				 const SourceFileAttributes& source);
+  bool findLocalFileCollection(const std::string& localCacheFileName, std::string* originalFullPathName, CacheFileMetadata* metadata);
+  std::string getOriginalFullPathName(const std::string& localCacheFileName);
   void removeLocalFileCollection(const std::string& localCacheFileName);
   bool canUseLocalCacheNameForLocalFileCollection(const std::string& localCacheFileName, const std::string& originalFullPathName);
 
@@ -61,11 +217,19 @@ public:
   static int       AUTO;
 
   CacheGarbageCollection();
+  ~CacheGarbageCollection();
   void init(const char* cacheRootDirectory,
 	    const int softLimitInKBytes,
 	    const int hardLimitInKBytes);
   void collect(const Cache_LockedFileChecker& clfc);
-  void accessedFile(const long long fileSize, const Cache_LockedFileChecker& clfc);
+  void accessedFile(const long long fileSize);
+  void waitForFreeSpace();
+  const std::string& getCacheRootDirectory() const { return cacheRootDirectory; }
+  // false if the cache directory has failed or its disk is full.
+  bool isAvailable();
+  void reportFailure();
+  bool startEvictionThread(const Cache_LockedFileChecker* clfc);
+  void stopEvictionThread();
 };
 
 #endif // #ifndef _HEADER_TGE_CACHE
@@ -0,0 +1,302 @@
+#if HAVE_CONFIG
+ #include "config.h"
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <math.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sstream>
+#include "tge_log.h"
+#include "tge_cachedirs.h"
+
+using namespace std;
+
+int       CacheDirectories::promotionMinimumOpens          = 2;
+long long CacheDirectories::ramPromotionMaximumSizeInBytes = 16 * 1024 * 1024ll; // 16Mbytes
+
+CacheDirectories::CacheDirectories()
+{
+  for(int tier = 0; tier < NUMBER_OF_TIERS; tier++)
+    tierDemotions[tier].init(this, tier);
+}
+
+CacheDirectories::~CacheDirectories()
+{
+  for(unsigned int i = 0; i < caches.size(); i++)
+    delete caches[i];
+}
+
+void CacheDirectories::init(const std::vector<std::string>& cacheRootDirectories,
+			    const int softLimitInKBytes,
+			    const int hardLimitInKBytes)
+{
+  for(unsigned int i = 0; i < cacheRootDirectories.size(); i++)
+    addCacheDirectory(cacheRootDirectories[i], TIER_MAIN, softLimitInKBytes, hardLimitInKBytes);
+}
+
+void CacheDirectories::addCacheDirectory(const std::string& cacheRootDirectory, const Tier tier,
+					 const int softLimitInKBytes,
+					 const int hardLimitInKBytes)
+{
+  struct stat st;
+  if(stat(cacheRootDirectory.c_str(), &st) == 0) {
+    for(unsigned int i = 0; i < caches.size(); i++) {
+      struct stat anotherSt;
+      if(stat(caches[i]->getCacheRootDirectory().c_str(), &anotherSt) == 0 && anotherSt.st_dev == st.st_dev)
+	logprintf(0, LOG_WARNING, "Cache directory '%s' is on the same disk as another one. Their limits are not shared.\n", cacheRootDirectory.c_str());
+    }
+  }
+  CacheGarbageCollection* cache = new CacheGarbageCollection();
+  cache->init(cacheRootDirectory.c_str(), softLimitInKBytes, hardLimitInKBytes);
+  cache->setDemotionTarget(&tierDemotions[tier]);
+  caches.push_back(cache);
+  double weight = 1.0;
+  struct statfs sfs;
+  if(statfs(cacheRootDirectory.c_str(), &sfs) == 0 && 0 < sfs.f_blocks)
+    weight = (double)sfs.f_bsize * sfs.f_blocks;
+  weights.push_back(weight);
+  tiers.push_back(tier);
+  logprintf(0, LOG_INFO, "Cache directory '%s' is added to the %s tier.\n", cacheRootDirectory.c_str(), getTierName(tier));
+}
+
+const char* CacheDirectories::getTierName(const int tier)
+{
+  switch(tier) {
+  case TIER_RAM:  return "ram";
+  case TIER_MAIN: return "main";
+  case TIER_HDD:  return "hdd";
+  }
+  return "unknown";
+}
+
+double CacheDirectories::hashToUnitInterval(const std::string& cacheFileName, const std::string& cacheRootDirectory)
+{
+  // FNV-1a
+  unsigned long long h = 14695981039346656037ull;
+  for(string::size_type i = 0; i < cacheFileName.size(); i++) {
+    h ^= (unsigned char)cacheFileName[i];
+    h *= 1099511628211ull;
+  }
+  for(string::size_type i = 0; i < cacheRootDirectory.size(); i++) {
+    h ^= (unsigned char)cacheRootDirectory[i];
+    h *= 1099511628211ull;
+  }
+  h ^= h >> 32;
+  // (0, 1), excluding both ends.
+  return ((h >> 11) + 0.5) / (double)(1ull << 53);
+}
+
+int CacheDirectories::selectCacheDirectory(const std::string& cacheFileName, const int tier)
+{
+  int bestIndex          = -1;
+  double bestScore       = 0.0;
+  int bestAvailableIndex = -1;
+  double bestAvailableScore = 0.0;
+  for(unsigned int i = 0; i < caches.size(); i++) {
+    if(tiers[i] != tier)
+      continue;
+    const double score = weights[i] / -log(hashToUnitInterval(cacheFileName, caches[i]->getCacheRootDirectory()));
+    if(bestIndex < 0 || bestScore < score) {
+      bestIndex = i;
+      bestScore = score;
+    }
+    if((bestAvailableIndex < 0 || bestAvailableScore < score) && caches[i]->isAvailable()) {
+      bestAvailableIndex = i;
+      bestAvailableScore = score;
+    }
+  }
+  // if no directories are available, use the preferred one, and let it wait for eviction.
+  return 0 <= bestAvailableIndex ? bestAvailableIndex : bestIndex;
+}
+
+std::string CacheDirectories::makeCacheFilePath(const std::string& cacheFileName)
+{
+  string mainTierPath;
+  for(int tier = 0; tier < NUMBER_OF_TIERS; tier++) {
+    if(tier == TIER_MAIN) {
+      const int mainTierIndex = selectCacheDirectory(cacheFileName, TIER_MAIN);
+      mainTierPath = ::makeCacheFilePath(caches[mainTierIndex]->getCacheRootDirectory(), cacheFileName);
+      if(caches.size() == 1 || caches[mainTierIndex]->hasCacheEntry(mainTierPath))
+	return mainTierPath;
+      // the file stays where it was made when the directory which it prefers changes,
+      // for example when a directory is added or has failed.
+      for(unsigned int i = 0; i < caches.size(); i++) {
+	if(tiers[i] != TIER_MAIN || (int)i == mainTierIndex)
+	  continue;
+	const string path = ::makeCacheFilePath(caches[i]->getCacheRootDirectory(), cacheFileName);
+	if(caches[i]->hasCacheEntry(path))
+	  return path;
+      }
+      continue;
+    }
+    for(unsigned int i = 0; i < caches.size(); i++) {
+      if(tiers[i] != tier)
+	continue;
+      const string path = ::makeCacheFilePath(caches[i]->getCacheRootDirectory(), cacheFileName);
+      if(caches[i]->hasCacheEntry(path))
+	return path;
+    }
+  }
+  return mainTierPath;
+}
+
+bool CacheDirectories::moveBetweenTiers(const int destinationIndex, const std::string& localCacheFileName, const std::string& destinationPath,
+					const std::string& originalFullPathName, const CacheEntry& entry)
+{
+  if(!ensureCacheFileDirectory(destinationPath)) {
+    caches[destinationIndex]->reportFailure();
+    return false;
+  }
+  if(!moveCacheFile(localCacheFileName, destinationPath)) {
+    logprintf(0, LOG_ERROR, "Could not move '%s' to '%s'. (errno=%d)\n", localCacheFileName.c_str(), destinationPath.c_str(), errno);
+    return false;
+  }
+  // the source directory keeps the entry until the caller makes it forget.
+  CacheFileMetadata metadata;
+  of(localCacheFileName).findLocalFileCollection(localCacheFileName, NULL, &metadata);
+  caches[destinationIndex]->adoptCacheEntry(destinationPath, entry, originalFullPathName, metadata.source);
+  return true;
+}
+
+bool CacheDirectories::demote(const int sourceTier, const std::string& localCacheFileName, const std::string& originalFullPathName, const CacheEntry& entry)
+{
+  for(int tier = sourceTier + 1; tier < NUMBER_OF_TIERS; tier++) {
+    const string cacheFileName = localCacheFileName.substr(localCacheFileName.rfind('/') + 1);
+    const int destinationIndex = selectCacheDirectory(cacheFileName, tier);
+    if(destinationIndex < 0)
+      continue; // no directories in this tier
+    if(!caches[destinationIndex]->isAvailable())
+      return false;
+    const string destinationPath = ::makeCacheFilePath(caches[destinationIndex]->getCacheRootDirectory(), cacheFileName);
+    // the source directory removes the entry by itself.
+    return moveBetweenTiers(destinationIndex, localCacheFileName, destinationPath, originalFullPathName, entry);
+  }
+  return false;
+}
+
+std::string CacheDirectories::promote(const std::string& localCacheFileName, const Cache_LockedFileChecker& clfc)
+{
+  if(caches.size() == 1)
+    return localCacheFileName;
+  CacheGarbageCollection& source = of(localCacheFileName);
+  int sourceIndex = 0;
+  while(caches[sourceIndex] != &source)
+    sourceIndex++;
+  // the HDD tier is promoted to the main tier, and the main tier is promoted to the RAM tier.
+  const int destinationTier = tiers[sourceIndex] - 1;
+  if(destinationTier < 0)
+    return localCacheFileName;
+  CacheEntry entry;
+  if(!source.getCacheEntry(localCacheFileName, entry) || entry.isDirty || entry.isPinned || entry.accessCount < promotionMinimumOpens)
+    return localCacheFileName;
+  if(destinationTier == TIER_RAM && ramPromotionMaximumSizeInBytes < entry.size)
+    return localCacheFileName;
+  const string cacheFileName  = localCacheFileName.substr(localCacheFileName.rfind('/') + 1);
+  const int destinationIndex = selectCacheDirectory(cacheFileName, destinationTier);
+  if(destinationIndex < 0 || !caches[destinationIndex]->isAvailable())
+    return localCacheFileName;
+  if(clfc.isLockedFile(localCacheFileName))
+    return localCacheFileName; // another process is using it.
+  const string destinationPath      = ::makeCacheFilePath(caches[destinationIndex]->getCacheRootDirectory(), cacheFileName);
+  const string originalFullPathName = source.getOriginalFullPathName(localCacheFileName);
+  if(!moveBetweenTiers(destinationIndex, localCacheFileName, destinationPath, originalFullPathName, entry))
+    return localCacheFileName;
+  source.forgetCacheEntry(localCacheFileName);
+  logprintf(2, LOG_DEBUG, "Promoted '%s' to '%s'.\n", localCacheFileName.c_str(), destinationPath.c_str());
+  return destinationPath;
+}
+
+CacheGarbageCollection& CacheDirectories::of(const std::string& localCacheFileName)
+{
+  for(unsigned int i = 0; i < caches.size(); i++) {
+    const string& cacheRootDirectory = caches[i]->getCacheRootDirectory();
+    if(localCacheFileName.compare(0, cacheRootDirectory.size(), cacheRootDirectory) == 0 && localCacheFileName.size() > cacheRootDirectory.size() && localCacheFileName[cacheRootDirectory.size()] == '/')
+      return *caches[i];
+  }
+  logprintf(0, LOG_ERROR, "'%s' is not in any cache directory.\n", localCacheFileName.c_str());
+  return *caches[0];
+}
+
+void CacheDirectories::collect(const Cache_LockedFileChecker& clfc)
+{
+  for(unsigned int i = 0; i < caches.size(); i++)
+    caches[i]->collect(clfc);
+}
+
+bool CacheDirectories::startEvictionThreads(const Cache_LockedFileChecker* clfc)
+{
+  bool succeeded = true;
+  for(unsigned int i = 0; i < caches.size(); i++) {
+    if(!caches[i]->startEvictionThread(clfc))
+      succeeded = false;
+  }
+  return succeeded;
+}
+
+void CacheDirectories::stopEvictionThreads()
+{
+  for(unsigned int i = 0; i < caches.size(); i++)
+    caches[i]->stopEvictionThread();
+}
+
+bool CacheDirectories::setEvictionPolicy(const char* policyName)
+{
+  for(unsigned int i = 0; i < caches.size(); i++) {
+    if(!caches[i]->setEvictionPolicy(policyName))
+      return false;
+  }
+  return true;
+}
+
+void CacheDirectories::enablePolicySimulation()
+{
+  for(unsigned int i = 0; i < caches.size(); i++)
+    caches[i]->enablePolicySimulation();
+}
+
+void CacheDirectories::setPriorityClassifier(const Cache_PriorityClassifier* priorityClassifier)
+{
+  for(unsigned int i = 0; i < caches.size(); i++)
+    caches[i]->setPriorityClassifier(priorityClassifier);
+}
+
+std::string CacheDirectories::getStatisticsText()
+{
+  if(caches.size() == 1)
+    return caches[0]->getStatisticsText();
+  // prefix each line with 'cache<n>.' to tell the directories apart.
+  string retval;
+  for(unsigned int i = 0; i < caches.size(); i++) {
+    char prefix[32];
+    sprintf(prefix, "cache%d.", i);
+    retval += prefix;
+    retval += "root=" + caches[i]->getCacheRootDirectory() + "\n";
+    retval += prefix;
+    retval += string("tier=") + getTierName(tiers[i]) + "\n";
+    istringstream ist(caches[i]->getStatisticsText());
+    string line;
+    while(getline(ist, line)) {
+      retval += prefix;
+      retval += line;
+      retval += '\n';
+    }
+  }
+  return retval;
+}
+
+bool CacheDirectories::listCacheEntries(int* directoryIndex, unsigned long long* position, const unsigned int maxEntries,
+					std::vector<CacheListEntry>& entries)
+{
+  while(*directoryIndex < (int)caches.size()) {
+    if(caches[*directoryIndex]->listCacheEntries(position, maxEntries, entries))
+      return true;
+    ++*directoryIndex;
+    *position = 0;
+    if(!entries.empty())
+      return *directoryIndex < (int)caches.size();
+  }
+  return false;
+}
@@ -0,0 +1,91 @@
+#ifndef _HEADER_TGE_CACHEDIRS
+#define _HEADER_TGE_CACHEDIRS
+
+#include <string>
+#include <vector>
+#include "pmutex.h"
+#include "tge_cache.h"
+
+// A set of cache directories, typically one per local disk. Each directory has its own
+// CacheGarbageCollection, so that its limits and eviction follow the disk it resides on.
+// A cache file is placed by weighted rendezvous hashing of its name, where the weight of
+// a directory is the capacity of its disk, and directories which have failed or are full
+// are skipped.
+//
+// Directories are grouped into tiers. Files are fetched into the main tier. Small files
+// opened repeatedly are promoted to the RAM tier, and files in the HDD tier are promoted
+// to the main tier when they are opened again. Files evicted from a tier are demoted to
+// the next lower tier, and they are deleted only when they are evicted from the lowest one.
+class CacheDirectories {
+ public:
+  enum Tier {
+    TIER_RAM  = 0,
+    TIER_MAIN = 1,
+    TIER_HDD  = 2,
+    NUMBER_OF_TIERS
+  };
+  static int       promotionMinimumOpens;
+  static long long ramPromotionMaximumSizeInBytes;
+
+ private:
+  class TierDemotion : public Cache_DemotionTarget {
+    CacheDirectories* cacheDirectories;
+    int               sourceTier;
+   public:
+    TierDemotion() : cacheDirectories(NULL), sourceTier(0) {}
+    void init(CacheDirectories* cacheDirectories, const int sourceTier) { this->cacheDirectories = cacheDirectories; this->sourceTier = sourceTier; }
+    virtual bool demote(const std::string& localCacheFileName, const std::string& originalFullPathName, const CacheEntry& entry) {
+      return cacheDirectories->demote(sourceTier, localCacheFileName, originalFullPathName, entry);
+    }
+  };
+  friend class TierDemotion;
+
+  std::vector<CacheGarbageCollection*> caches;
+  std::vector<double>                  weights;
+  std::vector<int>                     tiers;
+  TierDemotion                         tierDemotions[NUMBER_OF_TIERS];
+
+  static double hashToUnitInterval(const std::string& cacheFileName, const std::string& cacheRootDirectory);
+  static const char* getTierName(const int tier);
+  // returns -1 if the tier has no directories.
+  int  selectCacheDirectory(const std::string& cacheFileName, const int tier);
+  bool moveBetweenTiers(const int destinationIndex, const std::string& localCacheFileName, const std::string& destinationPath,
+			const std::string& originalFullPathName, const CacheEntry& entry);
+  bool demote(const int sourceTier, const std::string& localCacheFileName, const std::string& originalFullPathName, const CacheEntry& entry);
+
+ public:
+  CacheDirectories();
+  ~CacheDirectories();
+  void init(const std::vector<std::string>& cacheRootDirectories,
+	    const int softLimitInKBytes,
+	    const int hardLimitInKBytes);
+  void addCacheDirectory(const std::string& cacheRootDirectory, const Tier tier,
+			 const int softLimitInKBytes,
+			 const int hardLimitInKBytes);
+  int size() const { return caches.size(); }
+  CacheGarbageCollection& operator[](const int index) { return *caches[index]; }
+
+  // the path of a cache file named by a hash. It is the path in the tier which holds the file
+  // if any, or the path in the main tier directory where it should be placed now.
+  std::string makeCacheFilePath(const std::string& cacheFileName);
+  // the directory which the cache file belongs to.
+  CacheGarbageCollection& of(const std::string& localCacheFileName);
+  // moves a cache file, which is not opened now, to the upper tier if it deserves.
+  // returns the new path of the file.
+  std::string promote(const std::string& localCacheFileName, const Cache_LockedFileChecker& clfc);
+
+  void collect(const Cache_LockedFileChecker& clfc);
+  bool startEvictionThreads(const Cache_LockedFileChecker* clfc);
+  void stopEvictionThreads();
+  bool setEvictionPolicy(const char* policyName);
+  void enablePolicySimulation();
+  void setPriorityClassifier(const Cache_PriorityClassifier* priorityClassifier);
+  std::string getStatisticsText();
+
+  // lists at most maxEntries cache files of all the directories from (*directoryIndex, *position),
+  // which are 0 at first, and advances them. returns false if there are no more files.
+  bool listCacheEntries(int* directoryIndex, unsigned long long* position, const unsigned int maxEntries,
+			std::vector<CacheListEntry>& entries);
+};
+
+#endif // #ifndef _HEADER_TGE_CACHEDIRS
@@ -0,0 +1,236 @@
+#if HAVE_CONFIG
+ #include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <sstream>
+#include "tge_cachequery.h"
+
+using namespace std;
+
+bool CacheQueryFilter::execute(const std::string& commandLine)
+{
+  istringstream ist(commandLine);
+  string command, argument;
+  if(!(ist >> command))
+    return true;
+  if(command[0] == '/') {
+    pathPrefix = command;
+    return true;
+  }
+  if(command == "reset") {
+    *this = CacheQueryFilter();
+    return true;
+  }
+  if(!(ist >> argument))
+    return false;
+  if(command == "prefix") {
+    if(argument[0] != '/')
+      return false;
+    pathPrefix = argument;
+    return true;
+  }
+  if(command == "state") {
+    if(argument == "any")            state = STATE_ANY;
+    else if(argument == "clean")     state = STATE_CLEAN;
+    else if(argument == "dirty")     state = STATE_DIRTY;
+    else if(argument == "pinned")    state = STATE_PINNED;
+    else if(argument == "unindexed") state = STATE_UNINDEXED;
+    else return false;
+    return true;
+  }
+  long long value;
+  char      trailing;
+  if(sscanf(argument.c_str(), "%lld%c", &value, &trailing) != 1 || value < 0)
+    return false;
+  if(command == "minsize") {
+    minimumSize = value;
+  } else if(command == "skip") {
+    numberToSkip = value;
+  } else if(command == "limit") {
+    limit = value;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool CacheQueryFilter::matches(const CacheListEntry& listEntry) const
+{
+  if(listEntry.originalFullPathName.compare(0, pathPrefix.size(), pathPrefix) != 0)
+    return false;
+  const long long size = listEntry.isIndexed ? listEntry.entry.size : listEntry.metadata.size;
+  if(size < minimumSize)
+    return false;
+  switch(state) {
+  case STATE_CLEAN:     return listEntry.isIndexed && !listEntry.entry.isDirty;
+  case STATE_DIRTY:     return listEntry.isIndexed && listEntry.entry.isDirty;
+  case STATE_PINNED:    return listEntry.isIndexed && listEntry.entry.isPinned;
+  case STATE_UNINDEXED: return !listEntry.isIndexed;
+  }
+  return true;
+}
+
+CacheQuery::CacheQuery(CacheDirectories& cacheDirectories, const CacheQueryFilter& filter)
+  : cacheDirectories(cacheDirectories), filter(filter)
+{
+  rewind_internal_shouldBeCalledWithMutexLocked();
+}
+
+CacheQueryFilter CacheQuery::getFilter()
+{
+  Mutex::scoped_lock lock(query_mutex);
+  return filter;
+}
+
+void CacheQuery::setFilter(const CacheQueryFilter& filter)
+{
+  Mutex::scoped_lock lock(query_mutex);
+  this->filter = filter;
+  rewind_internal_shouldBeCalledWithMutexLocked();
+}
+
+void CacheQuery::rewind_internal_shouldBeCalledWithMutexLocked()
+{
+  directoryIndex         = 0;
+  position               = 0;
+  numberOfMatchedEntries = 0;
+  isFinished             = false;
+  buffer.clear();
+  bufferOffset           = 0;
+}
+
+std::string CacheQuery::formatEntry(const CacheListEntry& listEntry, const time_t currentTime)
+{
+  // <cache file>,<original file>,<size>,<seconds since the last open>,<opens>,<state>
+  // the age is empty if the file is not indexed yet.
+  char buffer[64];
+  vector<string> csv;
+  csv.push_back(listEntry.localCacheFileName);
+  csv.push_back(listEntry.originalFullPathName);
+  if(listEntry.isIndexed) {
+    const CacheEntry& entry = listEntry.entry;
+    sprintf(buffer, "%lld", entry.size);
+    csv.push_back(buffer);
+    sprintf(buffer, "%ld", (long)max<time_t>(0, currentTime - entry.lastAccessTime));
+    csv.push_back(buffer);
+    sprintf(buffer, "%d", entry.accessCount);
+    csv.push_back(buffer);
+    csv.push_back(string(entry.isDirty ? "dirty" : "clean") + (entry.isPinned ? "+pinned" : ""));
+  } else {
+    sprintf(buffer, "%lld", listEntry.metadata.size);
+    csv.push_back(buffer);
+    csv.push_back("");
+    sprintf(buffer, "%d", listEntry.metadata.accessCount);
+    csv.push_back(buffer);
+    csv.push_back("unindexed");
+  }
+  return convertToCSV(csv) + "\n";
+}
+
+void CacheQuery::generate_internal_shouldBeCalledWithMutexLocked()
+{
+  vector<CacheListEntry> entries;
+  const bool hasMoreEntries = cacheDirectories.listCacheEntries(&directoryIndex, &position, ENTRIES_PER_BATCH, entries);
+  const time_t currentTime = time(NULL);
+  for(vector<CacheListEntry>::const_iterator cit = entries.begin(); cit != entries.end(); ++cit) {
+    if(!filter.matches(*cit))
+      continue;
+    numberOfMatchedEntries++;
+    if(numberOfMatchedEntries <= filter.numberToSkip)
+      continue;
+    if(0 <= filter.limit && filter.numberToSkip + filter.limit < numberOfMatchedEntries) {
+      isFinished = true;
+      return;
+    }
+    buffer += formatEntry(*cit, currentTime);
+  }
+  if(!hasMoreEntries)
+    isFinished = true;
+}
+
+int CacheQuery::read(char* buf, const size_t size, const off_t offset)
+{
+  Mutex::scoped_lock lock(query_mutex);
+  if(offset < bufferOffset)
+    rewind_internal_shouldBeCalledWithMutexLocked();
+  while(true) {
+    // the lines before the offset have been read, and are not kept.
+    if(bufferOffset < offset) {
+      const string::size_type readSize = (string::size_type)min<off_t>(offset - bufferOffset, buffer.size());
+      buffer.erase(0, readSize);
+      bufferOffset += readSize;
+    }
+    if((bufferOffset == offset && size <= buffer.size()) || isFinished)
+      break;
+    generate_internal_shouldBeCalledWithMutexLocked();
+  }
+  if(bufferOffset != offset)
+    return 0;
+  const int copiedSize = (int)min<string::size_type>(size, buffer.size());
+  memcpy(buf, buffer.data(), copiedSize);
+  return copiedSize;
+}
+
+CacheQueries::CacheQueries(CacheDirectories& cacheDirectories, const uint64_t firstHandle)
+  : cacheDirectories(cacheDirectories), nextHandle(firstHandle)
+{
+}
+
+CacheQueries::~CacheQueries()
+{
+  for(map<uint64_t, CacheQuery*>::iterator it = queries.begin(); it != queries.end(); ++it)
+    delete it->second;
+}
+
+uint64_t CacheQueries::open(const uid_t uid)
+{
+  Mutex::scoped_lock lock(queries_mutex);
+  const uint64_t handle = nextHandle++;
+  queries[handle] = new CacheQuery(cacheDirectories, filtersByUser[uid]);
+  return handle;
+}
+
+CacheQuery* CacheQueries::find(const uint64_t handle)
+{
+  Mutex::scoped_lock lock(queries_mutex);
+  map<uint64_t, CacheQuery*>::const_iterator cit = queries.find(handle);
+  if(cit == queries.end())
+    return NULL;
+  return cit->second;
+}
+
+bool CacheQueries::write(const uint64_t handle, const uid_t uid, const std::string& text, const bool isAppended)
+{
+  CacheQuery* query = find(handle);
+  if(query == NULL)
+    return false;
+  CacheQueryFilter filter;
+  if(isAppended)
+    filter = query->getFilter();
+  istringstream ist(text);
+  string line;
+  while(getline(ist, line)) {
+    if(line.empty() || line[0] == '#')
+      continue;
+    if(!filter.execute(line))
+      return false;
+  }
+  query->setFilter(filter);
+  Mutex::scoped_lock lock(queries_mutex);
+  filtersByUser[uid] = filter;
+  return true;
+}
+
+void CacheQueries::close(const uint64_t handle)
+{
+  Mutex::scoped_lock lock(queries_mutex);
+  map<uint64_t, CacheQuery*>::iterator it = queries.find(handle);
+  if(it == queries.end())
+    return;
+  delete it->second;
+  queries.erase(it);
+}
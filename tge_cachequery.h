@@ -0,0 +1,86 @@
+#ifndef _HEADER_TGE_CACHEQUERY
+#define _HEADER_TGE_CACHEQUERY
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include "pmutex.h"
+#include "tge_cachedirs.h"
+
+// A filter on the cache files listed in /proc/tgefscache, given by lines such as
+// 'prefix /data/reference', 'state dirty', 'minsize 1048576', 'skip 1000' or 'limit 100'.
+struct CacheQueryFilter {
+  enum State {
+    STATE_ANY,
+    STATE_CLEAN,
+    STATE_DIRTY,
+    STATE_PINNED,
+    STATE_UNINDEXED
+  };
+  std::string pathPrefix;
+  int         state;
+  long long   minimumSize;
+  long long   numberToSkip;
+  long long   limit; // -1 means no limit
+
+  CacheQueryFilter() : state(STATE_ANY), minimumSize(0ll), numberToSkip(0ll), limit(-1ll) {}
+  // executes a line of a query. returns false if it is malformed.
+  bool execute(const std::string& commandLine);
+  bool matches(const CacheListEntry& listEntry) const;
+};
+
+// A listing of the cache files for an open of /proc/tgefscache. The lines are generated from
+// the cache index a batch at a time as they are read, so that the whole list is never held
+// in memory. Reading from an offset before the current batch starts the listing over.
+class CacheQuery {
+  enum {
+    ENTRIES_PER_BATCH = 256
+  };
+  Mutex              query_mutex;
+  CacheDirectories&  cacheDirectories;
+  CacheQueryFilter   filter;
+  int                directoryIndex;
+  unsigned long long position;
+  long long          numberOfMatchedEntries;
+  bool               isFinished;
+  std::string        buffer;
+  off_t              bufferOffset;
+
+  void rewind_internal_shouldBeCalledWithMutexLocked();
+  void generate_internal_shouldBeCalledWithMutexLocked();
+  static std::string formatEntry(const CacheListEntry& listEntry, const time_t currentTime);
+
+ public:
+  CacheQuery(CacheDirectories& cacheDirectories, const CacheQueryFilter& filter);
+  CacheQueryFilter getFilter();
+  // starts the listing over with the filter.
+  void setFilter(const CacheQueryFilter& filter);
+  int  read(char* buf, const size_t size, const off_t offset);
+};
+
+// The queries of the open handles of /proc/tgefscache. The last query written by each user
+// is kept, so that 'echo prefix /data > /proc/tgefscache; cat /proc/tgefscache' works.
+class CacheQueries {
+  Mutex                             queries_mutex;
+  CacheDirectories&                 cacheDirectories;
+  std::map<uint64_t, CacheQuery*>   queries;
+  std::map<uid_t, CacheQueryFilter> filtersByUser;
+  uint64_t                          nextHandle;
+
+ public:
+  // the handles are allocated from firstHandle, so that they can be told from file descriptors.
+  CacheQueries(CacheDirectories& cacheDirectories, const uint64_t firstHandle);
+  ~CacheQueries();
+  // starts a listing with the last query of the user.
+  uint64_t open(const uid_t uid);
+  // returns NULL if the handle is not open.
+  CacheQuery* find(const uint64_t handle);
+  // a write at offset 0 replaces the query of the handle and the user, and a write at a later
+  // offset adds lines to it. returns false if it is malformed.
+  bool write(const uint64_t handle, const uid_t uid, const std::string& text, const bool isAppended);
+  void close(const uint64_t handle);
+};
+
+#endif // #ifndef _HEADER_TGE_CACHEQUERY
@@ -33,6 +33,10 @@ using namespace std;
 //
 //   U            uncompressed
 //   L            compress by LZOx1
+//   Z            compress by LZ4, which decodes faster than LZOx1
+//   DL           write back uncompressed, and compress by LZOx1 later
+//                when the file system becomes idle (deferred compression)
+//   DZ           write back uncompressed, and compress by LZ4 later
 //
 //
 // Example:
@@ -130,7 +134,9 @@ void CompressionControl::init(const char* homedir)
 	  cerr << "ERROR: no compression type at line " << lineCount << endl;
 	  break;
 	}
-	if(line[1] == 'U' || line[1] == 'L') {
+	if(line[1] == 'U' || line[1] == 'L' || line[1] == 'Z') {
+	  compressingOrders.push_back(line);
+	} else if(line[1] == 'D' && line.size() == 3 && (line[2] == 'L' || line[2] == 'Z')) {
 	  compressingOrders.push_back(line);
 	} else {
 	  cerr << "ERROR: unknown compression type '" << line.substr(1) << "' at line " << lineCount << endl;
@@ -194,9 +200,11 @@ int CompressionControl::predicate(const string& expr, int cursor, const char* pa
   return 0;
 }
 
-CompressionControl::CompressionType CompressionControl::getCompressionType(const char* path)
+CompressionControl::CompressionType CompressionControl::getCompressionType(const char* path, bool* isDeferred)
 {
   int currentFlag = 0;
+  if(isDeferred != NULL)
+    *isDeferred = false;
 
   for(vector<string>::const_iterator cit = compressingOrders.begin(); cit != compressingOrders.end(); ++cit) {
     const string& l = *cit;
@@ -212,7 +220,15 @@ CompressionControl::CompressionType CompressionControl::getCompressionType(const
       if(currentFlag == 1) {
 	if(l.size() <= 1)
 	  return Uncompressed; // this should never happen
+	if(l[1] == 'D' && 3 <= l.size()) {
+	  if(isDeferred != NULL)
+	    *isDeferred = true;
+	  if(l[2] == 'L') return LZOx1;
+	  if(l[2] == 'Z') return LZ4;
+	  return Uncompressed; // this should never happen
+	}
 	if(l[1] == 'L') return LZOx1;
+	if(l[1] == 'Z') return LZ4;
 	if(l[1] == 'U') return Uncompressed;
 	return Uncompressed; // this should never happen
       }
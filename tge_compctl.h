@@ -12,10 +12,11 @@ class CompressionControl {
  public:
   enum CompressionType {
     Uncompressed = 0,
-    LZOx1        = 1
+    LZOx1        = 1,
+    LZ4          = 2
   };
   void init(const char* homedir);
-  CompressionType getCompressionType(const char* path);
+  CompressionType getCompressionType(const char* path, bool* isDeferred = NULL);
 };
 
 #endif // #ifndef _HEADER_TGE_COMPCTL
@@ -0,0 +1,273 @@
+#if HAVE_CONFIG
+ #include "config.h"
+#endif
+
+#include <string.h>
+#include <algorithm>
+#include "tge_evict.h"
+
+using namespace std;
+
+//------------------------------------------------------------------------------
+void LRUEvictionPolicy::insert(const std::string& name, const CacheEntry& entry)
+{
+  access(name, entry);
+}
+
+void LRUEvictionPolicy::access(const std::string& name, const CacheEntry& entry)
+{
+  remove(name, false);
+  name2sequence[name] = ++sequence;
+  order.insert(make_pair(sequence, name));
+}
+
+void LRUEvictionPolicy::remove(const std::string& name, const bool isEvicted)
+{
+  map<string, unsigned long long>::iterator it = name2sequence.find(name);
+  if(it == name2sequence.end())
+    return;
+  order.erase(make_pair(it->second, name));
+  name2sequence.erase(it);
+}
+
+void LRUEvictionPolicy::visitInEvictionOrder(EvictionPolicy_Visitor& visitor)
+{
+  for(set<pair<unsigned long long, string> >::const_iterator cit = order.begin(); cit != order.end(); ++cit) {
+    if(!visitor.visit(cit->second))
+      return;
+  }
+}
+
+//------------------------------------------------------------------------------
+double TwoQueueEvictionPolicy::Kin  = 0.25; // ratio of bytes that A1in may hold before Am is evicted
+double TwoQueueEvictionPolicy::Kout = 0.50; // ratio of the number of entries remembered in A1out
+
+void TwoQueueEvictionPolicy::putNode(const std::string& name, const Queue queue, const long long size)
+{
+  eraseNode(name);
+  Node node;
+  node.queue    = queue;
+  node.size     = size;
+  node.sequence = ++sequence;
+  nodes[name]   = node;
+  if(queue == A1IN) {
+    a1in.insert(make_pair(node.sequence, name));
+    a1inBytes += size;
+  } else {
+    am.insert(make_pair(node.sequence, name));
+  }
+  totalBytes += size;
+}
+
+void TwoQueueEvictionPolicy::eraseNode(const std::string& name)
+{
+  map<string, Node>::iterator it = nodes.find(name);
+  if(it == nodes.end())
+    return;
+  const Node& node = it->second;
+  if(node.queue == A1IN) {
+    a1in.erase(make_pair(node.sequence, name));
+    a1inBytes -= node.size;
+  } else {
+    am.erase(make_pair(node.sequence, name));
+  }
+  totalBytes -= node.size;
+  nodes.erase(it);
+}
+
+void TwoQueueEvictionPolicy::insert(const std::string& name, const CacheEntry& entry)
+{
+  map<string, list<string>::iterator>::iterator a1outIt = a1outPositions.find(name);
+  if(a1outIt != a1outPositions.end()) {
+    // it was evicted from A1in too early.
+    a1out.erase(a1outIt->second);
+    a1outPositions.erase(a1outIt);
+    putNode(name, AM, entry.size);
+    return;
+  }
+  map<string, Node>::const_iterator cit = nodes.find(name);
+  if(cit != nodes.end()) {
+    access(name, entry);
+    return;
+  }
+  putNode(name, A1IN, entry.size);
+}
+
+void TwoQueueEvictionPolicy::access(const std::string& name, const CacheEntry& entry)
+{
+  map<string, Node>::iterator it = nodes.find(name);
+  if(it == nodes.end()) {
+    insert(name, entry);
+    return;
+  }
+  if(it->second.queue == AM || 2 <= entry.accessCount) {
+    putNode(name, AM, entry.size);
+  } else {
+    // a change of size only; A1in is FIFO, so the position is kept.
+    a1inBytes  += entry.size - it->second.size;
+    totalBytes += entry.size - it->second.size;
+    it->second.size = entry.size;
+  }
+}
+
+void TwoQueueEvictionPolicy::remove(const std::string& name, const bool isEvicted)
+{
+  map<string, Node>::const_iterator cit = nodes.find(name);
+  if(cit == nodes.end())
+    return;
+  const bool wasInA1in = cit->second.queue == A1IN;
+  eraseNode(name);
+  if(isEvicted && wasInA1in && a1outPositions.count(name) == 0) {
+    a1outPositions[name] = a1out.insert(a1out.end(), name);
+    const unsigned int maxA1outSize = max<unsigned int>(100, (unsigned int)(nodes.size() * Kout));
+    while(maxA1outSize < a1out.size()) {
+      a1outPositions.erase(a1out.front());
+      a1out.pop_front();
+    }
+  }
+}
+
+void TwoQueueEvictionPolicy::visitInEvictionOrder(EvictionPolicy_Visitor& visitor)
+{
+  // Step 1) A1in while it is larger than its share.
+  set<pair<unsigned long long, string> >::const_iterator a1in_it = a1in.begin();
+  long long remainingA1inBytes = a1inBytes;
+  while(a1in_it != a1in.end() && totalBytes * Kin < remainingA1inBytes) {
+    remainingA1inBytes -= nodes[a1in_it->second].size;
+    if(!visitor.visit(a1in_it->second))
+      return;
+    ++a1in_it;
+  }
+  // Step 2) Am in LRU order.
+  for(set<pair<unsigned long long, string> >::const_iterator cit = am.begin(); cit != am.end(); ++cit) {
+    if(!visitor.visit(cit->second))
+      return;
+  }
+  // Step 3) The rest of A1in.
+  for(; a1in_it != a1in.end(); ++a1in_it) {
+    if(!visitor.visit(a1in_it->second))
+      return;
+  }
+}
+
+//------------------------------------------------------------------------------
+long long GDSFEvictionPolicy::refetchOverheadInBytes = 1024 * 1024ll; // opening a remote file costs as much as transferring 1Mbytes
+
+double GDSFEvictionPolicy::computePriority(const CacheEntry& entry) const
+{
+  const long long size      = max<long long>(entry.size, 4096ll);
+  const int       frequency = max<int>(entry.accessCount, 1);
+  return inflation + (double)frequency * (double)(refetchOverheadInBytes + size) / (double)size;
+}
+
+void GDSFEvictionPolicy::setPriority(const std::string& name, const double priority)
+{
+  remove(name, false);
+  name2priority[name] = priority;
+  order.insert(make_pair(priority, name));
+}
+
+void GDSFEvictionPolicy::insert(const std::string& name, const CacheEntry& entry)
+{
+  setPriority(name, computePriority(entry));
+}
+
+void GDSFEvictionPolicy::access(const std::string& name, const CacheEntry& entry)
+{
+  setPriority(name, computePriority(entry));
+}
+
+void GDSFEvictionPolicy::remove(const std::string& name, const bool isEvicted)
+{
+  map<string, double>::iterator it = name2priority.find(name);
+  if(it == name2priority.end())
+    return;
+  if(isEvicted)
+    inflation = max<double>(inflation, it->second);
+  order.erase(make_pair(it->second, name));
+  name2priority.erase(it);
+}
+
+void GDSFEvictionPolicy::visitInEvictionOrder(EvictionPolicy_Visitor& visitor)
+{
+  for(set<pair<double, string> >::const_iterator cit = order.begin(); cit != order.end(); ++cit) {
+    if(!visitor.visit(cit->second))
+      return;
+  }
+}
+
+//------------------------------------------------------------------------------
+EvictionPolicy* createEvictionPolicy(const char* name)
+{
+  if(strcmp(name, "lru") == 0)
+    return new LRUEvictionPolicy();
+  if(strcmp(name, "2q") == 0)
+    return new TwoQueueEvictionPolicy();
+  if(strcmp(name, "gdsf") == 0)
+    return new GDSFEvictionPolicy();
+  return NULL;
+}
+
+const char* getEvictionPolicyNames()
+{
+  return "lru 2q gdsf";
+}
+
+//------------------------------------------------------------------------------
+class SimulatedVictimCollector : public EvictionPolicy_Visitor {
+  const std::map<std::string, long long>& residentSizes;
+  const std::string&                      referencedName;
+  const long long                         bytesToBeEvicted;
+ public:
+  std::vector<std::string> victims;
+  long long                sizeOfVictims;
+
+  SimulatedVictimCollector(const std::map<std::string, long long>& residentSizes, const std::string& referencedName, const long long bytesToBeEvicted)
+    : residentSizes(residentSizes), referencedName(referencedName), bytesToBeEvicted(bytesToBeEvicted), sizeOfVictims(0ll) {}
+  virtual bool visit(const std::string& name) {
+    if(name == referencedName)
+      return true;
+    map<string, long long>::const_iterator cit = residentSizes.find(name);
+    if(cit == residentSizes.end())
+      return true;
+    victims.push_back(name);
+    sizeOfVictims += cit->second;
+    return sizeOfVictims < bytesToBeEvicted;
+  }
+};
+
+EvictionPolicySimulator::EvictionPolicySimulator(EvictionPolicy* policy)
+  : policy(policy), residentBytes(0ll), numberOfHits(0ll), numberOfMisses(0ll)
+{
+}
+
+EvictionPolicySimulator::~EvictionPolicySimulator()
+{
+  delete policy;
+}
+
+void EvictionPolicySimulator::reference(const std::string& name, const CacheEntry& entry, const long long capacityInBytes)
+{
+  map<string, long long>::iterator it = residentSizes.find(name);
+  if(it != residentSizes.end()) {
+    numberOfHits++;
+    residentBytes += entry.size - it->second;
+    it->second = entry.size;
+    policy->access(name, entry);
+  } else {
+    numberOfMisses++;
+    residentBytes += entry.size;
+    residentSizes[name] = entry.size;
+    policy->insert(name, entry);
+  }
+  if(capacityInBytes < residentBytes) {
+    SimulatedVictimCollector collector(residentSizes, name, residentBytes - capacityInBytes);
+    policy->visitInEvictionOrder(collector);
+    for(unsigned int i = 0; i < collector.victims.size(); i++) {
+      const string& victim = collector.victims[i];
+      policy->remove(victim, true);
+      residentBytes -= residentSizes[victim];
+      residentSizes.erase(victim);
+    }
+  }
+}
@@ -0,0 +1,149 @@
+#ifndef _HEADER_TGE_EVICT
+#define _HEADER_TGE_EVICT
+
+#include <sys/types.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <list>
+
+// Cache files of a lower class are evicted first. Pinned files are never evicted.
+enum CachePriorityClass {
+  PRIORITY_SCRATCH   = 0,
+  PRIORITY_NORMAL    = 1,
+  PRIORITY_REFERENCE = 2,
+  PRIORITY_PINNED    = 3
+};
+
+struct CacheEntry {
+  long long size;
+  time_t    lastAccessTime;
+  uid_t     owner;
+  int       accessCount;   // number of opens, counted by tgefs since atime is unreliable (noatime)
+  int       priorityClass; // CachePriorityClass
+  bool      isPinned;
+  bool      isDirty;
+
+  CacheEntry() : size(0ll), lastAccessTime(0), owner(0), accessCount(0), priorityClass(PRIORITY_NORMAL), isPinned(false), isDirty(false) {}
+};
+
+class EvictionPolicy_Visitor {
+ public:
+  EvictionPolicy_Visitor() {}
+  // returns false to stop visiting.
+  virtual bool visit(const std::string& name) = 0;
+  virtual ~EvictionPolicy_Visitor() {}
+};
+
+// An eviction policy decides the order in which cache entries are evicted.
+// The caller serializes all the calls.
+class EvictionPolicy {
+ public:
+  EvictionPolicy() {}
+  virtual const char* getName() const = 0;
+  // a new entry is fetched into the cache.
+  virtual void insert(const std::string& name, const CacheEntry& entry) = 0;
+  // an entry in the cache is referenced again, or its size is changed.
+  virtual void access(const std::string& name, const CacheEntry& entry) = 0;
+  // an entry is removed from the cache. isEvicted is true if the policy chose it.
+  virtual void remove(const std::string& name, const bool isEvicted) = 0;
+  // visits entries from the one which should be evicted first.
+  virtual void visitInEvictionOrder(EvictionPolicy_Visitor& visitor) = 0;
+  virtual ~EvictionPolicy() {}
+};
+
+// Plain LRU, which is what tgefs used to do.
+class LRUEvictionPolicy : public EvictionPolicy {
+  unsigned long long                                sequence;
+  std::map<std::string, unsigned long long>         name2sequence;
+  std::set<std::pair<unsigned long long, std::string> > order;
+ public:
+  LRUEvictionPolicy() : sequence(0) {}
+  virtual const char* getName() const { return "lru"; }
+  virtual void insert(const std::string& name, const CacheEntry& entry);
+  virtual void access(const std::string& name, const CacheEntry& entry);
+  virtual void remove(const std::string& name, const bool isEvicted);
+  virtual void visitInEvictionOrder(EvictionPolicy_Visitor& visitor);
+};
+
+// 2Q (Johnson and Shasha, VLDB '94), which is scan-resistant. New entries enter A1in (FIFO),
+// and they are promoted to Am (LRU) when referenced again, or when they come back while their
+// names are still remembered in A1out after being evicted from A1in. A1in is evicted first
+// as long as it holds more than Kin of the cached bytes, so a large one-shot scan flushes
+// only itself.
+class TwoQueueEvictionPolicy : public EvictionPolicy {
+  enum Queue { A1IN, AM };
+  struct Node {
+    Queue              queue;
+    long long          size;
+    unsigned long long sequence;
+  };
+  static double Kin;
+  static double Kout;
+
+  unsigned long long          sequence;
+  std::map<std::string, Node> nodes;
+  std::set<std::pair<unsigned long long, std::string> > a1in;
+  std::set<std::pair<unsigned long long, std::string> > am;
+  std::list<std::string>      a1out;
+  std::map<std::string, std::list<std::string>::iterator> a1outPositions; // of the names in A1out, to forget one in O(log n)
+  long long                   a1inBytes;
+  long long                   totalBytes;
+
+  void putNode(const std::string& name, const Queue queue, const long long size);
+  void eraseNode(const std::string& name);
+ public:
+  TwoQueueEvictionPolicy() : sequence(0), a1inBytes(0ll), totalBytes(0ll) {}
+  virtual const char* getName() const { return "2q"; }
+  virtual void insert(const std::string& name, const CacheEntry& entry);
+  virtual void access(const std::string& name, const CacheEntry& entry);
+  virtual void remove(const std::string& name, const bool isEvicted);
+  virtual void visitInEvictionOrder(EvictionPolicy_Visitor& visitor);
+};
+
+// GreedyDual-Size-Frequency (Cherkasova, HPL-98-69). The priority of an entry is
+// L + frequency * cost / size, where the cost to refetch a file is modeled as a fixed
+// per-file overhead plus its size, and L is raised to the priority of each evicted entry.
+// Small files referenced frequently stay longest, and stale entries age out through L.
+class GDSFEvictionPolicy : public EvictionPolicy {
+  static long long refetchOverheadInBytes;
+
+  double                                   inflation;
+  std::map<std::string, double>            name2priority;
+  std::set<std::pair<double, std::string> > order;
+
+  double computePriority(const CacheEntry& entry) const;
+  void   setPriority(const std::string& name, const double priority);
+ public:
+  GDSFEvictionPolicy() : inflation(0.0) {}
+  virtual const char* getName() const { return "gdsf"; }
+  virtual void insert(const std::string& name, const CacheEntry& entry);
+  virtual void access(const std::string& name, const CacheEntry& entry);
+  virtual void remove(const std::string& name, const bool isEvicted);
+  virtual void visitInEvictionOrder(EvictionPolicy_Visitor& visitor);
+};
+
+// returns NULL if the name is unknown.
+EvictionPolicy* createEvictionPolicy(const char* name);
+const char*     getEvictionPolicyNames();
+
+// Replays the references to the cache against a policy with a given capacity,
+// only keeping metadata, so that the hit ratios of policies can be compared.
+class EvictionPolicySimulator {
+  EvictionPolicy*                  policy;
+  std::map<std::string, long long> residentSizes;
+  long long                        residentBytes;
+  long long                        numberOfHits;
+  long long                        numberOfMisses;
+ public:
+  EvictionPolicySimulator(EvictionPolicy* policy);
+  ~EvictionPolicySimulator();
+  const char* getName() const { return policy->getName(); }
+  void reference(const std::string& name, const CacheEntry& entry, const long long capacityInBytes);
+  long long getNumberOfHits()   const { return numberOfHits;   }
+  long long getNumberOfMisses() const { return numberOfMisses; }
+};
+
+#endif // #ifndef _HEADER_TGE_EVICT
@@ -10,17 +10,48 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include "lzocomp.h"
+#include "lzoparallel.h"
+#include "tge_fcopy.h"
 
 using namespace std;
 
 // Compressed file format (total 16bytes):
 //
 // Signature             7 bytes : L Z O \FC \AC \BA \71
-// Compression algorithm 1 byte  : 1 (for LZO)
+// Compression algorithm 1 byte  : 1 (for LZO) or 2 (for LZ4) in the lower 4 bits, and the format
+//                                 version of the blocks in the upper 4 bits (0 for version 1)
 // File size             8 bytss :
+//
+// The blocks follow the header (see lzoparallel.h for the formats).
 
 char LZO_signature[] = "LZO\xfc\xac\xba\x71";
-const char COMPRESSION_TYPE_LZO = 1;
+
+char lzo_compression_type(const int format_version, const char algorithm)
+{
+  return algorithm | (format_version <= 1 ? 0 : format_version << 4);
+}
+
+char lzo_compression_algorithm(const char compression_type)
+{
+  return compression_type & 0x0f;
+}
+
+int lzo_format_version(const char compression_type)
+{
+  const int version = (unsigned char)compression_type >> 4;
+  return version == 0 ? 1 : version;
+}
+
+// a file which starts with the signature but has an unknown compression type is not one of ours.
+static bool is_lzo_header(const unsigned char* header)
+{
+  const int LZO_signature_length = strlen(LZO_signature);
+  if(memcmp(LZO_signature, header, LZO_signature_length) != 0)
+    return false;
+  const char compressionType = header[LZO_signature_length];
+  return ParallelLZO::isSupportedAlgorithm(lzo_compression_algorithm(compressionType))
+    && ParallelLZO::isSupportedFormatVersion(lzo_format_version(compressionType));
+}
 
 bool copyFile(const char *srcPath, const char *destPath, int mode)
 {
@@ -31,22 +62,31 @@ bool copyFile(const char *srcPath, const char *destPath, int mode)
     close(srcfd);
     return false;
   }
+  bool succeeded = true;
   {
     const int bufferSize = 16 * 1024 * 1024; // 16MegaBytes
     char* buffer = new char[bufferSize];
-    unsigned int readBytes;
+    ssize_t readBytes;
     while((readBytes = read(srcfd, buffer, bufferSize)) > 0) {
-      write(destfd, buffer, readBytes);
+      if(write(destfd, buffer, readBytes) != readBytes) {
+	succeeded = false;
+	break;
+      }
     }
+    if(readBytes < 0)
+      succeeded = false;
     delete[] buffer;
   }
   close(srcfd);
-  close(destfd);
-  return true;
+  if(close(destfd) != 0)
+    succeeded = false;
+  return succeeded;
 }
 
-bool copyFileWithCompression(const char *srcPath, const char *destPath, int mode)
+bool copyFileWithCompression(const char *srcPath, const char *destPath, int mode, const char algorithm, bool* destFileWasCompressed)
 {
+  if(destFileWasCompressed != NULL)
+    *destFileWasCompressed = false;
   const int srcfd = open(srcPath, O_RDONLY | O_LARGEFILE);
   if(srcfd == -1) return false;
   struct stat st;
@@ -55,25 +95,46 @@ bool copyFileWithCompression(const char *srcPath, const char *destPath, int mode
     if(result == -1) return false;
     if(st.st_mode & S_IFMT != S_IFREG) false; // not a regular file. non-regular file may not have a file size.
   }
+  if(!ParallelLZO::isWorthCompressing(srcfd, algorithm)) {
+    // already compressed data (gz, bam, jpg, ...) would not shrink, so it is copied as it is.
+    close(srcfd);
+    return copyFile(srcPath, destPath, mode);
+  }
   const int destfd = open(destPath, O_CREAT | O_TRUNC | O_WRONLY | O_NOFOLLOW | O_LARGEFILE, mode);
   if(destfd == -1) {
     close(srcfd);
     return false;
   }
-  {
-    char buffer[16];
-    const int LZO_signature_length = strlen(LZO_signature);
-    memcpy(buffer    , LZO_signature        , LZO_signature_length);
-    memcpy(buffer + 7, &COMPRESSION_TYPE_LZO, sizeof(COMPRESSION_TYPE_LZO));
-    const unsigned long long fileSize = st.st_size;
-    memcpy(buffer + 8, &fileSize            , sizeof(fileSize));
-    write(destfd, buffer, 16);
-  }
-  LZO lzoObject;
-  lzoObject.compress(srcfd, destfd);
+  const bool compressionSucceeded = compressFile(srcfd, destfd, st.st_size, algorithm);
   close(srcfd);
   close(destfd);
-  return true;
+  if(compressionSucceeded && destFileWasCompressed != NULL)
+    *destFileWasCompressed = true;
+  return compressionSucceeded;
+}
+
+bool compressFile(const int srcfd, const int destfd, const long long srcFileSize, const char algorithm)
+{
+  char buffer[16];
+  const int LZO_signature_length = strlen(LZO_signature);
+  memcpy(buffer    , LZO_signature        , LZO_signature_length);
+  buffer[7] = lzo_compression_type(ParallelLZO::defaultFormatVersion, algorithm);
+  const unsigned long long fileSize = srcFileSize;
+  memcpy(buffer + 8, &fileSize            , sizeof(fileSize));
+  if(write(destfd, buffer, 16) != 16)
+    return false;
+  ParallelLZO lzoObject;
+  return lzoObject.compress(srcfd, destfd, ParallelLZO::defaultFormatVersion, algorithm);
+}
+
+bool is_worth_compressing(const char* infilename, const char algorithm)
+{
+  const int fd = open(infilename, O_RDONLY | O_LARGEFILE);
+  if(fd == -1)
+    return true;
+  const bool isWorth = ParallelLZO::isWorthCompressing(fd, algorithm);
+  close(fd);
+  return isWorth;
 }
 
 bool copyFileWithDecompression(const char *srcPath, const char *destPath, int mode, bool* srcFileWasCompressed)
@@ -87,20 +148,21 @@ bool copyFileWithDecompression(const char *srcPath, const char *destPath, int mo
     close(srcfd);
     return false;
   }
+  bool succeeded = true;
   {
-    unsigned lzbuffer[128];
+    unsigned char lzbuffer[128];
     const int LZO_signature_length = strlen(LZO_signature);
     const int headerSize = LZO_signature_length + sizeof(char) + sizeof(long long);
     int minusOffsetBytes = read(srcfd, lzbuffer, headerSize);
-    const bool decompressionCopy = minusOffsetBytes == headerSize && memcmp(LZO_signature, lzbuffer, LZO_signature_length) == 0;
+    const bool decompressionCopy = minusOffsetBytes == headerSize && is_lzo_header(lzbuffer);
     if(decompressionCopy) {
       if(srcFileWasCompressed != NULL)
 	*srcFileWasCompressed = true;
       const char compressionType = lzbuffer[LZO_signature_length];
       const long long fileSize   = *((long long *)(lzbuffer + LZO_signature_length + sizeof(char)));
-      // above two variables are obtained but not used yet.
-      LZO lzoObject;
-      lzoObject.decompress(srcfd, destfd);
+      // the file size is obtained but not used yet.
+      ParallelLZO lzoObject;
+      succeeded = lzoObject.decompress(srcfd, destfd, lzo_format_version(compressionType), lzo_compression_algorithm(compressionType));
     } else {
       write(destfd, lzbuffer, minusOffsetBytes);
 
@@ -116,7 +178,11 @@ bool copyFileWithDecompression(const char *srcPath, const char *destPath, int mo
   }
   close(srcfd);
   close(destfd);
-  return true;
+  if(!succeeded) {
+    // a broken cache file must not be taken for a fresh one later.
+    unlink(destPath);
+  }
+  return succeeded;
 }
 
 bool is_lzo_compressed_file(const char* infilename, char* compression_type, long long* file_size)
@@ -140,7 +206,7 @@ bool is_lzo_compressed_file(const char* infilename, char* compression_type, long
   if(readBytes < headerLength) {
     return false;
   }
-  const bool isCompressedFile = memcmp(LZO_signature, lzbuffer, LZO_signature_length) == 0;
+  const bool isCompressedFile = is_lzo_header(lzbuffer);
   const char compressionType = lzbuffer[LZO_signature_length];
   const long long fileSize   = *((long long *)(lzbuffer + LZO_signature_length + sizeof(char)));
   if(isCompressedFile) {
@@ -2,9 +2,20 @@
 #define _HEADER_TGE_FCOPY
 
 bool copyFile(const char *srcPath, const char *destPath, int mode);
-bool copyFileWithCompression(const char *srcPath, const char *destPath, int mode);
+// the compression algorithms in the header of a compressed file
+const char COMPRESSION_TYPE_LZO = 1;
+const char COMPRESSION_TYPE_LZ4 = 2;
+
+// a file which would not shrink is copied uncompressed, and *destFileWasCompressed tells it.
+bool copyFileWithCompression(const char *srcPath, const char *destPath, int mode, const char algorithm = COMPRESSION_TYPE_LZO, bool* destFileWasCompressed = NULL);
+// writes the header and the compressed data of srcfd to destfd, without closing them.
+bool compressFile(const int srcfd, const int destfd, const long long srcFileSize, const char algorithm = COMPRESSION_TYPE_LZO);
 bool copyFileWithDecompression(const char *srcPath, const char *destPath, int mode, bool* srcFileWasCompressed = NULL);
 bool is_lzo_compressed_file(const char* infilename, char* compression_type = NULL, long long* file_size = NULL);
+bool is_worth_compressing(const char* infilename, const char algorithm = COMPRESSION_TYPE_LZO);
+char lzo_compression_type(const int format_version, const char algorithm = COMPRESSION_TYPE_LZO);
+int  lzo_format_version(const char compression_type);
+char lzo_compression_algorithm(const char compression_type);
 
 extern char LZO_signature[];
 
@@ -0,0 +1,735 @@
+#if HAVE_CONFIG
+ #include "config.h"
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <vector>
+#include "tge_log.h"
+#include "tge_index.h"
+
+using namespace std;
+
+namespace {
+  const char INDEX_MAGIC[8]     = "TGEIDX1";
+  const unsigned int INDEX_VERSION = 1;
+  const unsigned int LOG_MAGIC  = 0x4c454754u; // "TGEL"
+  const size_t NAME_LENGTH      = 32;          // SHA-256
+  const size_t HEADER_SIZE      = 4096;
+
+  enum RecordState {
+    RECORD_EMPTY   = 0,
+    RECORD_USED    = 1,
+    RECORD_DELETED = 2
+  };
+
+  enum LogOperation {
+    LOG_PUT    = 1,
+    LOG_REMOVE = 2
+  };
+
+  unsigned int fnv1a32(const void* buffer, const size_t size, unsigned int h = 2166136261u)
+  {
+    const unsigned char* p = static_cast<const unsigned char*>(buffer);
+    for(size_t i = 0; i < size; i++) {
+      h ^= p[i];
+      h *= 16777619u;
+    }
+    return h;
+  }
+
+  bool writeFully(const int fd, const void* buffer, const size_t size)
+  {
+    const char* p = static_cast<const char*>(buffer);
+    size_t written = 0;
+    while(written < size) {
+      const ssize_t result = write(fd, p + written, size - written);
+      if(result < 0) {
+	if(errno == EINTR)
+	  continue;
+	return false;
+      }
+      written += result;
+    }
+    return true;
+  }
+}
+
+struct CacheFileIndex::Header {
+  char               magic[8];
+  unsigned int       version;
+  unsigned int       recordSize;
+  unsigned long long capacity;           // the number of records, which is a power of 2
+  unsigned long long pathsGeneration;    // the suffix of the paths file
+};
+
+struct CacheFileIndex::Record {          // 128 bytes
+  unsigned char      state;
+  unsigned char      isCompressed;
+  unsigned char      hasSourceAttributes;
+  unsigned char      hasOwner;
+  unsigned int       pathLength;
+  unsigned long long pathOffset;         // in the paths file
+  unsigned long long pathHash;
+  long long          size;
+  long long          sourceMTime;
+  unsigned int       accessCount;
+  unsigned int       sourceMTimeNsec;
+  unsigned char      name[NAME_LENGTH];
+  unsigned long long sourceInode;
+  long long          sourceSize;
+  long long          sourceCTime;
+  unsigned int       sourceCTimeNsec;
+  unsigned int       owner;
+  unsigned char      reserved1[16];
+};
+
+struct CacheFileIndex::LogEntry {        // followed by the path
+  unsigned int       magic;
+  unsigned int       operation;
+  unsigned int       pathLength;
+  unsigned int       checksum;           // of the entry with this field zeroed, and the path
+  Record             record;             // the name and the metadata
+};
+
+const unsigned int CacheFileIndex::INITIAL_CAPACITY                    = 4096;
+const double       CacheFileIndex::MAXIMUM_LOAD_FACTOR                 = 0.7;
+const long long    CacheFileIndex::CHECKPOINT_LOG_SIZE_IN_BYTES        = 4 * 1024 * 1024ll;  // 4Mbytes
+const long long    CacheFileIndex::MINIMUM_GARBAGE_TO_COMPACT_IN_BYTES = 1 * 1024 * 1024ll;  // 1Mbytes
+
+CacheFileIndex::CacheFileIndex()
+  : tableFd(-1), pathsFd(-1), logFd(-1), header(NULL), records(NULL), mappedSize(0),
+    pathsSize(0ll), pathsLiveSize(0ll), logSize(0ll), numberOfRecords(0ull), numberOfTombstones(0ull)
+{
+  // the layout of the files must not change silently.
+  (void)sizeof(char[sizeof(Record) == 128 ? 1 : -1]);
+  (void)sizeof(char[sizeof(Header) <= HEADER_SIZE ? 1 : -1]);
+}
+
+CacheFileIndex::~CacheFileIndex()
+{
+  close();
+}
+
+std::string CacheFileIndex::getTableFileName() const
+{
+  return baseName + ".idx";
+}
+
+std::string CacheFileIndex::getPathsFileName(const unsigned long long generation) const
+{
+  char suffix[32];
+  sprintf(suffix, ".paths.%llu", generation);
+  return baseName + suffix;
+}
+
+std::string CacheFileIndex::getLogFileName() const
+{
+  return baseName + ".wal";
+}
+
+bool CacheFileIndex::decodeName(const std::string& cacheFileName, unsigned char* name)
+{
+  if(cacheFileName.size() != NAME_LENGTH * 2)
+    return false;
+  for(size_t i = 0; i < NAME_LENGTH * 2; i++) {
+    const char c = cacheFileName[i];
+    int v;
+    if('0' <= c && c <= '9')      v = c - '0';
+    else if('a' <= c && c <= 'f') v = c - 'a' + 10;
+    else if('A' <= c && c <= 'F') v = c - 'A' + 10;
+    else return false;
+    if(i % 2 == 0)
+      name[i / 2] = v << 4;
+    else
+      name[i / 2] |= v;
+  }
+  return true;
+}
+
+std::string CacheFileIndex::encodeName(const unsigned char* name)
+{
+  static const char hexDigits[] = "0123456789ABCDEF";
+  string retval(NAME_LENGTH * 2, '0');
+  for(size_t i = 0; i < NAME_LENGTH; i++) {
+    retval[i * 2]     = hexDigits[name[i] >> 4];
+    retval[i * 2 + 1] = hexDigits[name[i] & 15];
+  }
+  return retval;
+}
+
+unsigned long long CacheFileIndex::hashPath(const std::string& originalFullPathName)
+{
+  // FNV-1a
+  unsigned long long h = 14695981039346656037ull;
+  for(string::size_type i = 0; i < originalFullPathName.size(); i++) {
+    h ^= (unsigned char)originalFullPathName[i];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+SourceFileAttributes::SourceFileAttributes(const struct stat& st, const bool isCompressed)
+  : isValid(true), isCompressed(isCompressed), inode(st.st_ino), size(st.st_size),
+    mtime(st.st_mtim.tv_sec), mtimeNsec(st.st_mtim.tv_nsec), ctime(st.st_ctim.tv_sec), ctimeNsec(st.st_ctim.tv_nsec)
+{
+}
+
+bool SourceFileAttributes::matches(const struct stat& st) const
+{
+  // a file replaced by rename changes the inode, and a file rewritten within a second changes the nanoseconds.
+  return isValid && inode == st.st_ino && size == st.st_size
+    && mtime == st.st_mtim.tv_sec && mtimeNsec == st.st_mtim.tv_nsec
+    && ctime == st.st_ctim.tv_sec && ctimeNsec == st.st_ctim.tv_nsec;
+}
+
+void CacheFileIndex::storeMetadata(Record& record, const CacheFileMetadata& metadata)
+{
+  record.size                = metadata.size;
+  record.accessCount         = metadata.accessCount;
+  record.hasOwner            = metadata.hasOwner ? 1 : 0;
+  record.owner               = metadata.owner;
+  record.isCompressed        = metadata.source.isCompressed ? 1 : 0;
+  record.hasSourceAttributes = metadata.source.isValid ? 1 : 0;
+  record.sourceInode         = metadata.source.inode;
+  record.sourceSize          = metadata.source.size;
+  record.sourceMTime         = metadata.source.mtime;
+  record.sourceMTimeNsec     = metadata.source.mtimeNsec;
+  record.sourceCTime         = metadata.source.ctime;
+  record.sourceCTimeNsec     = metadata.source.ctimeNsec;
+}
+
+void CacheFileIndex::loadMetadata(const Record& record, CacheFileMetadata& metadata)
+{
+  metadata.size                = record.size;
+  metadata.accessCount         = record.accessCount;
+  metadata.hasOwner            = record.hasOwner != 0;
+  metadata.owner               = record.owner;
+  metadata.source.isCompressed = record.isCompressed != 0;
+  metadata.source.isValid      = record.hasSourceAttributes != 0;
+  metadata.source.inode        = record.sourceInode;
+  metadata.source.size         = record.sourceSize;
+  metadata.source.mtime        = record.sourceMTime;
+  metadata.source.mtimeNsec    = record.sourceMTimeNsec;
+  metadata.source.ctime        = record.sourceCTime;
+  metadata.source.ctimeNsec    = record.sourceCTimeNsec;
+}
+
+bool CacheFileIndex::createTable_internal(const std::string& fileName, const unsigned long long capacity, const unsigned long long generation,
+					  int* fd, Header** newHeader, size_t* newMappedSize)
+{
+  *fd = ::open(fileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if(*fd < 0) {
+    logprintf(0, LOG_ERROR, "Could not create '%s'. (errno=%d)\n", fileName.c_str(), errno);
+    return false;
+  }
+  *newMappedSize = HEADER_SIZE + capacity * sizeof(Record);
+  if(ftruncate(*fd, *newMappedSize) != 0) {
+    logprintf(0, LOG_ERROR, "Could not extend '%s'. (errno=%d)\n", fileName.c_str(), errno);
+    ::close(*fd);
+    unlink(fileName.c_str());
+    return false;
+  }
+  void* p = mmap(NULL, *newMappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+  if(p == MAP_FAILED) {
+    logprintf(0, LOG_ERROR, "Could not map '%s'. (errno=%d)\n", fileName.c_str(), errno);
+    ::close(*fd);
+    unlink(fileName.c_str());
+    return false;
+  }
+  // the file is sparse and filled with zeros, which means RECORD_EMPTY.
+  *newHeader = static_cast<Header*>(p);
+  memcpy((*newHeader)->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+  (*newHeader)->version         = INDEX_VERSION;
+  (*newHeader)->recordSize      = sizeof(Record);
+  (*newHeader)->capacity        = capacity;
+  (*newHeader)->pathsGeneration = generation;
+  return true;
+}
+
+bool CacheFileIndex::openTable_internal_shouldBeCalledWithMutexLocked()
+{
+  const string tableFileName = getTableFileName();
+  tableFd = ::open(tableFileName.c_str(), O_RDWR);
+  if(tableFd < 0)
+    return false;
+  struct stat st;
+  if(fstat(tableFd, &st) != 0 || st.st_size < (off_t)HEADER_SIZE) {
+    ::close(tableFd);
+    tableFd = -1;
+    return false;
+  }
+  void* p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, tableFd, 0);
+  if(p == MAP_FAILED) {
+    ::close(tableFd);
+    tableFd = -1;
+    return false;
+  }
+  header     = static_cast<Header*>(p);
+  mappedSize = st.st_size;
+  const unsigned long long capacity = header->capacity;
+  if(memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 || header->version != INDEX_VERSION || header->recordSize != sizeof(Record)
+     || capacity == 0 || (capacity & (capacity - 1)) != 0 || mappedSize != HEADER_SIZE + capacity * sizeof(Record)) {
+    logprintf(0, LOG_ERROR, "'%s' is broken or of an unknown version.\n", tableFileName.c_str());
+    closeTable_internal_shouldBeCalledWithMutexLocked();
+    return false;
+  }
+  records = reinterpret_cast<Record*>(static_cast<char*>(p) + HEADER_SIZE);
+  return true;
+}
+
+void CacheFileIndex::closeTable_internal_shouldBeCalledWithMutexLocked()
+{
+  if(header != NULL)
+    munmap(header, mappedSize);
+  if(tableFd >= 0)
+    ::close(tableFd);
+  header     = NULL;
+  records    = NULL;
+  mappedSize = 0;
+  tableFd    = -1;
+}
+
+bool CacheFileIndex::open(const std::string& baseName, bool* isCreated)
+{
+  Mutex::scoped_lock lock(index_mutex);
+  this->baseName = baseName;
+  *isCreated = false;
+  struct stat st;
+  if(stat(getTableFileName().c_str(), &st) == 0 && !openTable_internal_shouldBeCalledWithMutexLocked()) {
+    const string brokenFileName = getTableFileName() + ".broken";
+    logprintf(0, LOG_WARNING, "Moved '%s' to '%s', and created a new one.\n", getTableFileName().c_str(), brokenFileName.c_str());
+    rename(getTableFileName().c_str(), brokenFileName.c_str());
+  }
+  if(header == NULL) {
+    if(!createTable_internal(getTableFileName(), INITIAL_CAPACITY, 0, &tableFd, &header, &mappedSize))
+      return false;
+    records = reinterpret_cast<Record*>(reinterpret_cast<char*>(header) + HEADER_SIZE);
+    unlink(getPathsFileName(0).c_str());
+    unlink(getLogFileName().c_str());
+    *isCreated = true;
+  }
+  // a rebuild may have been interrupted before or after the rename.
+  if(0 < header->pathsGeneration)
+    unlink(getPathsFileName(header->pathsGeneration - 1).c_str());
+  unlink(getPathsFileName(header->pathsGeneration + 1).c_str());
+  unlink((getTableFileName() + ".tmp").c_str());
+
+  const string pathsFileName = getPathsFileName(header->pathsGeneration);
+  pathsFd = ::open(pathsFileName.c_str(), O_RDWR | O_CREAT | O_APPEND, 0600);
+  if(pathsFd < 0) {
+    logprintf(0, LOG_ERROR, "Could not open '%s'. (errno=%d)\n", pathsFileName.c_str(), errno);
+    closeTable_internal_shouldBeCalledWithMutexLocked();
+    return false;
+  }
+  pathsSize = fstat(pathsFd, &st) == 0 ? st.st_size : 0ll;
+
+  // the table may have been written partially, so the counts are not trusted.
+  numberOfRecords    = 0;
+  numberOfTombstones = 0;
+  pathsLiveSize      = 0;
+  for(unsigned long long i = 0; i < header->capacity; i++) {
+    Record& record = records[i];
+    if(record.state == RECORD_USED) {
+      if(pathsSize < (long long)(record.pathOffset + record.pathLength)) {
+	record.state = RECORD_DELETED;
+      } else {
+	numberOfRecords++;
+	pathsLiveSize += record.pathLength;
+	continue;
+      }
+    }
+    if(record.state == RECORD_DELETED)
+      numberOfTombstones++;
+  }
+
+  const string logFileName = getLogFileName();
+  logFd = ::open(logFileName.c_str(), O_RDWR | O_CREAT | O_APPEND, 0600);
+  if(logFd < 0) {
+    logprintf(0, LOG_ERROR, "Could not open '%s'. (errno=%d)\n", logFileName.c_str(), errno);
+    ::close(pathsFd);
+    pathsFd = -1;
+    closeTable_internal_shouldBeCalledWithMutexLocked();
+    return false;
+  }
+  logSize = fstat(logFd, &st) == 0 ? st.st_size : 0ll;
+  if(0 < logSize)
+    replayLog_internal_shouldBeCalledWithMutexLocked();
+  checkpoint_internal_shouldBeCalledWithMutexLocked();
+  logprintf(1, LOG_INFO, "Opened the cache index '%s' (%llu entries).\n", getTableFileName().c_str(), numberOfRecords);
+  return true;
+}
+
+void CacheFileIndex::close()
+{
+  Mutex::scoped_lock lock(index_mutex);
+  if(header == NULL)
+    return;
+  checkpoint_internal_shouldBeCalledWithMutexLocked();
+  closeTable_internal_shouldBeCalledWithMutexLocked();
+  ::close(pathsFd);
+  ::close(logFd);
+  pathsFd = -1;
+  logFd   = -1;
+}
+
+CacheFileIndex::Record* CacheFileIndex::findRecord_internal_shouldBeCalledWithMutexLocked(const unsigned char* name, Record* table,
+											  const unsigned long long capacity) const
+{
+  // the name is a cryptographic hash, so its first bytes are already uniform.
+  unsigned long long h;
+  memcpy(&h, name, sizeof(h));
+  const unsigned long long mask = capacity - 1;
+  Record* firstTombstone = NULL;
+  for(unsigned long long i = h & mask; ; i = (i + 1) & mask) {
+    Record& record = table[i];
+    if(record.state == RECORD_EMPTY)
+      return firstTombstone != NULL ? firstTombstone : &record;
+    if(record.state == RECORD_DELETED) {
+      if(firstTombstone == NULL)
+	firstTombstone = &record;
+    } else if(memcmp(record.name, name, NAME_LENGTH) == 0) {
+      return &record;
+    }
+  }
+}
+
+bool CacheFileIndex::readPath_internal_shouldBeCalledWithMutexLocked(const Record& record, std::string& originalFullPathName) const
+{
+  vector<char> buffer(record.pathLength);
+  size_t readSize = 0;
+  while(readSize < record.pathLength) {
+    const ssize_t result = pread(pathsFd, &buffer[readSize], record.pathLength - readSize, record.pathOffset + readSize);
+    if(result < 0 && errno == EINTR)
+      continue;
+    if(result <= 0) {
+      logprintf(0, LOG_ERROR, "Could not read a path from '%s'. (errno=%d)\n", getPathsFileName(header->pathsGeneration).c_str(), errno);
+      return false;
+    }
+    readSize += result;
+  }
+  originalFullPathName.assign(buffer.begin(), buffer.end());
+  return true;
+}
+
+bool CacheFileIndex::reserve_internal_shouldBeCalledWithMutexLocked()
+{
+  if(numberOfRecords + numberOfTombstones + 1 < header->capacity * MAXIMUM_LOAD_FACTOR)
+    return true;
+  // grow only if the tombstones are not the majority.
+  const unsigned long long newCapacity = numberOfTombstones < numberOfRecords ? header->capacity * 2 : header->capacity;
+  return rebuild_internal_shouldBeCalledWithMutexLocked(newCapacity);
+}
+
+bool CacheFileIndex::put_internal_shouldBeCalledWithMutexLocked(const unsigned char* name, const std::string& originalFullPathName, const CacheFileMetadata& metadata)
+{
+  if(!reserve_internal_shouldBeCalledWithMutexLocked())
+    return false;
+  Record* record = findRecord_internal_shouldBeCalledWithMutexLocked(name, records, header->capacity);
+  const unsigned long long pathHash = hashPath(originalFullPathName);
+  const bool isSamePath = record->state == RECORD_USED && record->pathHash == pathHash && record->pathLength == originalFullPathName.size();
+  if(!isSamePath) {
+    if(!writeFully(pathsFd, originalFullPathName.data(), originalFullPathName.size())) {
+      logprintf(0, LOG_ERROR, "Could not write to '%s'. (errno=%d)\n", getPathsFileName(header->pathsGeneration).c_str(), errno);
+      return false;
+    }
+    if(record->state == RECORD_USED) {
+      pathsLiveSize -= record->pathLength;
+    } else {
+      if(record->state == RECORD_DELETED)
+	numberOfTombstones--;
+      numberOfRecords++;
+      memcpy(record->name, name, NAME_LENGTH);
+    }
+    record->pathOffset = pathsSize;
+    record->pathLength = originalFullPathName.size();
+    record->pathHash   = pathHash;
+    pathsSize     += originalFullPathName.size();
+    pathsLiveSize += originalFullPathName.size();
+  }
+  storeMetadata(*record, metadata);
+  // the state is set at last, so that a partially written record is not used.
+  record->state        = RECORD_USED;
+  return true;
+}
+
+bool CacheFileIndex::remove_internal_shouldBeCalledWithMutexLocked(const unsigned char* name)
+{
+  Record* record = findRecord_internal_shouldBeCalledWithMutexLocked(name, records, header->capacity);
+  if(record->state != RECORD_USED)
+    return false;
+  record->state = RECORD_DELETED;
+  numberOfRecords--;
+  numberOfTombstones++;
+  pathsLiveSize -= record->pathLength;
+  return true;
+}
+
+bool CacheFileIndex::appendLog_internal_shouldBeCalledWithMutexLocked(const int operation, const unsigned char* name,
+								     const std::string& originalFullPathName, const CacheFileMetadata& metadata)
+{
+  vector<char> buffer(sizeof(LogEntry) + originalFullPathName.size()); // zero-filled, including the checksum and the reserved fields
+  LogEntry* entry = reinterpret_cast<LogEntry*>(&buffer[0]);
+  entry->magic        = LOG_MAGIC;
+  entry->operation    = operation;
+  entry->pathLength   = originalFullPathName.size();
+  memcpy(entry->record.name, name, NAME_LENGTH);
+  storeMetadata(entry->record, metadata);
+  if(!originalFullPathName.empty())
+    memcpy(&buffer[sizeof(LogEntry)], originalFullPathName.data(), originalFullPathName.size());
+  entry->checksum = fnv1a32(&buffer[0], buffer.size());
+  if(!writeFully(logFd, &buffer[0], buffer.size())) {
+    logprintf(0, LOG_ERROR, "Could not write to '%s'. (errno=%d)\n", getLogFileName().c_str(), errno);
+    return false;
+  }
+  logSize += buffer.size();
+  if(operation == LOG_REMOVE && fdatasync(logFd) != 0) {
+    logprintf(0, LOG_ERROR, "Could not flush '%s'. (errno=%d)\n", getLogFileName().c_str(), errno);
+    return false;
+  }
+  return true;
+}
+
+void CacheFileIndex::replayLog_internal_shouldBeCalledWithMutexLocked()
+{
+  vector<char> buffer(logSize);
+  size_t readSize = 0;
+  while(readSize < buffer.size()) {
+    const ssize_t result = pread(logFd, &buffer[readSize], buffer.size() - readSize, readSize);
+    if(result < 0 && errno == EINTR)
+      continue;
+    if(result <= 0)
+      break;
+    readSize += result;
+  }
+  // the operations are idempotent, so those already in the table are just done again.
+  int numberOfOperations = 0;
+  size_t position = 0;
+  while(position + sizeof(LogEntry) <= readSize) {
+    LogEntry entry;
+    memcpy(&entry, &buffer[position], sizeof(LogEntry));
+    if(entry.magic != LOG_MAGIC || readSize < position + sizeof(LogEntry) + entry.pathLength)
+      break;
+    const unsigned int checksum = entry.checksum;
+    LogEntry* entryInBuffer = reinterpret_cast<LogEntry*>(&buffer[position]);
+    entryInBuffer->checksum = 0;
+    if(fnv1a32(entryInBuffer, sizeof(LogEntry) + entry.pathLength) != checksum)
+      break; // the tail was being written
+    if(entry.operation == LOG_PUT) {
+      CacheFileMetadata metadata;
+      loadMetadata(entry.record, metadata);
+      put_internal_shouldBeCalledWithMutexLocked(entry.record.name, string(&buffer[position + sizeof(LogEntry)], entry.pathLength), metadata);
+    } else if(entry.operation == LOG_REMOVE) {
+      remove_internal_shouldBeCalledWithMutexLocked(entry.record.name);
+    }
+    numberOfOperations++;
+    position += sizeof(LogEntry) + entry.pathLength;
+  }
+  logprintf(0, LOG_INFO, "Replayed %d operations from '%s'.\n", numberOfOperations, getLogFileName().c_str());
+}
+
+bool CacheFileIndex::rebuild_internal_shouldBeCalledWithMutexLocked(const unsigned long long newCapacity)
+{
+  const unsigned long long newGeneration = header->pathsGeneration + 1;
+  const string newTableFileName = getTableFileName() + ".tmp";
+  const string newPathsFileName = getPathsFileName(newGeneration);
+  int newTableFd;
+  Header* newHeader;
+  size_t newMappedSize;
+  if(!createTable_internal(newTableFileName, newCapacity, newGeneration, &newTableFd, &newHeader, &newMappedSize))
+    return false;
+  Record* newRecords = reinterpret_cast<Record*>(reinterpret_cast<char*>(newHeader) + HEADER_SIZE);
+  const int newPathsFd = ::open(newPathsFileName.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0600);
+  bool succeeded = newPathsFd >= 0;
+  long long newPathsSize = 0ll;
+  for(unsigned long long i = 0; succeeded && i < header->capacity; i++) {
+    const Record& record = records[i];
+    if(record.state != RECORD_USED)
+      continue;
+    string originalFullPathName;
+    if(!readPath_internal_shouldBeCalledWithMutexLocked(record, originalFullPathName)
+       || !writeFully(newPathsFd, originalFullPathName.data(), originalFullPathName.size())) {
+      succeeded = false;
+      break;
+    }
+    Record* newRecord = findRecord_internal_shouldBeCalledWithMutexLocked(record.name, newRecords, newCapacity);
+    *newRecord = record;
+    newRecord->pathOffset = newPathsSize;
+    newPathsSize += record.pathLength;
+  }
+  if(succeeded)
+    succeeded = fdatasync(newPathsFd) == 0 && msync(newHeader, newMappedSize, MS_SYNC) == 0;
+  if(succeeded)
+    succeeded = rename(newTableFileName.c_str(), getTableFileName().c_str()) == 0;
+  if(!succeeded) {
+    logprintf(0, LOG_ERROR, "Could not rebuild the cache index '%s'. (errno=%d)\n", getTableFileName().c_str(), errno);
+    munmap(newHeader, newMappedSize);
+    ::close(newTableFd);
+    unlink(newTableFileName.c_str());
+    if(newPathsFd >= 0) {
+      ::close(newPathsFd);
+      unlink(newPathsFileName.c_str());
+    }
+    return false;
+  }
+  // everything in the log is in the new table now.
+  const string oldPathsFileName = getPathsFileName(header->pathsGeneration);
+  closeTable_internal_shouldBeCalledWithMutexLocked();
+  ::close(pathsFd);
+  unlink(oldPathsFileName.c_str());
+  tableFd            = newTableFd;
+  header             = newHeader;
+  records            = newRecords;
+  mappedSize         = newMappedSize;
+  pathsFd            = newPathsFd;
+  pathsSize          = newPathsSize;
+  pathsLiveSize      = newPathsSize;
+  numberOfTombstones = 0;
+  if(ftruncate(logFd, 0) == 0)
+    logSize = 0;
+  logprintf(1, LOG_INFO, "Rebuilt the cache index '%s' (capacity=%llu, entries=%llu).\n", getTableFileName().c_str(), newCapacity, numberOfRecords);
+  return true;
+}
+
+void CacheFileIndex::checkpoint_internal_shouldBeCalledWithMutexLocked()
+{
+  if(MINIMUM_GARBAGE_TO_COMPACT_IN_BYTES < pathsSize - pathsLiveSize && pathsLiveSize < pathsSize - pathsLiveSize) {
+    if(rebuild_internal_shouldBeCalledWithMutexLocked(header->capacity))
+      return;
+  }
+  if(fdatasync(pathsFd) != 0 || msync(header, mappedSize, MS_SYNC) != 0) {
+    logprintf(0, LOG_ERROR, "Could not flush the cache index '%s'. (errno=%d)\n", getTableFileName().c_str(), errno);
+    return;
+  }
+  if(ftruncate(logFd, 0) == 0)
+    logSize = 0;
+}
+
+bool CacheFileIndex::put(const std::string& cacheFileName, const std::string& originalFullPathName, const CacheFileMetadata& metadata)
+{
+  unsigned char name[NAME_LENGTH];
+  if(!decodeName(cacheFileName, name))
+    return false;
+  Mutex::scoped_lock lock(index_mutex);
+  if(header == NULL)
+    return false;
+  // a rebuild empties the log, so it is done before the operation is logged.
+  if(!reserve_internal_shouldBeCalledWithMutexLocked())
+    return false;
+  if(!appendLog_internal_shouldBeCalledWithMutexLocked(LOG_PUT, name, originalFullPathName, metadata))
+    return false;
+  if(!put_internal_shouldBeCalledWithMutexLocked(name, originalFullPathName, metadata))
+    return false;
+  if(CHECKPOINT_LOG_SIZE_IN_BYTES <= logSize)
+    checkpoint_internal_shouldBeCalledWithMutexLocked();
+  return true;
+}
+
+bool CacheFileIndex::remove(const std::string& cacheFileName)
+{
+  unsigned char name[NAME_LENGTH];
+  if(!decodeName(cacheFileName, name))
+    return false;
+  Mutex::scoped_lock lock(index_mutex);
+  if(header == NULL)
+    return false;
+  if(findRecord_internal_shouldBeCalledWithMutexLocked(name, records, header->capacity)->state != RECORD_USED)
+    return false;
+  appendLog_internal_shouldBeCalledWithMutexLocked(LOG_REMOVE, name, "", CacheFileMetadata());
+  return remove_internal_shouldBeCalledWithMutexLocked(name);
+}
+
+bool CacheFileIndex::find(const std::string& cacheFileName, std::string* originalFullPathName, CacheFileMetadata* metadata)
+{
+  unsigned char name[NAME_LENGTH];
+  if(!decodeName(cacheFileName, name))
+    return false;
+  Mutex::scoped_lock lock(index_mutex);
+  if(header == NULL)
+    return false;
+  const Record* record = findRecord_internal_shouldBeCalledWithMutexLocked(name, records, header->capacity);
+  if(record->state != RECORD_USED)
+    return false;
+  if(originalFullPathName != NULL && !readPath_internal_shouldBeCalledWithMutexLocked(*record, *originalFullPathName))
+    return false;
+  if(metadata != NULL)
+    loadMetadata(*record, *metadata);
+  return true;
+}
+
+bool CacheFileIndex::canUse(const std::string& cacheFileName, const std::string& originalFullPathName)
+{
+  unsigned char name[NAME_LENGTH];
+  if(!decodeName(cacheFileName, name))
+    return true;
+  Mutex::scoped_lock lock(index_mutex);
+  if(header == NULL)
+    return true;
+  const Record* record = findRecord_internal_shouldBeCalledWithMutexLocked(name, records, header->capacity);
+  if(record->state != RECORD_USED)
+    return true;
+  if(record->pathHash != hashPath(originalFullPathName) || record->pathLength != originalFullPathName.size())
+    return false;
+  // the hash of the path may collide, too.
+  string indexedPath;
+  return readPath_internal_shouldBeCalledWithMutexLocked(*record, indexedPath) && indexedPath == originalFullPathName;
+}
+
+void CacheFileIndex::visit(CacheFileIndex_Visitor& visitor)
+{
+  Mutex::scoped_lock lock(index_mutex);
+  if(header == NULL)
+    return;
+  for(unsigned long long i = 0; i < header->capacity; i++) {
+    const Record& record = records[i];
+    if(record.state != RECORD_USED)
+      continue;
+    string originalFullPathName;
+    if(!readPath_internal_shouldBeCalledWithMutexLocked(record, originalFullPathName))
+      continue;
+    CacheFileMetadata metadata;
+    loadMetadata(record, metadata);
+    visitor.visit(encodeName(record.name), originalFullPathName, metadata);
+  }
+}
+
+bool CacheFileIndex::visit(CacheFileIndex_Visitor& visitor, unsigned long long* position, const unsigned int maxRecords)
+{
+  Mutex::scoped_lock lock(index_mutex);
+  if(header == NULL)
+    return false;
+  unsigned int numberOfVisitedRecords = 0;
+  for(; *position < header->capacity && numberOfVisitedRecords < maxRecords; ++*position) {
+    const Record& record = records[*position];
+    if(record.state != RECORD_USED)
+      continue;
+    string originalFullPathName;
+    if(!readPath_internal_shouldBeCalledWithMutexLocked(record, originalFullPathName))
+      continue;
+    CacheFileMetadata metadata;
+    loadMetadata(record, metadata);
+    visitor.visit(encodeName(record.name), originalFullPathName, metadata);
+    numberOfVisitedRecords++;
+  }
+  return *position < header->capacity;
+}
+
+int CacheFileIndex::size()
+{
+  Mutex::scoped_lock lock(index_mutex);
+  return numberOfRecords;
+}
+
+void CacheFileIndex::checkpoint()
+{
+  Mutex::scoped_lock lock(index_mutex);
+  if(header == NULL)
+    return;
+  checkpoint_internal_shouldBeCalledWithMutexLocked();
+}
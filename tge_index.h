@@ -0,0 +1,132 @@
+#ifndef _HEADER_TGE_INDEX
+#define _HEADER_TGE_INDEX
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <string>
+#include "pmutex.h"
+
+// The attributes of an original file when its cache file was made or validated, which tell
+// whether the cache file is still fresh by one stat of the original file.
+struct SourceFileAttributes {
+  bool      isValid;      // false for the entries made by older versions
+  bool      isCompressed; // the original file is compressed
+  ino_t     inode;
+  long long size;
+  time_t    mtime;
+  long      mtimeNsec;
+  time_t    ctime;
+  long      ctimeNsec;
+
+  SourceFileAttributes() : isValid(false), isCompressed(false), inode(0), size(0ll), mtime(0), mtimeNsec(0), ctime(0), ctimeNsec(0) {}
+  SourceFileAttributes(const struct stat& st, const bool isCompressed);
+  bool matches(const struct stat& st) const;
+};
+
+// Metadata of a cache file kept in the index.
+struct CacheFileMetadata {
+  long long            size;
+  int                  accessCount;
+  bool                 hasOwner; // false for the entries made by older versions
+  uid_t                owner;    // the user who fetched the file, as the cache files are owned by root when tgefs runs as root
+  SourceFileAttributes source;
+
+  CacheFileMetadata() : size(0ll), accessCount(0), hasOwner(false), owner(0) {}
+};
+
+class CacheFileIndex_Visitor {
+ public:
+  CacheFileIndex_Visitor() {}
+  virtual void visit(const std::string& cacheFileName, const std::string& originalFullPathName, const CacheFileMetadata& metadata) = 0;
+  virtual ~CacheFileIndex_Visitor() {}
+};
+
+// A persistent map from the names of cache files (SHA-256 in hex) to their original paths
+// and metadata, which replaces localfiles.csv.
+//
+// <base>.idx is a memory-mapped hash table of fixed-size records with linear probing,
+// so that an update is done in place in O(1). The original paths are appended to
+// <base>.paths.<generation>, and a record points to its path there. Each update is also
+// appended to the write-ahead log <base>.wal, which is replayed when tgefs starts, since
+// the pages of the table may not have been written when tgefs crashed. Only the removals
+// are synced to the disk, so that a host crash does not bring back the entry of a deleted
+// file; a lost update leaves the older attributes of the original file, which just makes
+// the cache file be fetched again.
+// A checkpoint flushes the table and the paths, and empties the log. When the table gets
+// full or the paths file gets mostly garbage, both are rebuilt into new files, which
+// replace the old ones atomically by rename.
+class CacheFileIndex {
+  struct Header;
+  struct Record;
+  struct LogEntry;
+
+  static const unsigned int INITIAL_CAPACITY;
+  static const double       MAXIMUM_LOAD_FACTOR;
+  static const long long    CHECKPOINT_LOG_SIZE_IN_BYTES;
+  static const long long    MINIMUM_GARBAGE_TO_COMPACT_IN_BYTES;
+
+  Mutex         index_mutex;
+  std::string   baseName;
+  int           tableFd;
+  int           pathsFd;
+  int           logFd;
+  Header*       header;
+  Record*       records;
+  size_t        mappedSize;
+  long long     pathsSize;
+  long long     pathsLiveSize;
+  long long     logSize;
+  unsigned long long numberOfRecords;
+  unsigned long long numberOfTombstones;
+
+  std::string getTableFileName() const;
+  std::string getPathsFileName(const unsigned long long generation) const;
+  std::string getLogFileName() const;
+  static bool decodeName(const std::string& cacheFileName, unsigned char* name);
+  // in upper-case hexadecimal digits, as the cache files are named.
+  static std::string encodeName(const unsigned char* name);
+  static unsigned long long hashPath(const std::string& originalFullPathName);
+  static void storeMetadata(Record& record, const CacheFileMetadata& metadata);
+  static void loadMetadata(const Record& record, CacheFileMetadata& metadata);
+
+  bool createTable_internal(const std::string& fileName, const unsigned long long capacity, const unsigned long long generation,
+			    int* fd, Header** header, size_t* mappedSize);
+  bool openTable_internal_shouldBeCalledWithMutexLocked();
+  void closeTable_internal_shouldBeCalledWithMutexLocked();
+  // returns the record of the name, or the free record where it should be inserted.
+  Record* findRecord_internal_shouldBeCalledWithMutexLocked(const unsigned char* name, Record* table, const unsigned long long capacity) const;
+  bool readPath_internal_shouldBeCalledWithMutexLocked(const Record& record, std::string& originalFullPathName) const;
+  // rebuilds the table if it is too full to insert one more.
+  bool reserve_internal_shouldBeCalledWithMutexLocked();
+  bool put_internal_shouldBeCalledWithMutexLocked(const unsigned char* name, const std::string& originalFullPathName, const CacheFileMetadata& metadata);
+  bool remove_internal_shouldBeCalledWithMutexLocked(const unsigned char* name);
+  bool appendLog_internal_shouldBeCalledWithMutexLocked(const int operation, const unsigned char* name, const std::string& originalFullPathName, const CacheFileMetadata& metadata);
+  void replayLog_internal_shouldBeCalledWithMutexLocked();
+  bool rebuild_internal_shouldBeCalledWithMutexLocked(const unsigned long long newCapacity);
+  void checkpoint_internal_shouldBeCalledWithMutexLocked();
+
+ public:
+  CacheFileIndex();
+  ~CacheFileIndex();
+  // opens <baseName>.idx, or creates it if it does not exist. returns true if it is created.
+  bool open(const std::string& baseName, bool* isCreated);
+  void close();
+
+  // inserts or updates the entry. returns false if the name is not a cache file name.
+  bool put(const std::string& cacheFileName, const std::string& originalFullPathName, const CacheFileMetadata& metadata);
+  bool remove(const std::string& cacheFileName);
+  bool find(const std::string& cacheFileName, std::string* originalFullPathName, CacheFileMetadata* metadata);
+  // returns true if the name is not used, or used for the same original path.
+  bool canUse(const std::string& cacheFileName, const std::string& originalFullPathName);
+  // the visitor must not call the index.
+  void visit(CacheFileIndex_Visitor& visitor);
+  // visits at most maxRecords entries from *position, which is 0 at first, and advances it.
+  // returns false if there are no more entries. The entries may be visited twice or missed
+  // if the table is rebuilt between the calls, which is fine for listing them.
+  bool visit(CacheFileIndex_Visitor& visitor, unsigned long long* position, const unsigned int maxRecords);
+  int  size();
+  void checkpoint();
+};
+
+#endif // #ifndef _HEADER_TGE_INDEX
@@ -0,0 +1,184 @@
+#if HAVE_CONFIG
+ #include "config.h"
+#endif
+
+#include <string.h>
+#include <algorithm>
+#include "tge_keylock.h"
+
+using namespace std;
+
+unsigned int KeyLockTable::hashKey(const char* key, const size_t keyLength)
+{
+  // FNV-1a
+  unsigned int h = 2166136261u;
+  for(size_t i = 0; i < keyLength; i++) {
+    h ^= (unsigned char)key[i];
+    h *= 16777619u;
+  }
+  return h ^ (h >> 16);
+}
+
+bool KeyLockTable::hasSameKey(const Holder& holder1, const Holder& holder2)
+{
+  return holder1.hash == holder2.hash && holder1.keyLength == holder2.keyLength && memcmp(holder1.key, holder2.key, holder1.keyLength) == 0;
+}
+
+KeyLockTable::Holder* KeyLockTable::findCarrier_internal_shouldBeCalledWithMutexLocked(Stripe& stripe, const Holder& holder)
+{
+  for(Holder* h = stripe.firstHolder; h != NULL; h = h->nextHolder) {
+    if(hasSameKey(*h, holder))
+      return h;
+  }
+  return NULL;
+}
+
+void KeyLockTable::enqueue_internal_shouldBeCalledWithMutexLocked(Holder* carrier, Holder& holder)
+{
+  holder.nextWaiter = NULL;
+  if(carrier->lastWaiter == NULL)
+    carrier->firstWaiter = &holder;
+  else
+    carrier->lastWaiter->nextWaiter = &holder;
+  carrier->lastWaiter = &holder;
+}
+
+void KeyLockTable::requeue_internal_shouldBeCalledWithMutexLocked(Holder* carrier, Holder& holder)
+{
+  Holder* const rest     = carrier->firstWaiter;
+  Holder* const restLast = carrier->lastWaiter;
+  Holder* const tail     = holder.firstWaiter != NULL ? holder.lastWaiter : &holder;
+  holder.nextWaiter    = holder.firstWaiter != NULL ? holder.firstWaiter : rest;
+  tail->nextWaiter     = rest;
+  carrier->firstWaiter = &holder;
+  carrier->lastWaiter  = rest != NULL ? restLast : tail;
+  holder.firstWaiter   = NULL;
+  holder.lastWaiter    = NULL;
+}
+
+void KeyLockTable::grant_internal_shouldBeCalledWithMutexLocked(Stripe& stripe, Holder* carrier, Holder& holder)
+{
+  if(carrier == NULL) {
+    // the holder carries the queue it has taken over, if any.
+    holder.nextHolder  = stripe.firstHolder;
+    stripe.firstHolder = &holder;
+    carrier            = &holder;
+  } else {
+    // shares the key. The carrier stays the first holder of the key, and the waiters the holder
+    // has taken over go before those queued on the carrier since it was woken up.
+    holder.nextHolder   = carrier->nextHolder;
+    carrier->nextHolder = &holder;
+    if(holder.firstWaiter != NULL) {
+      holder.lastWaiter->nextWaiter = carrier->firstWaiter;
+      if(carrier->lastWaiter == NULL)
+	carrier->lastWaiter = holder.lastWaiter;
+      carrier->firstWaiter = holder.firstWaiter;
+      holder.firstWaiter   = NULL;
+      holder.lastWaiter    = NULL;
+    }
+  }
+  holder.isLocked = true;
+  Holder* const next = carrier->firstWaiter;
+  if(holder.isShared && next != NULL && next->isShared) {
+    carrier->firstWaiter = next->nextWaiter;
+    if(carrier->firstWaiter == NULL)
+      carrier->lastWaiter = NULL;
+    next->nextWaiter = NULL;
+    next->isWoken    = true;
+    next->woken_cond.signal();
+  }
+}
+
+void KeyLockTable::prepare(Holder& holder, const char* key, const size_t keyLength, const bool isShared)
+{
+  holder.keyLength   = min<size_t>(keyLength, MAXIMUM_KEY_LENGTH);
+  memcpy(holder.key, key, holder.keyLength);
+  holder.key[holder.keyLength] = '\0';
+  holder.hash        = hashKey(holder.key, holder.keyLength);
+  holder.isShared    = isShared;
+  holder.isWoken     = false;
+  holder.firstWaiter = NULL;
+  holder.lastWaiter  = NULL;
+  holder.nextWaiter  = NULL;
+}
+
+void KeyLockTable::lock(Holder& holder, const char* key, const size_t keyLength, const bool isShared)
+{
+  prepare(holder, key, keyLength, isShared);
+  Stripe& stripe = stripes[holder.hash & (NUMBER_OF_STRIPES - 1)];
+  Mutex::scoped_lock lock(stripe.stripe_mutex);
+  stripe.numberOfLocks++;
+  Holder* carrier = findCarrier_internal_shouldBeCalledWithMutexLocked(stripe, holder);
+  if(carrier != NULL && !(isShared && carrier->isShared && carrier->firstWaiter == NULL)) {
+    stripe.numberOfWaits++;
+    enqueue_internal_shouldBeCalledWithMutexLocked(carrier, holder);
+    while(true) {
+      while(!holder.isWoken)
+	holder.woken_cond.wait(stripe.stripe_mutex);
+      holder.isWoken = false;
+      carrier = findCarrier_internal_shouldBeCalledWithMutexLocked(stripe, holder);
+      if(carrier == NULL || (isShared && carrier->isShared))
+	break;
+      // a running thread has taken the key since it was released.
+      requeue_internal_shouldBeCalledWithMutexLocked(carrier, holder);
+    }
+  }
+  grant_internal_shouldBeCalledWithMutexLocked(stripe, carrier, holder);
+}
+
+bool KeyLockTable::tryLock(Holder& holder, const char* key, const size_t keyLength, const bool isShared)
+{
+  prepare(holder, key, keyLength, isShared);
+  Stripe& stripe = stripes[holder.hash & (NUMBER_OF_STRIPES - 1)];
+  Mutex::scoped_lock lock(stripe.stripe_mutex);
+  Holder* const carrier = findCarrier_internal_shouldBeCalledWithMutexLocked(stripe, holder);
+  if(carrier != NULL && !(isShared && carrier->isShared && carrier->firstWaiter == NULL))
+    return false;
+  stripe.numberOfLocks++;
+  grant_internal_shouldBeCalledWithMutexLocked(stripe, carrier, holder);
+  return true;
+}
+
+void KeyLockTable::unlock(Holder& holder)
+{
+  if(!holder.isLocked)
+    return;
+  Stripe& stripe = stripes[holder.hash & (NUMBER_OF_STRIPES - 1)];
+  Mutex::scoped_lock lock(stripe.stripe_mutex);
+  Holder** link = &stripe.firstHolder;
+  while(*link != &holder)
+    link = &(*link)->nextHolder;
+  *link = holder.nextHolder;
+  holder.isLocked = false;
+  if(holder.firstWaiter == NULL)
+    return;
+  Holder* const carrier = findCarrier_internal_shouldBeCalledWithMutexLocked(stripe, holder);
+  if(carrier != NULL) {
+    // the other shared holders keep the key, and the next of them carries the queue.
+    carrier->firstWaiter = holder.firstWaiter;
+    carrier->lastWaiter  = holder.lastWaiter;
+  } else {
+    // only the first waiter is woken up, and it takes over the rest of the queue. The key is
+    // not handed over directly, since a thread which is running can take it much sooner than
+    // the waiter is scheduled, and the short locks would otherwise run one context switch apart.
+    Holder* const successor = holder.firstWaiter;
+    successor->firstWaiter = successor->nextWaiter;
+    successor->lastWaiter  = successor->nextWaiter != NULL ? holder.lastWaiter : NULL;
+    successor->nextWaiter  = NULL;
+    successor->isWoken     = true;
+    successor->woken_cond.signal();
+  }
+  holder.firstWaiter = NULL;
+  holder.lastWaiter  = NULL;
+}
+
+void KeyLockTable::getStatistics(long long* numberOfLocks, long long* numberOfWaits)
+{
+  *numberOfLocks = 0;
+  *numberOfWaits = 0;
+  for(int i = 0; i < NUMBER_OF_STRIPES; i++) {
+    Mutex::scoped_lock lock(stripes[i].stripe_mutex);
+    *numberOfLocks += stripes[i].numberOfLocks;
+    *numberOfWaits += stripes[i].numberOfWaits;
+  }
+}
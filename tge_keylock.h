@@ -0,0 +1,79 @@
+#ifndef _HEADER_TGE_KEYLOCK
+#define _HEADER_TGE_KEYLOCK
+
+#include <stddef.h>
+#include "pmutex.h"
+
+// Shared/exclusive locks on string keys, such as the names of cache files.
+//
+// The keys are hashed into stripes, each of which has its own mutex and the list of the keys
+// locked now, so that locking different keys rarely contends. A lock is held by a Holder,
+// which the caller places on its stack, so no memory is allocated to lock or unlock.
+// A key may have several shared holders, the first of which in the stripe carries the queue
+// of the threads waiting for the key. A shared lock waits if any thread is queued, so that
+// exclusive locks are not starved by a stream of shared ones. When the key is released,
+// only the first waiter is woken up and takes over the rest of the queue, and a shared
+// waiter which gets the key wakes up the shared waiter behind it in turn.
+class KeyLockTable {
+ public:
+  enum {
+    MAXIMUM_KEY_LENGTH = 255 // longer keys are truncated, which may make two keys share a lock
+  };
+
+  class Holder {
+    friend class KeyLockTable;
+    char              key[MAXIMUM_KEY_LENGTH + 1];
+    size_t            keyLength;
+    unsigned int      hash;
+    bool              isShared;
+    bool              isLocked;
+    bool              isWoken;
+    Holder*           nextHolder;  // in the same stripe
+    Holder*           firstWaiter; // waiting for this key, while this carries the queue
+    Holder*           lastWaiter;
+    Holder*           nextWaiter;
+    ConditionVariable woken_cond;
+    Holder(const Holder&);
+    Holder& operator=(const Holder&);
+   public:
+    Holder() : keyLength(0), hash(0), isShared(false), isLocked(false), isWoken(false), nextHolder(NULL), firstWaiter(NULL), lastWaiter(NULL), nextWaiter(NULL) {}
+    bool isHeld() const { return isLocked; }
+  };
+
+ private:
+  enum {
+    NUMBER_OF_STRIPES = 64, // a power of 2
+    CACHE_LINE_SIZE   = 64
+  };
+  struct Stripe {
+    Mutex   stripe_mutex;
+    Holder* firstHolder;
+    long long numberOfLocks;
+    long long numberOfWaits;
+    char    padding[CACHE_LINE_SIZE - (sizeof(Mutex) + sizeof(Holder*) + 2 * sizeof(long long)) % CACHE_LINE_SIZE];
+    Stripe() : firstHolder(NULL), numberOfLocks(0ll), numberOfWaits(0ll) {}
+  };
+  Stripe stripes[NUMBER_OF_STRIPES];
+
+  static unsigned int hashKey(const char* key, const size_t keyLength);
+  static bool hasSameKey(const Holder& holder1, const Holder& holder2);
+  static void prepare(Holder& holder, const char* key, const size_t keyLength, const bool isShared);
+  // returns the first holder of the key, which carries the queue.
+  static Holder* findCarrier_internal_shouldBeCalledWithMutexLocked(Stripe& stripe, const Holder& holder);
+  static void enqueue_internal_shouldBeCalledWithMutexLocked(Holder* carrier, Holder& holder);
+  // puts the holder back to the head of the queue, followed by the waiters it has taken over.
+  static void requeue_internal_shouldBeCalledWithMutexLocked(Holder* carrier, Holder& holder);
+  static void grant_internal_shouldBeCalledWithMutexLocked(Stripe& stripe, Holder* carrier, Holder& holder);
+
+ public:
+  KeyLockTable() {}
+  // blocks until the key can be held. A holder can hold only one key at a time.
+  void lock(Holder& holder, const char* key, const size_t keyLength, const bool isShared = false);
+  // holds the key only if it can be held without waiting, and returns whether it is held.
+  bool tryLock(Holder& holder, const char* key, const size_t keyLength, const bool isShared = false);
+  void unlock(Holder& holder);
+  // the number of locks, and of those which had to wait.
+  void getStatistics(long long* numberOfLocks, long long* numberOfWaits);
+};
+
+#endif // #ifndef _HEADER_TGE_KEYLOCK
@@ -0,0 +1,148 @@
+#if HAVE_CONFIG
+ #include "config.h"
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <fstream>
+#include <sstream>
+#include "tge_log.h"
+#include "tge_priority.h"
+
+using namespace std;
+
+CachePriorityRules::CachePriorityRules()
+  : version(0)
+{
+}
+
+std::string CachePriorityRules::normalizePrefix(const std::string& prefix)
+{
+  string retval = prefix;
+  while(1 < retval.size() && retval[retval.size() - 1] == '/')
+    retval.erase(retval.size() - 1);
+  return retval;
+}
+
+const char* CachePriorityRules::getClassName(const int priorityClass)
+{
+  switch(priorityClass) {
+  case PRIORITY_SCRATCH:   return "scratch";
+  case PRIORITY_NORMAL:    return "normal";
+  case PRIORITY_REFERENCE: return "reference";
+  case PRIORITY_PINNED:    return "pin";
+  }
+  return "unknown";
+}
+
+int CachePriorityRules::getClassByName(const std::string& className)
+{
+  for(int priorityClass = PRIORITY_SCRATCH; priorityClass <= PRIORITY_PINNED; priorityClass++) {
+    if(className == getClassName(priorityClass))
+      return priorityClass;
+  }
+  return -1;
+}
+
+void CachePriorityRules::init(const char* cacheRootDirectory)
+{
+  rulesFileName = string(cacheRootDirectory) + "/priority.conf";
+  ifstream ist(rulesFileName.c_str());
+  if(!ist)
+    return;
+  string line;
+  int lineCount = 0;
+  while(getline(ist, line)) {
+    ++lineCount;
+    if(line.empty() || line[0] == '#')
+      continue;
+    if(!execute(line))
+      logprintf(0, LOG_WARNING, "Syntax error at line %d in '%s'.\n", lineCount, rulesFileName.c_str());
+  }
+  logprintf(0, LOG_INFO, "%d priority rules are loaded.\n", (int)rules.size());
+}
+
+bool CachePriorityRules::execute(const std::string& commandLine)
+{
+  istringstream ist(commandLine);
+  string command, prefix;
+  if(!(ist >> command >> prefix) || prefix[0] != '/')
+    return false;
+  prefix = normalizePrefix(prefix);
+  Mutex::scoped_lock lock(rules_mutex);
+  if(command == "clear") {
+    if(rules.erase(prefix) == 0)
+      return true;
+  } else {
+    const int priorityClass = getClassByName(command);
+    if(priorityClass < 0)
+      return false;
+    map<string, int>::iterator it = rules.find(prefix);
+    if(it != rules.end() && it->second == priorityClass)
+      return true;
+    rules[prefix] = priorityClass;
+  }
+  version++;
+  logprintf(1, LOG_INFO, "Priority rule '%s %s' is applied.\n", command.c_str(), prefix.c_str());
+  save_internal_shouldBeCalledWithMutexLocked();
+  return true;
+}
+
+bool CachePriorityRules::save_internal_shouldBeCalledWithMutexLocked()
+{
+  if(rulesFileName.empty())
+    return false;
+  const string temporaryFileName = rulesFileName + ".tmp";
+  {
+    ofstream ost(temporaryFileName.c_str());
+    if(!ost) {
+      logprintf(0, LOG_ERROR, "Could not save the priority rules to '%s'.\n", temporaryFileName.c_str());
+      return false;
+    }
+    for(map<string, int>::const_iterator cit = rules.begin(); cit != rules.end(); ++cit)
+      ost << getClassName(cit->second) << " " << cit->first << "\n";
+  }
+  if(rename(temporaryFileName.c_str(), rulesFileName.c_str()) == -1) {
+    logprintf(0, LOG_ERROR, "Could not rename '%s' to '%s'. (errno=%d)\n", temporaryFileName.c_str(), rulesFileName.c_str(), errno);
+    return false;
+  }
+  return true;
+}
+
+std::string CachePriorityRules::getText() const
+{
+  Mutex::scoped_lock lock(rules_mutex);
+  string retval;
+  for(map<string, int>::const_iterator cit = rules.begin(); cit != rules.end(); ++cit) {
+    retval += getClassName(cit->second);
+    retval += ' ';
+    retval += cit->first;
+    retval += '\n';
+  }
+  return retval;
+}
+
+int CachePriorityRules::classify(const std::string& originalFullPathName) const
+{
+  Mutex::scoped_lock lock(rules_mutex);
+  if(rules.empty())
+    return PRIORITY_NORMAL;
+  // try the path itself, and then its parent directories.
+  string prefix = normalizePrefix(originalFullPathName);
+  while(true) {
+    map<string, int>::const_iterator cit = rules.find(prefix);
+    if(cit != rules.end())
+      return cit->second;
+    const string::size_type p = prefix.rfind('/');
+    if(p == string::npos || prefix == "/")
+      break;
+    prefix.erase(p == 0 ? 1 : p);
+  }
+  return PRIORITY_NORMAL;
+}
+
+int CachePriorityRules::getVersion() const
+{
+  Mutex::scoped_lock lock(rules_mutex);
+  return version;
+}
@@ -0,0 +1,38 @@
+#ifndef _HEADER_TGE_PRIORITY
+#define _HEADER_TGE_PRIORITY
+
+#include <string>
+#include <map>
+#include "pmutex.h"
+#include "tge_cache.h"
+
+// Rules which give the priority class of cache files by the prefixes of their original paths,
+// such as 'pin /data/reference' or 'scratch /data/tmp'. The longest matching prefix wins.
+// The rules are changed through /proc/tgefspriority, and saved in the first cache directory
+// so that they survive restarts.
+class CachePriorityRules : public Cache_PriorityClassifier {
+  mutable Mutex              rules_mutex;
+  std::map<std::string, int> rules;
+  int                        version;
+  std::string                rulesFileName;
+
+  static std::string normalizePrefix(const std::string& prefix);
+  bool save_internal_shouldBeCalledWithMutexLocked();
+
+ public:
+  CachePriorityRules();
+  // loads the rules saved in the cache directory if any.
+  void init(const char* cacheRootDirectory);
+  // executes a command line, '<class> <prefix>' or 'clear <prefix>'. returns false if it is malformed.
+  bool execute(const std::string& commandLine);
+  std::string getText() const;
+
+  virtual int classify(const std::string& originalFullPathName) const;
+  virtual int getVersion() const;
+
+  static const char* getClassName(const int priorityClass);
+  // returns -1 if the name is unknown.
+  static int getClassByName(const std::string& className);
+};
+
+#endif // #ifndef _HEADER_TGE_PRIORITY
@@ -0,0 +1,237 @@
+#if HAVE_CONFIG
+ #include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "tge_log.h"
+#include "tge_fcopy.h"
+#include "tge_recompress.h"
+
+using namespace std;
+
+int DeferredCompression::idleSecondsBeforeRecompression = 60;
+
+DeferredCompression::DeferredCompression()
+{
+  lastActivityTime          = time(NULL);
+  isStopping                = false;
+  locker                    = NULL;
+  numberOfRecompressedFiles = 0;
+  numberOfDiscardedRequests = 0;
+}
+
+bool DeferredCompression::start(Recompression_FileLocker* locker)
+{
+  this->locker = locker;
+  return PThread::start();
+}
+
+void DeferredCompression::stop()
+{
+  {
+    Mutex::scoped_lock lock(queue_mutex);
+    isStopping = true;
+    if(!queuedPaths.empty()) {
+      logprintf(0, LOG_INFO, "%d files are left uncompressed.\n", (int)queuedPaths.size());
+    }
+    queue_cond.signalAll();
+  }
+  join();
+}
+
+bool DeferredCompression::enqueue(const char* path, const CompressionControl::CompressionType ctype)
+{
+  struct stat st;
+  if(lstat(path, &st) == -1) {
+    logprintf(0, LOG_ERROR, "Could not stat '%s' to queue it for deferred compression. (errno=%d)\n", path, errno);
+    return false;
+  }
+  Request request;
+  request.path  = path;
+  request.ctype = ctype;
+  request.st    = st;
+  {
+    Mutex::scoped_lock lock(queue_mutex);
+    if(path2Request.count(request.path) == 0)
+      queuedPaths.push_back(request.path);
+    path2Request[request.path] = request; // a newer write back supersedes the old request
+    queue_cond.signal();
+  }
+  logprintf(2, LOG_DEBUG, "'%s' is queued for deferred compression.\n", path);
+  return true;
+}
+
+void DeferredCompression::notifyActivity()
+{
+  Mutex::scoped_lock lock(queue_mutex);
+  lastActivityTime = time(NULL);
+}
+
+int DeferredCompression::getQueueLength()
+{
+  Mutex::scoped_lock lock(queue_mutex);
+  return queuedPaths.size();
+}
+
+int DeferredCompression::getNumberOfRecompressedFiles()
+{
+  Mutex::scoped_lock lock(queue_mutex);
+  return numberOfRecompressedFiles;
+}
+
+int DeferredCompression::getNumberOfDiscardedRequests()
+{
+  Mutex::scoped_lock lock(queue_mutex);
+  return numberOfDiscardedRequests;
+}
+
+void DeferredCompression::run()
+{
+  // this thread should not steal CPU from user programs.
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+  while(true) {
+    Request request;
+    {
+      Mutex::scoped_lock lock(queue_mutex);
+      while(queuedPaths.empty() && !isStopping)
+	queue_cond.wait(queue_mutex);
+      if(isStopping)
+	return;
+      const time_t idleSeconds = time(NULL) - lastActivityTime;
+      if(idleSeconds < idleSecondsBeforeRecompression) {
+	queue_cond.timedWait(queue_mutex, idleSecondsBeforeRecompression - idleSeconds);
+	continue;
+      }
+      request = path2Request[queuedPaths.front()];
+      path2Request.erase(queuedPaths.front());
+      queuedPaths.pop_front();
+    }
+    if(locker != NULL)
+      locker->lockFile(request.path);
+    const bool succeeded = recompress(request);
+    if(locker != NULL)
+      locker->unlockFile(request.path);
+    {
+      Mutex::scoped_lock lock(queue_mutex);
+      if(succeeded)
+	numberOfRecompressedFiles++;
+      else
+	numberOfDiscardedRequests++;
+    }
+  }
+}
+
+static bool isSameFileVersion(const struct stat& st, const struct stat& queuedSt)
+{
+  // a file rewritten within a second changes the nanoseconds, and a chmod or a chown changes ctime.
+  return S_ISREG(st.st_mode) && st.st_ino == queuedSt.st_ino && st.st_size == queuedSt.st_size
+    && st.st_mtim.tv_sec == queuedSt.st_mtim.tv_sec && st.st_mtim.tv_nsec == queuedSt.st_mtim.tv_nsec
+    && st.st_ctim.tv_sec == queuedSt.st_ctim.tv_sec && st.st_ctim.tv_nsec == queuedSt.st_ctim.tv_nsec;
+}
+
+bool DeferredCompression::recompress(const Request& request)
+{
+  const char* path = request.path.c_str();
+  struct stat st;
+  if(lstat(path, &st) == -1) {
+    logprintf(1, LOG_WARNING, "'%s' has gone before deferred compression.\n", path);
+    return false;
+  }
+  if(!isSameFileVersion(st, request.st)) {
+    logprintf(2, LOG_DEBUG, "'%s' was modified after write back. Deferred compression is cancelled.\n", path);
+    return false;
+  }
+  if(is_lzo_compressed_file(path)) {
+    logprintf(2, LOG_DEBUG, "'%s' is already compressed.\n", path);
+    return false;
+  }
+  const char algorithm = request.ctype == CompressionControl::LZ4 ? COMPRESSION_TYPE_LZ4 : COMPRESSION_TYPE_LZO;
+  if(request.ctype != CompressionControl::LZOx1 && request.ctype != CompressionControl::LZ4) {
+    logprintf(0, LOG_ERROR, "Deferred compression of '%s' failed. (ctype=%d)\n", path, request.ctype);
+    return false;
+  }
+  if(!is_worth_compressing(path, algorithm)) {
+    logprintf(2, LOG_DEBUG, "'%s' would not shrink. Deferred compression is cancelled.\n", path);
+    return false;
+  }
+  logprintf(2, LOG_DEBUG, "Deferred compression of '%s' started.\n", path);
+  const int srcfd = open(path, O_RDONLY | O_NOFOLLOW | O_LARGEFILE);
+  if(srcfd == -1) {
+    logprintf(1, LOG_WARNING, "Could not open '%s' for deferred compression. (errno=%d)\n", path, errno);
+    return false;
+  }
+  {
+    struct stat srcSt;
+    if(fstat(srcfd, &srcSt) == -1 || !isSameFileVersion(srcSt, request.st)) {
+      logprintf(2, LOG_DEBUG, "'%s' was replaced before deferred compression. Discarded.\n", path);
+      close(srcfd);
+      return false;
+    }
+  }
+  // the temporary file is created exclusively under a unique name, and is handled only through
+  // its descriptor, so that a symbolic link or a hard link planted there cannot redirect the chown.
+  string tmpPath = request.path + ".tgefs-recompress.XXXXXX";
+  const int tmpfd = mkstemp(&tmpPath[0]);
+  if(tmpfd == -1) {
+    logprintf(0, LOG_ERROR, "Could not create a temporary file for '%s'. (errno=%d)\n", path, errno);
+    close(srcfd);
+    return false;
+  }
+  const bool compressionSucceeded = compressFile(srcfd, tmpfd, st.st_size, algorithm);
+  close(srcfd);
+  if(!compressionSucceeded) {
+    logprintf(0, LOG_ERROR, "Deferred compression of '%s' failed. (ctype=%d)\n", path, request.ctype);
+    close(tmpfd);
+    unlink(tmpPath.c_str());
+    return false;
+  }
+  static const uid_t ROOT_USER = 0;
+  if((getuid() == ROOT_USER && fchown(tmpfd, st.st_uid, st.st_gid) == -1) || fchmod(tmpfd, st.st_mode & 0777) == -1) {
+    logprintf(0, LOG_ERROR, "Could not chown '%s' to %d:%d and chmod it to %o.\n", tmpPath.c_str(), st.st_uid, st.st_gid, st.st_mode & 0777);
+    close(tmpfd);
+    unlink(tmpPath.c_str());
+    return false;
+  }
+  {
+    // keep the original date, which the cache entries without the source attributes are compared with.
+    const struct timespec times[2] = { st.st_atim, st.st_mtim };
+    if(futimens(tmpfd, times) == -1) {
+      logprintf(1, LOG_WARNING, "Could not touch '%s'. The local cache will be fetched again.\n", tmpPath.c_str());
+    }
+  }
+  if(close(tmpfd) == -1) {
+    logprintf(0, LOG_ERROR, "Could not write '%s'. (errno=%d)\n", tmpPath.c_str(), errno);
+    unlink(tmpPath.c_str());
+    return false;
+  }
+  {
+    struct stat stAfterCompression;
+    if(lstat(path, &stAfterCompression) == -1 || !isSameFileVersion(stAfterCompression, request.st)) {
+      logprintf(2, LOG_DEBUG, "'%s' was modified during deferred compression. Discarded.\n", path);
+      unlink(tmpPath.c_str());
+      return false;
+    }
+  }
+  if(rename(tmpPath.c_str(), path) == -1) {
+    logprintf(0, LOG_ERROR, "Could not rename '%s' to '%s'. (errno=%d)\n", tmpPath.c_str(), path, errno);
+    unlink(tmpPath.c_str());
+    return false;
+  }
+  {
+    // the rename changes the inode and ctime, so the cache entry is told the new attributes.
+    struct stat stAfterRename;
+    if(locker != NULL && lstat(path, &stAfterRename) == 0)
+      locker->recompressedFile(request.path, st, stAfterRename);
+  }
+  logprintf(2, LOG_DEBUG, "Deferred compression of '%s' finished.\n", path);
+  return true;
+}
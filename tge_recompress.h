@@ -0,0 +1,63 @@
+#ifndef _HEADER_TGE_RECOMPRESS
+#define _HEADER_TGE_RECOMPRESS
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <string>
+#include <deque>
+#include <map>
+#include "pmutex.h"
+#include "ppthread.h"
+#include "tge_compctl.h"
+
+// Serializes the recompression of a remote file against tgefs callbacks
+// which may write back the same file.
+class Recompression_FileLocker {
+ public:
+  Recompression_FileLocker() {}
+  virtual void lockFile(const std::string& path) = 0;
+  // called with the file locked, after the file has been replaced by its compressed version.
+  virtual void recompressedFile(const std::string& path, const struct stat& stBefore, const struct stat& stAfter) = 0;
+  virtual void unlockFile(const std::string& path) = 0;
+  virtual ~Recompression_FileLocker() {}
+};
+
+// Files written back uncompressed by a deferred compression rule ('-DL')
+// are queued here, and a low-priority thread compresses them in place
+// when no open/release has been observed for a while.
+class DeferredCompression : PThread {
+  struct Request {
+    std::string path;
+    CompressionControl::CompressionType ctype;
+    struct stat st; // of the file written back, which must not change until it is replaced
+  };
+
+  Mutex                          queue_mutex;
+  ConditionVariable              queue_cond;
+  std::deque<std::string>        queuedPaths;
+  std::map<std::string, Request> path2Request;
+  time_t                         lastActivityTime;
+  bool                           isStopping;
+  Recompression_FileLocker*      locker;
+
+  int numberOfRecompressedFiles;
+  int numberOfDiscardedRequests;
+
+  void run();
+  bool recompress(const Request& request);
+
+ public:
+  static int idleSecondsBeforeRecompression;
+
+  DeferredCompression();
+  bool start(Recompression_FileLocker* locker);
+  void stop();
+  bool enqueue(const char* path, const CompressionControl::CompressionType ctype);
+  void notifyActivity();
+  int  getQueueLength();
+  int  getNumberOfRecompressedFiles();
+  int  getNumberOfDiscardedRequests();
+};
+
+#endif // #ifndef _HEADER_TGE_RECOMPRESS
@@ -22,17 +22,20 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <pwd.h>
 #include <string.h>
 #include <utime.h>
 #include <sys/time.h>
 #include <sys/xattr.h>
 #include <sys/fsuid.h>
+#include <sys/syscall.h>
 #include <limits.h>
 #include <vector>
 #include <string>
 #include <map>
 #include <set>
+#include <sstream>
 #include "sha2.h"
 #include "pmutex.h"
 #include <iostream>
@@ -41,7 +44,14 @@
 #include "tge_log.h"
 #include "tge_compctl.h"
 #include "tge_cache.h"
+#include "tge_cachedirs.h"
 #include "tge_appconfig.h"
+#include "tge_recompress.h"
+#include "tge_admit.h"
+#include "tge_priority.h"
+#include "tge_cachequery.h"
+#include "tge_keylock.h"
+#include "lzoparallel.h"
 
 using namespace std;
 
@@ -53,189 +63,291 @@ static int  canonicalMountPoint_length = 0;
 static CompressionControl compressionControl;
 
 #define FH_SPECIAL_FILE ((uint64_t)-1)
+#define FH_CACHE_QUERY_FIRST ((uint64_t)1 << 62) // an open of /proc/tgefscache has its own handle
 
+static inline bool isSpecialFileHandle(const uint64_t fh)
+{
+  return FH_CACHE_QUERY_FIRST <= fh; // including FH_SPECIAL_FILE
+}
+
+// Switches the file system uid and gid to those of the caller while tgefs runs as root.
+// On Linux they are attributes of each thread, and the raw system calls change only the
+// calling thread, so the FUSE threads switch them without waiting for each other.
+// If isSerialized is set, the switches are serialized by a global lock as older versions did,
+// for the systems where they are shared by the process.
 class SETFSID {
   static Mutex setFSID_mutex;
-  bool locked;
-  bool uid_save;
-  bool gid_save;
+  bool  locked;
+  uid_t uid_save;
+  gid_t gid_save;
   enum {
     ROOT_USER = 0
   };
+  static inline uid_t setThreadFSUID(const uid_t uid) {
+#if defined(SYS_setfsuid32)
+    return syscall(SYS_setfsuid32, uid);
+#elif defined(SYS_setfsuid)
+    return syscall(SYS_setfsuid, uid);
+#else
+    return setfsuid(uid);
+#endif
+  }
+  static inline gid_t setThreadFSGID(const gid_t gid) {
+#if defined(SYS_setfsgid32)
+    return syscall(SYS_setfsgid32, gid);
+#elif defined(SYS_setfsgid)
+    return syscall(SYS_setfsgid, gid);
+#else
+    return setfsgid(gid);
+#endif
+  }
 public:
+  static bool isSerialized;
   SETFSID() {
+    locked = false;
     if(getuid() == ROOT_USER) {
       struct fuse_context *fc = fuse_get_context();
-      setFSID_mutex.lock();
-      locked = setFSID_mutex.islocked();
-      if(locked) {
-	uid_save = setfsuid(fc->uid);
-	gid_save = setfsgid(fc->gid);
-      } else {
-        uid_save = getuid();
-        gid_save = getgid();
+      if(isSerialized) {
+	setFSID_mutex.lock();
+	locked = true;
       }
+      uid_save = setThreadFSUID(fc->uid);
+      gid_save = setThreadFSGID(fc->gid);
     } else {
-      locked = false;
       uid_save = getuid();
       gid_save = getgid();
     }
   }
   ~SETFSID() {
     if(getuid() == ROOT_USER) {
-      if(locked) {
-	setfsuid(uid_save);
-	setfsgid(gid_save);
+      setThreadFSUID(uid_save);
+      setThreadFSGID(gid_save);
+      if(locked)
 	setFSID_mutex.unlock();
-      }
     }
   }
 };
 
 Mutex SETFSID::setFSID_mutex;
+bool  SETFSID::isSerialized = false;
 
+// The state shared by the opens of a cache file, which is written back once on the last release.
+// The dirty flag and the dirty extent are updated by atomic operations, since writes through
+// the handles may run in parallel.
+class OpenedFile {
+public:
+  const string cachedFileName;
+  int          referenceCount; // guarded by the mutex of the shard of CachedLocalFiles
+private:
+  volatile int       dirtyFlag;
+  volatile long long dirtyBegin; // the extent written through the handles
+  volatile long long dirtyEnd;
+public:
+  OpenedFile(const string& cachedFileName)
+    : cachedFileName(cachedFileName), referenceCount(0), dirtyFlag(0), dirtyBegin(LLONG_MAX), dirtyEnd(0ll) {}
+  bool isDirty() const { return dirtyFlag != 0; }
+  // returns true if the file becomes dirty now.
+  bool setDirty() {
+    return dirtyFlag == 0 && __sync_bool_compare_and_swap(&dirtyFlag, 0, 1);
+  }
+  void addDirtyRange(const long long offset, const long long size) {
+    long long current;
+    while(offset < (current = dirtyBegin) && !__sync_bool_compare_and_swap(&dirtyBegin, current, offset)) {}
+    while((current = dirtyEnd) < offset + size && !__sync_bool_compare_and_swap(&dirtyEnd, current, offset + size)) {}
+  }
+  long long getDirtyBegin() const { return dirtyBegin; }
+  long long getDirtyEnd() const   { return dirtyEnd; }
+};
+
+// The state of an open of a regular file, whose pointer is kept in fi->fh so that the calls
+// on the handle reach it without any lookup or lock.
 class LocalFile {
 public:
-  string realFileName;
-  string cachedFileName;
-  bool   isDirty;
-  bool   isCached;
-  bool   isOriginalFileCompressed;
-  LocalFile() {
-    isDirty  = false;
-    isCached = false;
-    isOriginalFileCompressed = false;
-  }
-  LocalFile(const string& realFileName, const string& cachedFileName, const bool isCached)
-    : realFileName(realFileName), isCached(isCached), isOriginalFileCompressed(false) {
-    isDirty  = false;
-  }
-  LocalFile(const string& realFileName, const string& cachedFileName, const bool isCached, const bool isOriginalFileCompressed)
-    : realFileName(realFileName), isCached(isCached), isOriginalFileCompressed(isOriginalFileCompressed) {
-    isDirty  = false;
-  }
+  int         fd;
+  string      realFileName;
+  bool        isCached;
+  bool        isOriginalFileCompressed;
+  OpenedFile* openedFile; // shared with the other opens of the same cache file
+  LocalFile(const int fd, const string& realFileName, const bool isCached, const bool isOriginalFileCompressed = false)
+    : fd(fd), realFileName(realFileName), isCached(isCached), isOriginalFileCompressed(isOriginalFileCompressed), openedFile(NULL) {}
 };
 
-class CachedLocalFiles {
-  void createCacheDir();
+static inline LocalFile* getLocalFile(const struct fuse_file_info *fi)
+{
+  // user-space pointers are far below FH_CACHE_QUERY_FIRST, so they are not taken for special files.
+  return reinterpret_cast<LocalFile*>((uintptr_t)fi->fh);
+}
 
-  set<string>              lockedLocalFiles;
-  Mutex                    lockedLocalFiles_mutex;
-  ConditionVariable        lockedLocalFiles_cond;
-public:
-  class LocalCacheFileLock;
-private:
-  friend class LocalCacheFileLock;
-  inline void lockLCF()             { lockedLocalFiles_mutex.lock();                      }
-  inline void unlockLCF()           { lockedLocalFiles_mutex.unlock();                    }
-  inline void waitLCFStatChange()   { lockedLocalFiles_cond.wait(lockedLocalFiles_mutex); }
-  inline void notifyLCFStatChange() { lockedLocalFiles_cond.signalAll();                  }
-  inline bool alreadyExistLCFLock(const string& filename) {
-    return 0 < lockedLocalFiles.count(filename);
-  }
-  inline void insertLCFLock(const string& filename) {
-    lockedLocalFiles.insert(filename);
-  }
-  inline void removeLCFLock(const string& filename) {
-    lockedLocalFiles.erase(filename);
-    lockedLocalFiles_cond.signalAll();
+class CachedLocalFiles {
+  KeyLockTable             lockedLocalFiles;
+  // locked by the hash name, so that the lock holds while the file moves between tiers.
+  static const char* getLockName(const char *filename) {
+    const char* name = strrchr(filename, '/');
+    return name != NULL ? name + 1 : filename;
   }
 public:
+  enum LockMode {
+    LOCK_LOOKUP, // looks up the original file, such as stat
+    LOCK_FETCH,  // copies the original file into the cache
+    LOCK_MODIFY  // changes the original file, such as write-back
+  };
+  // a fetch does not change the original file, so it excludes only the other fetches of the
+  // file and the modifications of it, and the lookups need not wait for a long copy.
   class LocalCacheFileLock {
-    CachedLocalFiles& clf;
-    string localCacheFileName;
-    bool   isLocked;
+    CachedLocalFiles&    clf;
+    KeyLockTable::Holder holder;
+    KeyLockTable::Holder fetchHolder;
   public:
-    LocalCacheFileLock(CachedLocalFiles& clf, const char *filename) : clf(clf) {
-      localCacheFileName = filename;
-      clf.lockLCF();
-      while(clf.alreadyExistLCFLock(localCacheFileName)) clf.waitLCFStatChange();
-      clf.insertLCFLock(localCacheFileName);
-      isLocked = true;
-      clf.unlockLCF();
+    LocalCacheFileLock(CachedLocalFiles& clf, const char *filename, const LockMode mode = LOCK_MODIFY) : clf(clf) {
+      const char* name = getLockName(filename);
+      const size_t nameLength = strlen(name);
+      if(mode == LOCK_FETCH) {
+	char fetchKey[KeyLockTable::MAXIMUM_KEY_LENGTH + 1];
+	const size_t fetchKeyLength = snprintf(fetchKey, sizeof(fetchKey), "%s.fetch", name);
+	clf.lockedLocalFiles.lock(fetchHolder, fetchKey, min(fetchKeyLength, sizeof(fetchKey) - 1));
+      }
+      clf.lockedLocalFiles.lock(holder, name, nameLength, mode != LOCK_MODIFY);
     }
     void unlock() {
-      if(!isLocked) return;
-      clf.lockLCF();
-      isLocked = false;
-      clf.removeLCFLock(localCacheFileName);
-      clf.unlockLCF();
+      clf.lockedLocalFiles.unlock(holder);
+      clf.lockedLocalFiles.unlock(fetchHolder);
     }
     ~LocalCacheFileLock() { unlock(); }
   };
+  // locks the cache file for a modification only if nobody else holds it, as the garbage collector does.
+  bool tryLockCacheFile(KeyLockTable::Holder& holder, const char *filename) {
+    const char* name = getLockName(filename);
+    return lockedLocalFiles.tryLock(holder, name, strlen(name));
+  }
+  void unlockCacheFile(KeyLockTable::Holder& holder) { lockedLocalFiles.unlock(holder); }
+  void getLockStatistics(long long* numberOfLocks, long long* numberOfWaits) { lockedLocalFiles.getStatistics(numberOfLocks, numberOfWaits); }
 
 private:
-  LocalFile dummy;
-  map<uint64_t, LocalFile>     localFH2LocalFile;
-  Mutex                        localFH2LocalFile_mutex; 
-  map<std::string, LocalFile*> localFileName2LocalFile;
-public:
-  class LFLock;
-private:
-  friend class LFLock;
-  void lockLF() {    localFH2LocalFile_mutex.lock();   }
-  void unlockLF() {  localFH2LocalFile_mutex.unlock(); }
+  // the opened cache files, which the garbage collector must not evict.
+  // It is sharded by the name, so that opens of different files rarely contend.
+  enum {
+    NUMBER_OF_OPENED_SHARDS = 16 // a power of 2
+  };
+  struct OpenedShard {
+    Mutex                    openedFiles_mutex;
+    map<string, OpenedFile*> openedFiles;
+  };
+  OpenedShard openedShards[NUMBER_OF_OPENED_SHARDS];
+  OpenedShard& getOpenedShard(const string& cachedFileName) {
+    // FNV-1a
+    unsigned int h = 2166136261u;
+    for(string::size_type i = 0; i < cachedFileName.size(); i++) {
+      h ^= (unsigned char)cachedFileName[i];
+      h *= 16777619u;
+    }
+    return openedShards[(h ^ (h >> 16)) & (NUMBER_OF_OPENED_SHARDS - 1)];
+  }
 public:
-  class LFLock : public Cache_LockedFileChecker {
-    CachedLocalFiles& clf;
-    bool isLocked;
-  public:
-    inline LFLock(CachedLocalFiles& clf) : clf(clf) { clf.lockLF(); isLocked = true; }
-    inline void unlock() { if(isLocked){ clf.unlockLF(); isLocked = false; } }
-    void setDirtyFlag(const uint64_t fh, const bool flag) {
-      map<uint64_t, LocalFile>::iterator it = clf.localFH2LocalFile.find(fh);
-      if(it == clf.localFH2LocalFile.end())
-	return;
-      it->second.isDirty = flag;
-    }
-    LocalFile& getLF(const uint64_t fh) {
-      map<uint64_t, LocalFile>::iterator it = clf.localFH2LocalFile.find(fh);
-      return it != clf.localFH2LocalFile.end() ? it->second : clf.dummy;
-    }
-    void removeLF(const uint64_t fh) {
-      map<uint64_t, LocalFile>::iterator it = clf.localFH2LocalFile.find(fh);
-      if(it == clf.localFH2LocalFile.end())
-	return;
-      const LocalFile& lh = it->second;
-      clf.localFileName2LocalFile.erase(lh.cachedFileName);
-      clf.localFH2LocalFile.erase(it);
-    }
-    virtual bool isLockedFile(const std::string& filename) const {
-      return 0 < clf.localFileName2LocalFile.count(filename);
-    }
-    void createLF(const uint64_t fh, const LocalFile& lf) {
-      LocalFile& p = clf.localFH2LocalFile[fh] = lf;
-      clf.localFileName2LocalFile[lf.cachedFileName] = &p;
-    }
-    virtual ~LFLock() {
-      unlock();
+  // joins the opened file of the name, and returns the handle to be stored in fi->fh.
+  uint64_t openLF(LocalFile* lf, const string& cachedFileName) {
+    OpenedShard& shard = getOpenedShard(cachedFileName);
+    Mutex::scoped_lock lock(shard.openedFiles_mutex);
+    OpenedFile*& openedFile = shard.openedFiles[cachedFileName];
+    if(openedFile == NULL)
+      openedFile = new OpenedFile(cachedFileName);
+    openedFile->referenceCount++;
+    lf->openedFile = openedFile;
+    return (uint64_t)(uintptr_t)lf;
+  }
+  // the files read directly from the original location share no state with the cache files
+  // of the same name, which would otherwise keep a dirty cache file from being written back.
+  uint64_t openDirectLF(LocalFile* lf) {
+    return openLF(lf, string());
+  }
+  // returns true if it was the last open of a dirty file, which should be written back and then
+  // be passed to finishWriteBack(), so that the garbage collector keeps it until then.
+  // The cache file should be locked by the caller, so that it is not opened again meanwhile.
+  bool closeLF(LocalFile* lf) {
+    OpenedFile* const openedFile = lf->openedFile;
+    delete lf;
+    OpenedShard& shard = getOpenedShard(openedFile->cachedFileName);
+    Mutex::scoped_lock lock(shard.openedFiles_mutex);
+    if(0 < --openedFile->referenceCount)
+      return false;
+    if(openedFile->isDirty()) {
+      logprintf(2, LOG_DEBUG, "'%s' was written in [%lld, %lld).\n", openedFile->cachedFileName.c_str(), openedFile->getDirtyBegin(), openedFile->getDirtyEnd());
+      return true;
     }
-  };
+    shard.openedFiles.erase(openedFile->cachedFileName);
+    delete openedFile;
+    return false;
+  }
+  void finishWriteBack(const string& cachedFileName) {
+    OpenedShard& shard = getOpenedShard(cachedFileName);
+    Mutex::scoped_lock lock(shard.openedFiles_mutex);
+    map<string, OpenedFile*>::iterator it = shard.openedFiles.find(cachedFileName);
+    // the file may have been opened again under another name of the lock, and kept by the open.
+    if(it == shard.openedFiles.end() || 0 < it->second->referenceCount)
+      return;
+    delete it->second;
+    shard.openedFiles.erase(it);
+  }
+  bool isOpened(const string& cachedFileName) {
+    OpenedShard& shard = getOpenedShard(cachedFileName);
+    Mutex::scoped_lock lock(shard.openedFiles_mutex);
+    return 0 < shard.openedFiles.count(cachedFileName);
+  }
 
-  string createCachedFileName(const char * virtualPath) const
+  // the name of the cache file, which is placed by CacheDirectories.
+  string createCacheFileHashName(const char * virtualPath) const
   {
     SHA256 sha;
     vector<unsigned char> digest;
     sha.doAll(reinterpret_cast<const unsigned char *>(virtualPath), strlen(virtualPath), digest);
     char buffer[256];
     char* p = buffer;
-    *p++ = '/';
     for(unsigned int i = 0; i < digest.size(); i++) {
       *p++ = "0123456789ABCDEF"[(digest[i] >> 4) & 0xf];
       *p++ = "0123456789ABCDEF"[ digest[i]       & 0xf];
     }
     *p = '\0';
-    return string(cacheDirectoryRoot) + buffer;
+    return buffer;
   }
 
-  void init() {
-    createCacheDir();
+  bool createCacheDir(const char* cacheRoot);
+  // returns the cache directories which are usable.
+  void init(vector<string>& cacheRoots) {
+    for(int i = 0; i < numberOfCacheDirectoryRoots; i++) {
+      if(createCacheDir(cacheDirectoryRoots[i])) {
+	cacheRoots.push_back(cacheDirectoryRoots[i]);
+      } else if(i == 0) {
+	exit(1);
+      } else {
+	fprintf(stderr, "CacheRoot '%s' is skipped.\n", cacheDirectoryRoots[i]);
+      }
+    }
   }
   CachedLocalFiles() { }
 };
 
 static CachedLocalFiles       cachedLocalFiles;
-static CacheGarbageCollection cacheGarbageCollection;
+static CacheDirectories       cacheDirectories;
+static DeferredCompression    deferredCompression;
+static CacheAdmission         cacheAdmission;
+static CachePriorityRules     cachePriorityRules;
+static CacheQueries           cacheQueries(cacheDirectories, FH_CACHE_QUERY_FIRST);
+static bool                   isSharedCacheEnabled = false;
+
+// tells the garbage collector which cache files are opened now.
+class OpenedCacheFileChecker : public Cache_LockedFileChecker {
+public:
+  virtual bool isLockedFile(const std::string& filename) const {
+    return cachedLocalFiles.isOpened(filename);
+  }
+  virtual bool tryLockFile(const std::string& filename, KeyLockTable::Holder& holder) const {
+    return cachedLocalFiles.tryLockCacheFile(holder, filename.c_str());
+  }
+  virtual void unlockFile(KeyLockTable::Holder& holder) const {
+    cachedLocalFiles.unlockCacheFile(holder);
+  }
+};
+
+static OpenedCacheFileChecker openedCacheFileChecker;
 
 //----------------------------------------------------------------------
 static inline bool isRecursiveFilePath(const char *path)
@@ -286,8 +398,8 @@ static long long getFileSize(const char *path)
 
 static string createCachedFileName(const char *path)
 {
-  const string firstCandidateForCachedLocalFileName = cachedLocalFiles.createCachedFileName(path);
-  if(cacheGarbageCollection.canUseLocalCacheNameForLocalFileCollection(firstCandidateForCachedLocalFileName, path))
+  const string firstCandidateForCachedLocalFileName = cacheDirectories.makeCacheFilePath(cachedLocalFiles.createCacheFileHashName(path));
+  if(cacheDirectories.of(firstCandidateForCachedLocalFileName).canUseLocalCacheNameForLocalFileCollection(firstCandidateForCachedLocalFileName, path))
     return firstCandidateForCachedLocalFileName;
   return "";
 }
@@ -302,7 +414,32 @@ static string createFSAttr()
     retval += buffer;
     sprintf(buffer, "loglevel=%d\n", getloglevel());
     retval += buffer;
+    sprintf(buffer, "recompressqueue=%d\n", deferredCompression.getQueueLength());
+    retval += buffer;
+    sprintf(buffer, "recompressed=%d\n", deferredCompression.getNumberOfRecompressedFiles());
+    retval += buffer;
+    sprintf(buffer, "recompressdiscarded=%d\n", deferredCompression.getNumberOfDiscardedRequests());
+    retval += buffer;
+    sprintf(buffer, "cacheadmissions=%lld\n", cacheAdmission.getNumberOfAdmissions());
+    retval += buffer;
+    sprintf(buffer, "cacherejections=%lld\n", cacheAdmission.getNumberOfRejections());
+    retval += buffer;
+    sprintf(buffer, "sharedcache=%d\n", isSharedCacheEnabled ? 1 : 0);
+    retval += buffer;
+    sprintf(buffer, "serializefsid=%d\n", SETFSID::isSerialized ? 1 : 0);
+    retval += buffer;
+    sprintf(buffer, "compressthreads=%d\n", ParallelLZO().getNumberOfThreads());
+    retval += buffer;
+    sprintf(buffer, "lzoformat=%d\n", ParallelLZO::defaultFormatVersion);
+    retval += buffer;
+    long long numberOfLocks, numberOfWaits;
+    cachedLocalFiles.getLockStatistics(&numberOfLocks, &numberOfWaits);
+    sprintf(buffer, "cachefilelocks=%lld\n", numberOfLocks);
+    retval += buffer;
+    sprintf(buffer, "cachefilelockwaits=%lld\n", numberOfWaits);
+    retval += buffer;
   }
+  retval += cacheDirectories.getStatisticsText();
   return retval;
 }
 
@@ -342,7 +479,11 @@ static int tgefs_getattr(const char *path, struct stat *stbuf)
       return 0;
     }
     if(strcmp(spath, "/tgefscache") == 0) {
-      stbuf->st_size    = cacheGarbageCollection.getSolidTextSize();
+      stbuf->st_size    = 0; // generated as it is read, like the files in /proc
+      return 0;
+    }
+    if(strcmp(spath, "/tgefspriority") == 0) {
+      stbuf->st_size    = cachePriorityRules.getText().size();
       return 0;
     }
     if(strcmp(spath, "") != 0) {
@@ -353,7 +494,7 @@ static int tgefs_getattr(const char *path, struct stat *stbuf)
     SETFSID setfsid;
     const string ccfn = createCachedFileName(path);
     if(!ccfn.empty()) {
-      CachedLocalFiles::LocalCacheFileLock lcflock(cachedLocalFiles, ccfn.c_str());
+      CachedLocalFiles::LocalCacheFileLock lcflock(cachedLocalFiles, ccfn.c_str(), CachedLocalFiles::LOCK_LOOKUP);
       const int res = lstat(path, stbuf);
       if (res == -1) return -errno;
     } else {
@@ -396,6 +537,9 @@ static int tgefs_access(const char *path, int mask)
     if(strcmp(spath, "/tgefscache") == 0) {
       return 0;
     }
+    if(strcmp(spath, "/tgefspriority") == 0) {
+      return 0;
+    }
     if(strcmp(spath, "") != 0) {
       return -ENOENT; // file not found
     }
@@ -403,7 +547,7 @@ static int tgefs_access(const char *path, int mask)
   SETFSID setfsid;
   const string ccfn = createCachedFileName(path);
   if(!ccfn.empty()) {
-    CachedLocalFiles::LocalCacheFileLock lcflock(cachedLocalFiles, ccfn.c_str());
+    CachedLocalFiles::LocalCacheFileLock lcflock(cachedLocalFiles, ccfn.c_str(), CachedLocalFiles::LOCK_LOOKUP);
     const int res = access(path, mask);
     if (res == -1) return -errno;
   } else {
@@ -437,6 +581,9 @@ static int tgefs_readlink(const char *path, char *buf, size_t size)
     if(strcmp(spath, "/tgefscache") == 0) {
       return tge_strncpy("/proc/tgefscache", buf, size);
     }
+    if(strcmp(spath, "/tgefspriority") == 0) {
+      return tge_strncpy("/proc/tgefspriority", buf, size);
+    }
     if(strcmp(spath, "") != 0) {
       return -ENOENT; // file not found
     }
@@ -464,6 +611,7 @@ static int tgefs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     if (filler(buf, "tgefs", &st, 0)) return 0;
     if (filler(buf, "tgefslog", &st, 0)) return 0;
     if (filler(buf, "tgefscache", &st, 0)) return 0;
+    if (filler(buf, "tgefspriority", &st, 0)) return 0;
     return 0;
   }
   SETFSID setfsid;
@@ -701,6 +849,10 @@ static int tgefs_truncate(const char *path, off_t size)
       if(size == 0)
 	return 0;
     }
+    if(strcmp(spath, "/tgefspriority") == 0) {
+      if(size == 0)
+	return 0;
+    }
     return -EPERM;
   }
   SETFSID setfsid;
@@ -773,18 +925,38 @@ static int getMyFilePermission(const struct stat &statBuffer)
   return   (statBuffer.st_mode & 0007);      // other
 }
 
-static bool copyFileIfUpdatedOrFirstTime(const char *srcPath, const char *destPath, bool *isSourceFileCompressed)
+// In the shared cache mode, the cache files are owned by tgefs running as root, and shared by
+// all users. A read-only open is granted by the permission of the caller against the mode,
+// uid and gid of the original file, which saves opening the original file on each open.
+// Since only the primary group is considered here, -EACCES must be confirmed by the original file.
+static int checkSharedCacheAccess(const char *path, struct stat *srcStatBuf)
+{
+  SETFSID setfsid; // the caller must be able to reach the file.
+  if(stat(path, srcStatBuf) == -1)
+    return -errno;
+  if(!S_ISREG(srcStatBuf->st_mode))
+    return -EACCES;
+  if((getMyFilePermission(*srcStatBuf) & 04) == 0)
+    return -EACCES;
+  return 0;
+}
+
+// srcStatBufPtr holds the result of stat on srcPath if the caller has already done it,
+// or receives it otherwise.
+static bool copyFileIfUpdatedOrFirstTime(const char *srcPath, const char *destPath, bool *isSourceFileCompressed, struct stat *srcStatBufPtr, const bool isSrcStatBufValid)
 {
   if(isSourceFileCompressed != NULL)
     *isSourceFileCompressed = false;
-  const bool foundSourceFile      = access(srcPath , F_OK) == 0;
-  if(!foundSourceFile) return false;
+  struct stat& srcStatBuf = *srcStatBufPtr;
+  struct stat destStatBuf;
+  if(!isSrcStatBufValid) {
+    const bool foundSourceFile = access(srcPath , F_OK) == 0;
+    if(!foundSourceFile) return false;
+    const int srcStatResult = stat(srcPath, &srcStatBuf);
+    if(srcStatResult != 0)
+      return false; // stat failed. maybe it can't be copied either.
+  }
   const bool foundDestinationFile = access(destPath, F_OK) == 0;
-
-  struct stat srcStatBuf, destStatBuf;
-  const int srcStatResult = stat(srcPath, &srcStatBuf);
-  if(srcStatResult != 0)
-    return false; // stat failed. maybe it can't be copied either.
   if(foundDestinationFile) {
     const int destStatResult = lstat(destPath, &destStatBuf); // the destination may not be a symbolic link.
     if(destStatResult == 0) {
@@ -798,13 +970,17 @@ static bool copyFileIfUpdatedOrFirstTime(const char *srcPath, const char *destPa
 	}
 	logprintf(2, LOG_DEBUG, "Successfully removed.\n");
       } else {
-	// const bool areTheSizesSame      = srcStatBuf.st_size  == destStatBuf.st_size;
-	const bool isTheLocalCacheNewer = srcStatBuf.st_mtime <= destStatBuf.st_mtime;
-	if(/*areTheSizesSame && (NOTE: file size may not necessarily be same particular if the original file is compressed)*/ isTheLocalCacheNewer) {
+	// the attributes of the original file recorded at the last open tell if the cache file is fresh.
+	// the cache files made by older versions are compared by the date, which was copied from the original file.
+	CacheFileMetadata metadata;
+	const bool hasSourceAttributes = cacheDirectories.of(destPath).findLocalFileCollection(destPath, NULL, &metadata) && metadata.source.isValid;
+	// NOTE: file size may not necessarily be same particular if the original file is compressed.
+	const bool isTheLocalCacheFresh = hasSourceAttributes ? metadata.source.matches(srcStatBuf) : srcStatBuf.st_mtime <= destStatBuf.st_mtime;
+	if(isTheLocalCacheFresh) {
 	  // no need to copy
 	  const int srcPermission  = getMyFilePermission(srcStatBuf);
 	  const int destPermission = getMyFilePermission(destStatBuf);
-	  if(srcPermission != destPermission) {
+	  if(!isSharedCacheEnabled && srcPermission != destPermission) {
 	    const int desiredPermission = srcPermission << 6;
 	    logprintf(2, LOG_DEBUG, "Chmod %s from %o to %o\n", destPath, destStatBuf.st_mode & 07777, desiredPermission);
 	    const int result = chmod(destPath, desiredPermission);
@@ -814,16 +990,24 @@ static bool copyFileIfUpdatedOrFirstTime(const char *srcPath, const char *destPa
 	    }
 	  }
 	  if(isSourceFileCompressed != NULL) {
-	    *isSourceFileCompressed = is_lzo_compressed_file(srcPath);
+	    *isSourceFileCompressed = hasSourceAttributes ? metadata.source.isCompressed : is_lzo_compressed_file(srcPath);
 	    logprintf(2, LOG_DEBUG, "Original file is %s\n", *isSourceFileCompressed ? "compressed" : "uncompressed");
 	  }
+	  cacheDirectories.of(destPath).touchCacheEntry(destPath);
 	  return true;
 	}
       }
     }
   }
   logprintf(2, LOG_DEBUG, "Copy %s to %s\n", srcPath, destPath);
-  const int desiredPermission = getMyFilePermission(srcStatBuf) << 6;
+  CacheGarbageCollection& cache = cacheDirectories.of(destPath);
+  if(!ensureCacheFileDirectory(destPath)) {
+    cache.reportFailure();
+    return false;
+  }
+  cache.waitForFreeSpace();
+  // a shared cache file is readable only by tgefs; the permission is checked on each open.
+  const int desiredPermission = isSharedCacheEnabled ? 0600 : getMyFilePermission(srcStatBuf) << 6;
   const bool useTGELock       = minimumFileSizeToEnableLock <= srcStatBuf.st_size;
   {
     TGELock lock(tgeLockdServer, tgeLockdPort);
@@ -846,10 +1030,8 @@ static bool copyFileIfUpdatedOrFirstTime(const char *srcPath, const char *destPa
       lock.unlock();
     }
   }
-  {
-    CachedLocalFiles::LFLock lock(cachedLocalFiles);
-    cacheGarbageCollection.accessedFile(getFileSize(destPath), lock);
-  }
+  cache.registerCacheEntry(destPath, fuse_get_context()->uid);
+  cache.accessedFile(getFileSize(destPath));
   const bool touchSucceeded = touchByAnotherFilesDate(destPath, srcPath);
   if(!touchSucceeded) {
     logprintf(0, LOG_ERROR, "Touch failed on processing local cache '%s' for '%s'. This may result in severe degrade in cache performance.", destPath, srcPath);
@@ -857,6 +1039,28 @@ static bool copyFileIfUpdatedOrFirstTime(const char *srcPath, const char *destPa
   return true;
 }
 
+// Files which are not admitted are read directly from the original location.
+static bool isAdmittedToCache(const char *path, const string& ccfn, const int flags)
+{
+  cacheAdmission.recordOpen(path);
+  if(PRIORITY_REFERENCE <= cachePriorityRules.classify(path))
+    return true; // reference data is worth caching at the first open.
+  if((flags & O_ACCMODE) != O_RDONLY)
+    return true; // written files must go through the cache to be compressed on write back.
+  if(access(ccfn.c_str(), F_OK) == 0)
+    return true; // already cached
+  struct stat srcStatBuf;
+  {
+    // the original file is probed as the user who opens it.
+    SETFSID setfsid;
+    if(stat(path, &srcStatBuf) != 0 || !S_ISREG(srcStatBuf.st_mode))
+      return true;
+    if(is_lzo_compressed_file(path))
+      return true; // compressed files cannot be read directly.
+  }
+  return cacheAdmission.admit(path, srcStatBuf.st_size);
+}
+
 static int tgefs_open(const char *path, struct fuse_file_info *fi)
 {
   if(isRecursiveFilePath(path))
@@ -873,6 +1077,11 @@ static int tgefs_open(const char *path, struct fuse_file_info *fi)
       return 0;
     }
     if(strcmp(spath, "/tgefscache") == 0) {
+      fi->fh        = cacheQueries.open(fuse_get_context()->uid);
+      fi->direct_io = 1; // read beyond st_size
+      return 0;
+    }
+    if(strcmp(spath, "/tgefspriority") == 0) {
       fi->fh = FH_SPECIAL_FILE;
       return 0;
     }
@@ -880,14 +1089,25 @@ static int tgefs_open(const char *path, struct fuse_file_info *fi)
       return -ENOENT;
     }
   }
+  deferredCompression.notifyActivity();
   const string ccfn = createCachedFileName(path);
   logprintf(2, LOG_DEBUG, "Open %s [%s]\n", path, ccfn.c_str());
-  {
+  struct stat srcStatBuf;
+  bool isSrcStatBufValid = false;
+  if(isSharedCacheEnabled && !ccfn.empty() && (fi->flags & O_ACCMODE) == O_RDONLY) {
+    const int res = checkSharedCacheAccess(path, &srcStatBuf);
+    if(res != 0 && res != -EACCES)
+      return res;
+    isSrcStatBufValid = res == 0;
+  }
+  if(!isSrcStatBufValid) {
     SETFSID setfsid;
     const string ccfn = createCachedFileName(path);
     int res;
     if(!ccfn.empty()) {
-      CachedLocalFiles::LocalCacheFileLock lcflock(cachedLocalFiles, ccfn.c_str());
+      // only checks the permission, which does not change the file unless it is truncated.
+      CachedLocalFiles::LocalCacheFileLock lcflock(cachedLocalFiles, ccfn.c_str(),
+						   (fi->flags & (O_ACCMODE | O_TRUNC)) == O_RDONLY ? CachedLocalFiles::LOCK_LOOKUP : CachedLocalFiles::LOCK_MODIFY);
       res = open(path, fi->flags);
     } else {
       res = open(path, fi->flags);
@@ -903,38 +1123,49 @@ static int tgefs_open(const char *path, struct fuse_file_info *fi)
       SETFSID setfsid;
       res = open(path, fi->flags);
       if (res == -1) return -errno;
-      fi->fh = res;
-      CachedLocalFiles::LFLock lock(cachedLocalFiles);
-      lock.createLF(fi->fh, LocalFile(path, ccfn, false));
+      fi->fh = cachedLocalFiles.openDirectLF(new LocalFile(res, path, false));
     }
     logprintf(1, LOG_WARNING, "Use original file, fh = %d\n", res);
+  } else if(!isAdmittedToCache(path, ccfn, fi->flags)) {
+    logprintf(2, LOG_DEBUG, "'%s' is not admitted to the cache. Read it directly.\n", path);
+    int res;
+    {
+      SETFSID setfsid;
+      res = open(path, fi->flags);
+      if (res == -1) return -errno;
+      fi->fh = cachedLocalFiles.openDirectLF(new LocalFile(res, path, false));
+    }
+    logprintf(2, LOG_DEBUG, "Use original file, fh = %d\n", res);
   } else {
-    CachedLocalFiles::LocalCacheFileLock lcflock(cachedLocalFiles, ccfn.c_str());
+    CachedLocalFiles::LocalCacheFileLock lcflock(cachedLocalFiles, ccfn.c_str(), CachedLocalFiles::LOCK_FETCH);
     bool isOriginalFileCompressed = false;
-    const bool succeeded = copyFileIfUpdatedOrFirstTime(path, ccfn.c_str(), &isOriginalFileCompressed);
+    const bool succeeded = copyFileIfUpdatedOrFirstTime(path, ccfn.c_str(), &isOriginalFileCompressed, &srcStatBuf, isSrcStatBufValid);
     if(!succeeded) {
-      logprintf(0, LOG_ERROR, "Copy failed. Fall back to direct access for '%s'\n", path);
       int res;
       { // fall back to direct access
 	SETFSID setfsid;
+	// the compressed bytes would be read as they are, so a file which cannot be decoded is an error.
+	if(isOriginalFileCompressed || is_lzo_compressed_file(path)) {
+	  logprintf(0, LOG_ERROR, "Decompression failed for '%s'.\n", path);
+	  return -EIO;
+	}
+	logprintf(0, LOG_ERROR, "Copy failed. Fall back to direct access for '%s'\n", path);
 	res = open(path, fi->flags);
 	if (res == -1) return -errno;
-	fi->fh = res;
-	CachedLocalFiles::LFLock lock(cachedLocalFiles);
-	lock.createLF(fi->fh, LocalFile(path, ccfn, false));
+	fi->fh = cachedLocalFiles.openDirectLF(new LocalFile(res, path, false));
       }
       logprintf(1, LOG_WARNING, "Use original file, fh = %d\n", res);
     } else {
       logprintf(2, LOG_DEBUG, "Cache access.\n");
+      // a file opened repeatedly may move to the faster tier before it is opened.
+      const string openedCcfn = cacheDirectories.promote(ccfn, openedCacheFileChecker);
       int res;
       { // cache access
-	res = open(ccfn.c_str(), fi->flags);
+	res = open(openedCcfn.c_str(), fi->flags);
 	if (res == -1) return -errno;
-	fi->fh = res;
-	CachedLocalFiles::LFLock lock(cachedLocalFiles);
-	lock.createLF(fi->fh, LocalFile(ccfn, ccfn, true, isOriginalFileCompressed));
+	fi->fh = cachedLocalFiles.openLF(new LocalFile(res, openedCcfn, true, isOriginalFileCompressed), openedCcfn);
       }
-      cacheGarbageCollection.appendLocalFileCollection(ccfn, path);
+      cacheDirectories.of(openedCcfn).appendLocalFileCollection(openedCcfn, path, SourceFileAttributes(srcStatBuf, isOriginalFileCompressed));
       logprintf(2, LOG_DEBUG, "Use cached file, fh = %d\n", res);
     }
   }
@@ -947,7 +1178,7 @@ static int tgefs_read(const char *path, char *buf, size_t size, off_t offset,
   if(isRecursiveFilePath(path))
     return -ENOENT;
   logprintf(3, LOG_DEBUG, "Read %s size=%ld, offset=%ld, fh=%ld\n", path, size, offset, fi->fh);
-  if(fi->fh == FH_SPECIAL_FILE) {
+  if(isSpecialFileHandle(fi->fh)) {
     const char* spath = getSpecialPath(path);
     if(strcmp(spath, "/tgefs") == 0) {
       const string fslog = createFSAttr();
@@ -972,14 +1203,24 @@ static int tgefs_read(const char *path, char *buf, size_t size, off_t offset,
       return 0;
     }
     if(strcmp(spath, "/tgefscache") == 0) {
-      const string& solidSubText = cacheGarbageCollection.getSolidText(offset, offset + size);
-      const int copiedSize = std::min<int>(size, solidSubText.size());
-      memcpy(buf, solidSubText.data(), copiedSize);
-      return copiedSize;
+      CacheQuery* query = cacheQueries.find(fi->fh);
+      if(query == NULL)
+	return -EBADF;
+      return query->read(buf, size, offset);
+    }
+    if(strcmp(spath, "/tgefspriority") == 0) {
+      const string rulesText = cachePriorityRules.getText();
+      if(offset < (off_t)rulesText.size()) {
+	const int actualLength = (off_t)rulesText.size() - offset;
+	const int readLength   = actualLength <= (int)size ? actualLength : size;
+	memcpy(buf, rulesText.data() + offset, readLength);
+	return readLength;
+      }
+      return 0;
     }
     return -EBADF;
   }
-  int res = pread(fi->fh, buf, size, offset);
+  int res = pread(getLocalFile(fi)->fd, buf, size, offset);
   if (res == -1) res = -errno;
   return res;
 }
@@ -988,7 +1229,7 @@ static int tgefs_write(const char *path, const char *buf, size_t size,
                        off_t offset, struct fuse_file_info *fi)
 {
   logprintf(3, LOG_DEBUG, "Write %s size=%ld, offset=%ld, fh=%ld\n", path, size, offset, fi->fh);
-  if(fi->fh == FH_SPECIAL_FILE) {
+  if(isSpecialFileHandle(fi->fh)) {
     const char* spath = getSpecialPath(path);
     if(strcmp(spath, "/tgefs") == 0) {
       return 0;
@@ -1004,16 +1245,40 @@ static int tgefs_write(const char *path, const char *buf, size_t size,
       return size;
     }
     if(strcmp(spath, "/tgefscache") == 0) {
-      cacheGarbageCollection.updateSolidText();
+      if(!cacheQueries.write(fi->fh, fuse_get_context()->uid, string(buf, size), offset != 0)) {
+	logprintf(0, LOG_WARNING, "Invalid cache query. It must be lines of '<path prefix>', 'prefix <path prefix>', 'state <clean|dirty|pinned|unindexed|any>', 'minsize <bytes>', 'skip <n>', 'limit <n>' or 'reset'.\n");
+	return -EINVAL;
+      }
+      return size;
+    }
+    if(strcmp(spath, "/tgefspriority") == 0) {
+      // only the user who runs tgefs (or root) can change the rules, since they affect all users.
+      const struct fuse_context *fc = fuse_get_context();
+      if(fc->uid != 0 && fc->uid != getuid())
+	return -EACCES;
+      istringstream ist(string(buf, size));
+      string line;
+      while(getline(ist, line)) {
+	if(line.empty() || line[0] == '#')
+	  continue;
+	if(!cachePriorityRules.execute(line)) {
+	  logprintf(0, LOG_WARNING, "Invalid priority rule '%s'. It must be '<pin|reference|normal|scratch|clear> <path prefix>'.\n", line.c_str());
+	  return -EINVAL;
+	}
+      }
       return size;
     }
     return -EBADF;
   }
-  int res = pwrite(fi->fh, buf, size, offset);
+  LocalFile* lf = getLocalFile(fi);
+  int res = pwrite(lf->fd, buf, size, offset);
   if (res == -1) res = -errno;
-  {
-    CachedLocalFiles::LFLock lock(cachedLocalFiles);
-    lock.setDirtyFlag(fi->fh, true);
+  if(lf->isCached) {
+    OpenedFile* const openedFile = lf->openedFile;
+    if(0 < res)
+      openedFile->addDirtyRange(offset, res);
+    if(openedFile->setDirty())
+      cacheDirectories.of(openedFile->cachedFileName).setCacheEntryDirty(openedFile->cachedFileName, true);
   }
   return res;
 }
@@ -1023,28 +1288,31 @@ static int tgefs_release(const char *path, struct fuse_file_info *fi)
   if(isRecursiveFilePath(path))
     return -ENOENT;
   logprintf(2, LOG_DEBUG, "Release %s fh=%ld\n", path, fi->fh);
-  if(fi->fh == FH_SPECIAL_FILE) {
+  if(isSpecialFileHandle(fi->fh)) {
+    if(fi->fh != FH_SPECIAL_FILE)
+      cacheQueries.close(fi->fh);
     return 0;
   }
+  deferredCompression.notifyActivity();
   {
-    close(fi->fh);
-    LocalFile lf;
-    {
-      CachedLocalFiles::LFLock lock(cachedLocalFiles);
-      lf = lock.getLF(fi->fh);
-    }
-    if(lf.isDirty) {
-      logprintf(2, LOG_DEBUG, "Dirty flag set, need to copy back. (Cached = %d)\n", lf.isCached);
-      if(lf.isCached) {
-	CachedLocalFiles::LocalCacheFileLock lcflock(cachedLocalFiles, lf.realFileName.c_str());
-	logprintf(2, LOG_DEBUG, "Copy %s to %s\n", lf.realFileName.c_str(), path);
+    LocalFile* const lf = getLocalFile(fi);
+    close(lf->fd);
+    if(!lf->isCached) {
+      cachedLocalFiles.closeLF(lf);
+    } else {
+      const string realFileName   = lf->realFileName;
+      const string cachedFileName = lf->openedFile->cachedFileName;
+      // an open of the file waits for the lock, so it does not join the file being written back.
+      CachedLocalFiles::LocalCacheFileLock lcflock(cachedLocalFiles, realFileName.c_str());
+      if(cachedLocalFiles.closeLF(lf)) {
+	logprintf(2, LOG_DEBUG, "Dirty flag set on the last release, need to copy back. Copy %s to %s\n", realFileName.c_str(), path);
 	int mode = 0600;
 	bool failedStat = false;
 	{
 	  struct stat origFileStat;
 	  const int statResult = stat(path, &origFileStat);
 	  if(statResult == -1) {
-	    logprintf(0, LOG_ERROR, "stat failed for the original file '%s', which is going to be replaced by '%s'. Using default permission (0600).\n", path, lf.realFileName.c_str());
+	    logprintf(0, LOG_ERROR, "stat failed for the original file '%s', which is going to be replaced by '%s'. Using default permission (0600).\n", path, realFileName.c_str());
 	    failedStat = true;
 	  } else {
 	    mode = origFileStat.st_mode & 0777;
@@ -1053,16 +1321,18 @@ static int tgefs_release(const char *path, struct fuse_file_info *fi)
 	}
 	struct stat cacheFileStat;
 	{
-	  const int statResult = stat(lf.realFileName.c_str(), &cacheFileStat);
+	  const int statResult = stat(realFileName.c_str(), &cacheFileStat);
 	  if(statResult == -1) {
-	    logprintf(0, LOG_ERROR, "stat failed for the cached file '%s'.\n", lf.realFileName.c_str());
+	    logprintf(0, LOG_ERROR, "stat failed for the cached file '%s'.\n", realFileName.c_str());
 	    cacheFileStat.st_size = 10 * 1024 * 1024; // 10Mbytes for temporary
 	  } else {
 	    logprintf(2, LOG_DEBUG, "The cache file size is %ld.\n", cacheFileStat.st_size);
 	  }
 	}
 	bool copySucceeded;
-	const CompressionControl::CompressionType ctype = compressionControl.getCompressionType(path);
+	bool isWrittenCompressed = false;
+	bool isCompressionDeferred;
+	const CompressionControl::CompressionType ctype = compressionControl.getCompressionType(path, &isCompressionDeferred);
 	{
 	  const bool useTGELock = minimumFileSizeToEnableLock <= cacheFileStat.st_size;
 	  TGELock tgeLock(tgeLockdServer, tgeLockdPort);
@@ -1074,12 +1344,15 @@ static int tgefs_release(const char *path, struct fuse_file_info *fi)
 	      logprintf(3, LOG_INFO,  "Locked tgelockd\n");
 	    }
 	  }
-	  switch(ctype){
+	  switch(isCompressionDeferred ? CompressionControl::Uncompressed : ctype){
 	  case CompressionControl::Uncompressed:
-	    copySucceeded = copyFile(lf.realFileName.c_str(), path, mode);
+	    copySucceeded = copyFile(realFileName.c_str(), path, mode);
 	    break;
 	  case CompressionControl::LZOx1:
-	    copySucceeded = copyFileWithCompression(lf.realFileName.c_str(), path, mode);
+	    copySucceeded = copyFileWithCompression(realFileName.c_str(), path, mode, COMPRESSION_TYPE_LZO, &isWrittenCompressed);
+	    break;
+	  case CompressionControl::LZ4:
+	    copySucceeded = copyFileWithCompression(realFileName.c_str(), path, mode, COMPRESSION_TYPE_LZ4, &isWrittenCompressed);
 	    break;
 	  default:
 	    copySucceeded = false;
@@ -1089,27 +1362,33 @@ static int tgefs_release(const char *path, struct fuse_file_info *fi)
 	  }
 	}
 	if(!copySucceeded) {
-	  logprintf(0, LOG_ERROR, "Write back copy failed. ('%s' -> '%s', mode=%o, ctype=%d)\n", lf.realFileName.c_str(), path, mode, ctype);
+	  logprintf(0, LOG_ERROR, "Write back copy failed. ('%s' -> '%s', mode=%o, ctype=%d)\n", realFileName.c_str(), path, mode, ctype);
 	  if(failedStat) {
-	    logprintf(0, LOG_ERROR, "stat failed for the original file '%s', which is going to be replaced by '%s'. Using default permission (0600).\n", path, lf.realFileName.c_str());
+	    logprintf(0, LOG_ERROR, "stat failed for the original file '%s', which is going to be replaced by '%s'. Using default permission (0600).\n", path, realFileName.c_str());
 	  }
 	} else {
 	  logprintf(2, LOG_DEBUG, "Copy succeeded\n");
-	  const bool touchSucceeded = touchByAnotherFilesDate(lf.realFileName.c_str(), path);
+	  const bool touchSucceeded = touchByAnotherFilesDate(realFileName.c_str(), path);
 	  if(!touchSucceeded) {
-	    logprintf(0, LOG_ERROR, "touch failed for write back cache file '%s' for '%s'.\n", lf.realFileName.c_str(), path);
+	    logprintf(0, LOG_ERROR, "touch failed for write back cache file '%s' for '%s'.\n", realFileName.c_str(), path);
 	  }
-	  {
-	    CachedLocalFiles::LFLock lock(cachedLocalFiles);
-	    cacheGarbageCollection.accessedFile(getFileSize(path), lock);
+	  CacheGarbageCollection& cache = cacheDirectories.of(cachedFileName);
+	  cache.updateCacheEntry(cachedFileName);
+	  cache.setCacheEntryDirty(cachedFileName, false);
+	  { // the cache file is the copy of what has been written back, which must not be fetched again.
+	    struct stat writtenStatBuf;
+	    if(stat(path, &writtenStatBuf) == 0) {
+	      cache.appendLocalFileCollection(cachedFileName, path, SourceFileAttributes(writtenStatBuf, isWrittenCompressed));
+	    }
+	  }
+	  cache.accessedFile(getFileSize(path));
+	  if(isCompressionDeferred && ctype != CompressionControl::Uncompressed) {
+	    deferredCompression.enqueue(path, ctype);
 	  }
 	}
+	cachedLocalFiles.finishWriteBack(cachedFileName);
       }
     }
-    {
-      CachedLocalFiles::LFLock lock(cachedLocalFiles);
-      lock.removeLF(fi->fh);
-    }
   }
   return 0;
 }
@@ -1127,6 +1406,8 @@ static int tgefs_statfs(const char *path, struct statvfs *stbuf)
       path = "/proc";
     } else if(strcmp(spath, "/tgefscache") == 0) {
       path = "/proc";
+    } else if(strcmp(spath, "/tgefspriority") == 0) {
+      path = "/proc";
     } else if(strcmp(spath, "") != -0) {
       return -ENOENT;
     }
@@ -1180,6 +1461,8 @@ static int tgefs_getxattr(const char *path, const char *name, char *value,
       return -ENOTSUP;
     } else if(strcmp(spath, "/tgefscache") == 0) {
       return -ENOTSUP;
+    } else if(strcmp(spath, "/tgefspriority") == 0) {
+      return -ENOTSUP;
     } else if(strcmp(spath, "") != -0) {
       return -ENOENT;
     }
@@ -1188,7 +1471,7 @@ static int tgefs_getxattr(const char *path, const char *name, char *value,
   const string ccfn = createCachedFileName(path);
   int res;
   if(!ccfn.empty()) {
-    CachedLocalFiles::LocalCacheFileLock lcflock(cachedLocalFiles, ccfn.c_str());
+    CachedLocalFiles::LocalCacheFileLock lcflock(cachedLocalFiles, ccfn.c_str(), CachedLocalFiles::LOCK_LOOKUP);
     res = lgetxattr(path, name, value, size);
   } else {
     res = lgetxattr(path, name, value, size);
@@ -1209,6 +1492,8 @@ static int tgefs_listxattr(const char *path, char *list, size_t size)
       return -ENOTSUP;
     } else if(strcmp(spath, "/tgefscache") == 0) {
       return -ENOTSUP;
+    } else if(strcmp(spath, "/tgefspriority") == 0) {
+      return -ENOTSUP;
     } else if(strcmp(spath, "") != -0) {
       return -ENOENT;
     }
@@ -1217,7 +1502,7 @@ static int tgefs_listxattr(const char *path, char *list, size_t size)
   const string ccfn = createCachedFileName(path);
   int res;
   if(!ccfn.empty()) {
-    CachedLocalFiles::LocalCacheFileLock lcflock(cachedLocalFiles, ccfn.c_str());
+    CachedLocalFiles::LocalCacheFileLock lcflock(cachedLocalFiles, ccfn.c_str(), CachedLocalFiles::LOCK_LOOKUP);
     res = llistxattr(path, list, size);
   } else {
     res = llistxattr(path, list, size);
@@ -1238,6 +1523,8 @@ static int tgefs_removexattr(const char *path, const char *name)
       return -ENOTSUP;
     } else if(strcmp(spath, "/tgefscache") == 0) {
       return -ENOTSUP;
+    } else if(strcmp(spath, "/tgefspriority") == 0) {
+      return -ENOTSUP;
     } else if(strcmp(spath, "") != -0) {
       return -ENOENT;
     }
@@ -1256,14 +1543,62 @@ static int tgefs_removexattr(const char *path, const char *name)
 }
 
 //--------------------------------------------------------------------------
-void CachedLocalFiles::createCacheDir()
+class RecompressionFileLocker : public Recompression_FileLocker {
+  CachedLocalFiles::LocalCacheFileLock* lcflock;
+public:
+  RecompressionFileLocker() : lcflock(NULL) {}
+  virtual void lockFile(const std::string& path) {
+    const string ccfn = createCachedFileName(path.c_str());
+    if(!ccfn.empty())
+      lcflock = new CachedLocalFiles::LocalCacheFileLock(cachedLocalFiles, ccfn.c_str());
+  }
+  // the cache file holds the same data, so it stays fresh if it was fresh before the recompression.
+  virtual void recompressedFile(const std::string& path, const struct stat& stBefore, const struct stat& stAfter) {
+    const string ccfn = createCachedFileName(path.c_str());
+    if(ccfn.empty())
+      return;
+    CacheGarbageCollection& cache = cacheDirectories.of(ccfn);
+    CacheFileMetadata metadata;
+    if(!cache.findLocalFileCollection(ccfn, NULL, &metadata) || !metadata.source.matches(stBefore))
+      return;
+    cache.appendLocalFileCollection(ccfn, path, SourceFileAttributes(stAfter, true));
+    logprintf(2, LOG_DEBUG, "The cache of '%s' is kept through the recompression.\n", path.c_str());
+  }
+  virtual void unlockFile(const std::string& path) {
+    delete lcflock;
+    lcflock = NULL;
+  }
+};
+
+static RecompressionFileLocker recompressionFileLocker;
+
+static void* tgefs_init(struct fuse_conn_info *conn)
+{
+  // threads must be started here because fuse_main() forks before calling this.
+  if(!cacheDirectories.startEvictionThreads(&openedCacheFileChecker)) {
+    logprintf(0, LOG_ERROR, "Could not start the cache eviction thread.\n");
+  }
+  if(!deferredCompression.start(&recompressionFileLocker)) {
+    logprintf(0, LOG_ERROR, "Could not start the deferred compression thread.\n");
+  }
+  return NULL;
+}
+
+static void tgefs_destroy(void *private_data)
+{
+  deferredCompression.stop();
+  cacheDirectories.stopEvictionThreads();
+}
+
+//--------------------------------------------------------------------------
+bool CachedLocalFiles::createCacheDir(const char* cacheRoot)
 {
   fprintf(stderr, "Checking cache directory...\n");
-  if(cacheDirectoryRoot[0] != '/') {
-    fprintf(stderr, "CacheRoot '%s' must be an absolute path\n", cacheDirectoryRoot);
-    exit(1);
+  if(cacheRoot[0] != '/') {
+    fprintf(stderr, "CacheRoot '%s' must be an absolute path\n", cacheRoot);
+    return false;
   }
-  const string dir = cacheDirectoryRoot;
+  const string dir = cacheRoot;
   int ensured_path_end = 0;
   while(ensured_path_end <= (int)dir.size()) {
     if(ensured_path_end == 0 || access(dir.substr(0, ensured_path_end).c_str(), F_OK) == 0) {
@@ -1271,8 +1606,8 @@ void CachedLocalFiles::createCacheDir()
       if(mkdir(dir.substr(0, ensured_path_end).c_str(), 0755) == 0) {
 	fprintf(stderr, "Directory '%s' is created.\n", dir.substr(0, ensured_path_end).c_str());
       } else {
-	fprintf(stderr, "CacheRoot '%s' does not exist. Abort.\n", cacheDirectoryRoot);
-	exit(1);
+	fprintf(stderr, "CacheRoot '%s' does not exist.\n", cacheRoot);
+	return false;
       }
     }
     if(ensured_path_end >= (int)dir.size())
@@ -1284,6 +1619,7 @@ void CachedLocalFiles::createCacheDir()
       ensured_path_end = nextSlashPos;
   }
   fprintf(stderr, "Done.\n");
+  return true;
 }
 
 static struct fuse_operations tgefs_oper;
@@ -1309,17 +1645,63 @@ int main(int argc, char *argv[])
     return 1;
   }
   initlog(cacheDirectoryRoot);
+  DeferredCompression::idleSecondsBeforeRecompression = recompressionIdleSeconds;
+  CacheAdmission::alwaysAdmitSizeInBytes = admissionAlwaysAdmitSize;
+  CacheAdmission::maximumSizeInBytes     = admissionMaximumSize;
+  CacheAdmission::minimumOpensToAdmit    = admissionMinimumOpens;
+  CacheDirectories::promotionMinimumOpens          = promotionMinimumOpens;
+  CacheDirectories::ramPromotionMaximumSizeInBytes = ramPromotionMaximumSize;
+  CacheGarbageCollection::defaultUserQuotaInBytes  = defaultUserQuotaInMBytes * 1024 * 1024;
+  for(map<uid_t, long long>::const_iterator cit = userQuotasInMBytes.begin(); cit != userQuotasInMBytes.end(); ++cit)
+    CacheGarbageCollection::userQuotasInBytes[cit->first] = cit->second * 1024 * 1024;
+  CacheGarbageCollection::userWeights = userWeights;
+  CacheGarbageCollection::scanThreads = max(1, cacheScanThreads);
+  ParallelLZO::defaultNumberOfThreads = max(0, compressionThreads);
+  if(ParallelLZO::isSupportedFormatVersion(lzoFormatVersion)) {
+    ParallelLZO::defaultFormatVersion = lzoFormatVersion;
+  } else {
+    logprintf(0, LOG_WARNING, "lzoformat=%d is not supported. Version %d is used.\n", lzoFormatVersion, ParallelLZO::defaultFormatVersion);
+  }
+  SETFSID::isSerialized               = isSerializedFSIDRequested;
+  if(isSharedCacheRequested) {
+    if(getuid() == 0)
+      isSharedCacheEnabled = true;
+    else
+      fprintf(stderr, "'sharedcache' is ignored since tgefs is not run as root.\n");
+  }
   {
     const int INIT_LOG_LEVEL = 0;
     loglevel(INIT_LOG_LEVEL);
   }
-  cachedLocalFiles.init();
-  cacheGarbageCollection.init(cacheDirectoryRoot, CacheGarbageCollection::AUTO, CacheGarbageCollection::AUTO);
-  logprintf(0, LOG_INFO, "Initial garbage colletion\n");
   {
-    CachedLocalFiles::LFLock lock(cachedLocalFiles);
-    cacheGarbageCollection.collect(lock);
+    vector<string> cacheRoots;
+    cachedLocalFiles.init(cacheRoots);
+    cacheDirectories.init(cacheRoots, CacheGarbageCollection::AUTO, CacheGarbageCollection::AUTO);
+    // the other tiers are optional; tgefs runs without them if they are not usable.
+    if(ramCacheDirectoryRoot[0] != '\0') {
+      if(cachedLocalFiles.createCacheDir(ramCacheDirectoryRoot)) {
+	const int ramCacheSizeInKBytes = ramCacheSizeInMBytes * 1024;
+	cacheDirectories.addCacheDirectory(ramCacheDirectoryRoot, CacheDirectories::TIER_RAM, ramCacheSizeInKBytes, ramCacheSizeInKBytes);
+      } else {
+	fprintf(stderr, "RAM cache '%s' is skipped.\n", ramCacheDirectoryRoot);
+      }
+    }
+    if(hddCacheDirectoryRoot[0] != '\0') {
+      if(cachedLocalFiles.createCacheDir(hddCacheDirectoryRoot)) {
+	cacheDirectories.addCacheDirectory(hddCacheDirectoryRoot, CacheDirectories::TIER_HDD, CacheGarbageCollection::AUTO, CacheGarbageCollection::AUTO);
+      } else {
+	fprintf(stderr, "HDD cache '%s' is skipped.\n", hddCacheDirectoryRoot);
+      }
+    }
+  }
+  if(!cacheDirectories.setEvictionPolicy(evictionPolicyName)) {
+    logprintf(0, LOG_ERROR, "Unknown eviction policy '%s'. Choose one of '%s'. Use LRU instead.\n", evictionPolicyName, getEvictionPolicyNames());
   }
+  if(isPolicySimulationEnabled)
+    cacheDirectories.enablePolicySimulation();
+  cachePriorityRules.init(cacheDirectoryRoot);
+  cacheDirectories.setPriorityClassifier(&cachePriorityRules);
+  // the cache directories are scanned and collected by the eviction threads after mounting.
   {
     int idx = 1;
     while(idx < argc && argv[idx][0] == '-')
@@ -1346,6 +1728,8 @@ int main(int argc, char *argv[])
     logprintf(0, LOG_INFO, "tgefs started at %*.*s. mount point = %s\n", timeStringLength, timeStringLength, timeString, rmp);
   }
   umask(0);
+  tgefs_oper.init	   = tgefs_init;
+  tgefs_oper.destroy	   = tgefs_destroy;
   tgefs_oper.getattr	   = tgefs_getattr;
   tgefs_oper.access	   = tgefs_access;
   tgefs_oper.readlink	   = tgefs_readlink;
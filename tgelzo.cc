@@ -21,20 +21,22 @@
 #include <string>
 #include <fcntl.h>
 #include "lzocomp.h"
+#include "lzoparallel.h"
 #include "tge_fcopy.h"
 
 using namespace std;
 
-const char COMPRESSION_TYPE_LZO = 1;
-LZO lzoObject;
-
 void printusage_tgelzo()
 {
   fprintf(stderr, "TGE-LZO file compression utility.\n"
-                  "usage: tgelzo [e|d|c] <file> [options ...]\n"
+                  "usage: tgelzo [e|d|c|t] <file> [options ...]\n"
                   "  e ... encode\n"
                   "  d ... decode\n"
-                  "  c ... decode and cat (output to stdout)\n");
+                  "  c ... decode and cat (output to stdout)\n"
+                  "  t ... test the integrity\n"
+                  "options:\n"
+                  "  -Z ... encode by LZ4, which decodes faster than LZO\n"
+                  "  -2 ... encode in the format version 2, which has checksums and an index\n");
 }
 
 void printusage_lcat()
@@ -55,7 +57,7 @@ void printusage_lzo()
                   "usage: lzo <file(s)>\n");
 }
 
-void lzo_encode(const char* infilename)
+void lzo_encode(const char* infilename, const char algorithm = COMPRESSION_TYPE_LZO)
 {
   if(access(infilename, F_OK) != 0) {
     fprintf(stderr, "%s is not found.\n", infilename);
@@ -101,7 +103,7 @@ void lzo_encode(const char* infilename)
     char buffer[16];
     const int LZO_signature_length = strlen(LZO_signature);
     memcpy(buffer    , LZO_signature        , LZO_signature_length);
-    memcpy(buffer + 7, &COMPRESSION_TYPE_LZO, sizeof(COMPRESSION_TYPE_LZO));
+    buffer[7] = lzo_compression_type(ParallelLZO::defaultFormatVersion, algorithm);
     const unsigned long long fileSize = st.st_size;
     memcpy(buffer + 8, &fileSize            , sizeof(fileSize));
 	printf("LZOsig=%d\n", LZO_signature_length);
@@ -111,7 +113,8 @@ void lzo_encode(const char* infilename)
     printf("\n");
     write(ofd, buffer, 16);
   }
-  const bool compressionSuceeded = lzoObject.compress(ifd, ofd);
+  ParallelLZO parallelLZOObject;
+  const bool compressionSuceeded = parallelLZOObject.compress(ifd, ofd, ParallelLZO::defaultFormatVersion, algorithm);
   close(ofd);
   close(ifd);
   if(compressionSuceeded) {
@@ -159,18 +162,20 @@ void lzo_decode(const char* infilename)
     close(ofd);
     exit(1);
   }
+  char compressionType;
   {
-    unsigned lzbuffer[128];
+    unsigned char lzbuffer[128];
     const int LZO_signature_length = strlen(LZO_signature);
     const int headerSize           = LZO_signature_length + sizeof(char) + sizeof(long long);
     const int readBytes            = read(ifd, lzbuffer, headerSize);
-    const bool decompressionCopy   = readBytes == LZO_signature_length && memcmp(LZO_signature, lzbuffer, LZO_signature_length) == 0;
     if(readBytes < headerSize) {
       fprintf(stderr, "read error\n");
       exit(1);
     }
+    compressionType = lzbuffer[LZO_signature_length];
   }
-  const bool decompressionSuceeded = lzoObject.decompress(ifd, ofd);
+  ParallelLZO parallelLZOObject;
+  const bool decompressionSuceeded = parallelLZOObject.decompress(ifd, ofd, lzo_format_version(compressionType), lzo_compression_algorithm(compressionType));
   close(ofd);
   close(ifd);
   if(decompressionSuceeded) {
@@ -211,7 +216,10 @@ void lzo_cat(const char* infilename)
       fprintf(stderr, "read error\n");
       return;
     }
-    lzoObject.decompress(ifd, stdoutfd);
+    ParallelLZO parallelLZOObject;
+    if(!parallelLZOObject.decompress(ifd, stdoutfd, lzo_format_version(buffer[7]), lzo_compression_algorithm(buffer[7]))) {
+      fprintf(stderr, "Error occurred during decompression of %s\n", infilename);
+    }
   } else {
     const int bufferSize = 1024 * 1024; // 1megaBytes
     char* buffer = new char[bufferSize];
@@ -223,6 +231,37 @@ void lzo_cat(const char* infilename)
   }
 }
 
+// decodes the file without writing it, which checks the checksums and the index of version 2.
+bool lzo_test(const char* infilename)
+{
+  char compressionType;
+  if(!is_lzo_compressed_file(infilename, &compressionType)) {
+    fprintf(stderr, "%s is not compressed by TGEFS-LZO\n", infilename);
+    return false;
+  }
+  const int ifd = open(infilename, O_RDONLY | O_LARGEFILE);
+  if(ifd == -1) {
+    fprintf(stderr, "Cannot open %s\n", infilename);
+    return false;
+  }
+  const int nullfd = open("/dev/null", O_WRONLY);
+  if(nullfd == -1) {
+    fprintf(stderr, "Cannot open /dev/null\n");
+    close(ifd);
+    return false;
+  }
+  bool succeeded = lseek(ifd, 16, SEEK_SET) == 16;
+  if(succeeded) {
+    ParallelLZO parallelLZOObject;
+    succeeded = parallelLZOObject.decompress(ifd, nullfd, lzo_format_version(compressionType), lzo_compression_algorithm(compressionType));
+  }
+  close(nullfd);
+  close(ifd);
+  printf("%s: %s (format version %d, %s)\n", infilename, succeeded ? "OK" : "BROKEN", lzo_format_version(compressionType),
+         lzo_compression_algorithm(compressionType) == COMPRESSION_TYPE_LZ4 ? "LZ4" : "LZO");
+  return succeeded;
+}
+
 bool isProgram(const char* argv0, const char* program_name)
 {
   const char* a_cursor = argv0;
@@ -283,11 +322,24 @@ int main(int argc, char** argv)
   const char* type = argv[1];
   const char* filename = argv[2];
   if(strcmp(type, "e") == 0) {
-    lzo_encode(filename);
+    char algorithm = COMPRESSION_TYPE_LZO;
+    for(int i = 3; i < argc; i++) {
+      if(strcmp(argv[i], "-Z") == 0) {
+	algorithm = COMPRESSION_TYPE_LZ4;
+      } else if(strcmp(argv[i], "-2") == 0) {
+	ParallelLZO::defaultFormatVersion = 2;
+      } else {
+	printusage_tgelzo();
+	return 1;
+      }
+    }
+    lzo_encode(filename, algorithm);
   } else if(strcmp(type, "d") == 0) {
     lzo_decode(filename);
   } else if(strcmp(type, "c") == 0) {
     lzo_cat(filename);
+  } else if(strcmp(type, "t") == 0) {
+    return lzo_test(filename) ? 0 : 1;
   } else {
     printusage_tgelzo();
     return 1;